@@ -0,0 +1,305 @@
+//
+//  $Id$
+//
+//  In-process alias and virtusertable expansion for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "aliasmap.h"
+#include "listdb.h"
+
+/* as sendmail's MaxAliasRecursion */
+#define MAX_ALIAS_DEPTH 10
+
+static const char *whitespace = " \t\r\n";
+
+static string trim(const string& s)
+{
+	string::size_type start = s.find_first_not_of(whitespace);
+	string::size_type end = s.find_last_not_of(whitespace);
+
+	if (start == string::npos)
+		return "";
+	return s.substr(start, end - start + 1);
+}
+
+static string lowercase(string s)
+{
+	string::size_type i;
+
+	for (i = 0; i < s.size(); i++)
+		s[i] = tolower(s[i]);
+	return s;
+}
+
+/* Read path into lines, dropping comment and blank lines.  If
+   continuations is set, a line starting with white space is joined to
+   the one before, as in the aliases file. */
+static int read_lines(struct aliasmap *map, const char *path, bool continuations,
+	vector<string>& lines, char *errbuf, size_t errlen)
+{
+	FILE *f;
+	struct stat st;
+	char buf[4096];
+	string line;
+
+	f = fopen(path, "r");
+	if (!f || fstat(fileno(f), &st) < 0)
+	{
+		snprintf(errbuf, errlen, "Could not read %s: %s", path, strerror(errno));
+		if (f)
+			fclose(f);
+		return -1;
+	}
+	map->paths.push_back(path);
+	map->mtimes.push_back(st.st_mtime);
+
+	while (fgets(buf, sizeof(buf), f))
+	{
+		line = buf;
+		/* a line longer than buf arrives in pieces */
+		while (line.size() && line[line.size() - 1] != '\n' && fgets(buf, sizeof(buf), f))
+			line += buf;
+		if (line[0] == '#' || trim(line).empty())
+			continue;
+		if (continuations && lines.size() && (line[0] == ' ' || line[0] == '\t'))
+			lines.back() += " " + trim(line);
+		else
+			lines.push_back(trim(line));
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Split the right hand side of an alias at commas outside quotes */
+static void split_targets(const string& rhs, vector<string>& targets)
+{
+	string::size_type i, start = 0;
+	bool quoted = false;
+
+	for (i = 0; i <= rhs.size(); i++)
+	{
+		if (i < rhs.size() && rhs[i] == '"')
+			quoted = !quoted;
+		else if (i == rhs.size() || (rhs[i] == ',' && !quoted))
+		{
+			string t = trim(rhs.substr(start, i - start));
+
+			if (t.size() >= 2 && t[0] == '"' && t[t.size() - 1] == '"')
+				t = t.substr(1, t.size() - 2);
+			if (t.size())
+				targets.push_back(t);
+			start = i + 1;
+		}
+	}
+}
+
+static int load_aliases(struct aliasmap *map, const char *path, char *errbuf, size_t errlen)
+{
+	vector<string> lines;
+	vector<string>::size_type i, j;
+
+	if (read_lines(map, path, true, lines, errbuf, errlen) < 0)
+		return -1;
+
+	for (i = 0; i < lines.size(); i++)
+	{
+		string::size_type colon = lines[i].find(':');
+		vector<string> targets, expanded;
+		string name;
+
+		if (colon == string::npos || colon == 0)
+		{
+			snprintf(errbuf, errlen, "%s: missing colon in \"%s\"", path, lines[i].c_str());
+			return -1;
+		}
+		name = lowercase(trim(lines[i].substr(0, colon)));
+		if (name.size() >= 2 && name[0] == '"' && name[name.size() - 1] == '"')
+			name = name.substr(1, name.size() - 2);
+		split_targets(lines[i].substr(colon + 1), targets);
+
+		/* pull in :include: lists now, so expansion never reads files */
+		for (j = 0; j < targets.size(); j++)
+		{
+			if (targets[j].compare(0, 9, ":include:") == 0)
+			{
+				string inc = trim(targets[j].substr(9));
+				vector<string> inclines;
+				vector<string>::size_type k;
+
+				if (read_lines(map, inc.c_str(), false, inclines, errbuf, errlen) < 0)
+					return -1;
+				for (k = 0; k < inclines.size(); k++)
+					split_targets(inclines[k], expanded);
+			} else
+				expanded.push_back(targets[j]);
+		}
+		map->aliases[name] = expanded;
+	}
+	return 0;
+}
+
+static int load_virtusers(struct aliasmap *map, const char *path, char *errbuf, size_t errlen)
+{
+	vector<string> lines;
+	vector<string>::size_type i;
+
+	if (read_lines(map, path, false, lines, errbuf, errlen) < 0)
+		return -1;
+
+	for (i = 0; i < lines.size(); i++)
+	{
+		string::size_type sep = lines[i].find_first_of(whitespace);
+
+		if (sep == string::npos)
+		{
+			snprintf(errbuf, errlen, "%s: no target for \"%s\"", path, lines[i].c_str());
+			return -1;
+		}
+		map->virtusers[lowercase(lines[i].substr(0, sep))] = trim(lines[i].substr(sep));
+	}
+	return 0;
+}
+
+static int load_localhosts(struct aliasmap *map, const char *path, char *errbuf, size_t errlen)
+{
+	vector<string> lines;
+	vector<string>::size_type i;
+
+	if (read_lines(map, path, false, lines, errbuf, errlen) < 0)
+		return -1;
+	for (i = 0; i < lines.size(); i++)
+		map->localdomains.insert(lowercase(lines[i]));
+	return 0;
+}
+
+/* Load the files that are named (any may be NULL).  Returns NULL with
+   a message in errbuf if one can't be read or parsed. */
+struct aliasmap *aliasmap_load(const char *aliases, const char *virtusers,
+	const char *localhosts, char *errbuf, size_t errlen)
+{
+	struct aliasmap *map = new aliasmap;
+
+	if ((aliases && load_aliases(map, aliases, errbuf, errlen) < 0) ||
+	    (virtusers && load_virtusers(map, virtusers, errbuf, errlen) < 0) ||
+	    (localhosts && load_localhosts(map, localhosts, errbuf, errlen) < 0))
+	{
+		delete map;
+		return NULL;
+	}
+	return map;
+}
+
+/* Has any file the map was loaded from changed since? */
+bool aliasmap_changed(const struct aliasmap *map)
+{
+	struct stat st;
+	vector<string>::size_type i;
+
+	for (i = 0; i < map->paths.size(); i++)
+	{
+		if (stat(map->paths[i].c_str(), &st) < 0 || st.st_mtime != map->mtimes[i])
+			return true;
+	}
+	return false;
+}
+
+static void expand(const struct aliasmap *map, const string& rcpt, int depth,
+	unordered_set<string>& seen, list<string>& expanded)
+{
+	string addr = normalize_address(rcpt.c_str());
+	string::size_type at = addr.rfind('@');
+	unordered_map<string, vector<string> >::const_iterator a;
+	vector<string>::size_type i;
+
+	if (depth > MAX_ALIAS_DEPTH)
+	{
+		expanded.push_back(addr);
+		return;
+	}
+
+	if (at != string::npos)
+	{
+		string user = addr.substr(0, at), domain = addr.substr(at + 1);
+		unordered_map<string, string>::const_iterator v;
+
+		/* virtusertable: the address, then the whole domain */
+		v = map->virtusers.find(addr);
+		if (v == map->virtusers.end())
+			v = map->virtusers.find("@" + domain);
+		if (v != map->virtusers.end())
+		{
+			string target = v->second;
+			string::size_type pct;
+
+			/* error:nouser and the like deliver nowhere */
+			if (lowercase(target).compare(0, 6, "error:") == 0)
+				return;
+			while ((pct = target.find("%1")) != string::npos)
+				target.replace(pct, 2, user);
+			expand(map, target, depth + 1, seen, expanded);
+			return;
+		}
+		if (!map->localdomains.count(domain))
+		{
+			expanded.push_back(addr);
+			return;
+		}
+		addr = user;
+	}
+
+	/* a local name: an alias that refers to itself, directly or not,
+	   delivers to the name */
+	a = map->aliases.find(addr);
+	if (a == map->aliases.end() || seen.count(addr))
+	{
+		expanded.push_back(addr);
+		return;
+	}
+	seen.insert(addr);
+	for (i = 0; i < a->second.size(); i++)
+	{
+		const string& target = a->second[i];
+
+		if (target[0] == '\\')
+			expanded.push_back(lowercase(target.substr(1)));	// no further aliasing
+		else if (target[0] == '|' || target[0] == '/')
+			expanded.push_back(target);	// program or file
+		else
+			expand(map, target, depth + 1, seen, expanded);
+	}
+	seen.erase(addr);
+}
+
+/* Append the addresses rcpt is delivered to, in the form sendmail -bv
+   reports them: local users as a bare name, others in full */
+void aliasmap_expand(const struct aliasmap *map, const string& rcpt, list<string>& expanded)
+{
+	unordered_set<string> seen;
+
+	expand(map, rcpt, 0, seen, expanded);
+}
+
+// vim6:ai:noexpandtab
@@ -0,0 +1,57 @@
+//-*-c++-*-
+//
+//  $Id$
+//
+//  In-process alias and virtusertable expansion for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _ALIASMAP_H
+#define _ALIASMAP_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+//
+// The text sources of sendmail's aliases, virtusertable and
+// local-host-names, loaded into hash tables so that -x expansion needs
+// no sendmail -bv.  A loaded map is never modified; a newer one is
+// loaded when one of its files changes.
+//
+
+struct aliasmap
+{
+	unordered_map<string, vector<string> > aliases;	// local name -> targets
+	unordered_map<string, string> virtusers;	// user@domain or @domain -> target
+	unordered_set<string> localdomains;		// domains the aliases apply to
+
+	// every file read, :include:s too, and when it was last changed
+	vector<string> paths;
+	vector<time_t> mtimes;
+};
+
+struct aliasmap *aliasmap_load(const char *aliases, const char *virtusers,
+	const char *localhosts, char *errbuf, size_t errlen);
+bool aliasmap_changed(const struct aliasmap *map);
+void aliasmap_expand(const struct aliasmap *map, const string& rcpt, list<string>& expanded);
+
+#endif
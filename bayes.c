@@ -0,0 +1,233 @@
+/*
+ * Naive Bayes word statistics for the -y pre-classifier.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+/* $Id$ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bayes.h"
+
+#define FNV_OFFSET	0x811c9dc5U
+#define FNV_PRIME	0x01000193U
+
+/* messages learnt as spam [0] and ham [1], and the number of each that
+   each bucket's words appeared in.  Once BAYES_MAXLEARNT of one kind have
+   been learnt every count is halved, so no count can overflow and recent
+   mail weighs more than old. */
+static unsigned long learnt[2];
+static uint16_t counts[BAYES_BUCKETS][2];
+static pthread_mutex_t bayes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_string(uint32_t h, const char *s)
+{
+	for (; *s; s++)
+	{
+		unsigned char c = *s;
+
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		h = (h ^ c) * FNV_PRIME;
+	}
+	return h;
+}
+
+static int cmp_token(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sort the words and drop repeats: a message counts once for each word
+   in it, however often it is used */
+static void compact(struct bayes_tokens *bt)
+{
+	unsigned int i, n = 0;
+
+	if (bt->sorted)
+		return;
+	qsort(bt->tokens, bt->ntokens, sizeof(bt->tokens[0]), cmp_token);
+	for (i = 0; i < bt->ntokens; i++)
+		if (n == 0 || bt->tokens[i] != bt->tokens[n - 1])
+			bt->tokens[n++] = bt->tokens[i];
+	bt->ntokens = n;
+	bt->sorted = 1;
+}
+
+static void end_word(struct bayes_tokens *bt)
+{
+	if (bt->len >= BAYES_MINLEN && bt->len <= BAYES_MAXLEN)
+	{
+		if (bt->ntokens == BAYES_MAXTOKENS)
+			compact(bt);
+		if (bt->ntokens < BAYES_MAXTOKENS)
+		{
+			bt->tokens[bt->ntokens++] = bt->word & (BAYES_BUCKETS - 1);
+			bt->sorted = 0;
+		}
+	}
+	bt->len = 0;
+}
+
+void bayes_init(struct bayes_tokens *bt)
+{
+	bt->ntokens = 0;
+	bt->sorted = 1;
+	bt->seed = FNV_OFFSET;
+	bt->len = 0;
+}
+
+/* The text that follows is the value of header field name, or the body
+   if name is NULL; the same word counts separately in each */
+void bayes_field(struct bayes_tokens *bt, const char *name)
+{
+	if (bt->len)
+		end_word(bt);
+	bt->seed = FNV_OFFSET;
+	if (name)
+		bt->seed = hash_string(hash_string(bt->seed, name), ":");
+}
+
+/* Feed more text.  Words are runs of letters and digits (and any non-ASCII
+   bytes), compared without regard to case, as for the -N fingerprint. */
+void bayes_update(struct bayes_tokens *bt, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = p[i];
+
+		if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80)
+			;
+		else if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		else
+		{
+			if (bt->len)
+				end_word(bt);
+			continue;
+		}
+		if (!bt->len)
+			bt->word = bt->seed;
+		bt->word = (bt->word ^ c) * FNV_PRIME;
+		bt->len++;
+	}
+}
+
+/* Count the words of a message spamd has judged spam (1) or ham (0) */
+void bayes_learn(struct bayes_tokens *bt, int spam)
+{
+	int k = spam ? 0 : 1;
+	unsigned int i;
+
+	if (bt->len)
+		end_word(bt);
+	compact(bt);
+	pthread_mutex_lock(&bayes_mutex);
+	if (learnt[k] == BAYES_MAXLEARNT)
+	{
+		learnt[0] /= 2;
+		learnt[1] /= 2;
+		for (i = 0; i < BAYES_BUCKETS; i++)
+		{
+			counts[i][0] /= 2;
+			counts[i][1] /= 2;
+		}
+	}
+	learnt[k]++;
+	for (i = 0; i < bt->ntokens; i++)
+		counts[bt->tokens[i]][k]++;
+	pthread_mutex_unlock(&bayes_mutex);
+}
+
+static int cmp_strength(const void *a, const void *b)
+{
+	double x = fabs(*(const double *)a - 0.5), y = fabs(*(const double *)b - 0.5);
+
+	return x > y ? -1 : x < y;
+}
+
+/* The chance of a chi-square of at least x2 with 2 * n degrees of freedom */
+static double chi2q(double x2, unsigned int n)
+{
+	double m = x2 / 2, term, sum;
+	unsigned int i;
+
+	term = sum = exp(-m);
+	for (i = 1; i < n; i++)
+	{
+		term *= m / i;
+		sum += term;
+	}
+	return sum < 1 ? sum : 1;
+}
+
+/* How spammy a message is, going by its words, from 0 to 1.  Each word
+   seen before gets a spam probability, pulled towards 1/2 the fewer times
+   it has been seen (Robinson); only the BAYES_SIGNIFICANT furthest from
+   1/2 are combined, Fisher's way, into how unlikely they are to have come
+   by chance from ham and from spam.  A message that looks like neither,
+   or like both, gets 1/2, so it takes a run of clearly hammy words for
+   the result to come near 0.  Returns -1 until enough of both kinds have
+   been learnt. */
+double bayes_classify(struct bayes_tokens *bt)
+{
+	double f[BAYES_MAXTOKENS], ns, nh, ln_f = 0, ln_1f = 0, s, h;
+	unsigned int i, n = 0;
+
+	if (bt->len)
+		end_word(bt);
+	compact(bt);
+	pthread_mutex_lock(&bayes_mutex);
+	if (learnt[0] < BAYES_MINTRAIN || learnt[1] < BAYES_MINTRAIN)
+	{
+		pthread_mutex_unlock(&bayes_mutex);
+		return -1;
+	}
+	ns = learnt[0];
+	nh = learnt[1];
+	for (i = 0; i < bt->ntokens; i++)
+	{
+		const uint16_t *c = counts[bt->tokens[i]];
+		double ps, pw;
+
+		if (c[0] == 0 && c[1] == 0)
+			continue;
+		ps = c[0] / ns;
+		pw = ps / (ps + c[1] / nh);
+		/* a prior of 1/2 that weighs as much as one message */
+		f[n++] = (0.5 + (c[0] + c[1]) * pw) / (1 + c[0] + c[1]);
+	}
+	pthread_mutex_unlock(&bayes_mutex);
+
+	if (n == 0)
+		return 0.5;
+	qsort(f, n, sizeof(f[0]), cmp_strength);
+	if (n > BAYES_SIGNIFICANT)
+		n = BAYES_SIGNIFICANT;
+	for (i = 0; i < n; i++)
+	{
+		ln_f += log(f[i]);
+		ln_1f += log(1 - f[i]);
+	}
+	/* near 1 if the words are too spammy, or too hammy, to be chance */
+	s = 1 - chi2q(-2 * ln_1f, n);
+	h = 1 - chi2q(-2 * ln_f, n);
+	return (1 + s - h) / 2;
+}
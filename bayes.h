@@ -0,0 +1,43 @@
+#ifndef _BAYES_H
+#define _BAYES_H
+
+/* $Id$ */
+
+/* A naive Bayes classifier for the -y pre-classifier: messages are
+   reduced to the set of words in their Subject:, From: and text, each
+   hashed into a fixed table of per-word spam and ham counts that is
+   trained on spamd's verdicts.  The table is shared by all threads. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BAYES_BUCKETS	(1 << 20)	/* word counts kept, a power of 2 */
+#define BAYES_MAXTOKENS	1000	/* distinct words a message is read for ... */
+#define BAYES_SIGNIFICANT	150	/* ... and those of them it is judged on */
+#define BAYES_MINLEN	3	/* shorter words are ignored ... */
+#define BAYES_MAXLEN	24	/* ... and so are longer ones */
+#define BAYES_MINTRAIN	200	/* messages of each kind learnt before any is judged */
+#define BAYES_MAXLEARNT	60000	/* ... and after which the counts are halved */
+
+struct bayes_tokens {
+  uint32_t tokens[BAYES_MAXTOKENS];	/* buckets of the words seen */
+  unsigned int ntokens;
+  int sorted;			/* tokens are sorted and distinct */
+  uint32_t seed;		/* hash of the field the text comes from */
+  uint32_t word;		/* hash of the word being read */
+  unsigned int len;		/* its length so far */
+};
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+void bayes_init(struct bayes_tokens *bt);
+void bayes_field(struct bayes_tokens *bt, const char *name);
+void bayes_update(struct bayes_tokens *bt, const void *data, size_t len);
+void bayes_learn(struct bayes_tokens *bt, int spam);
+double bayes_classify(struct bayes_tokens *bt);
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
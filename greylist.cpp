@@ -0,0 +1,298 @@
+//
+//  $Id$
+//
+//  Greylisting for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "greylist.h"
+
+struct greyshard
+{
+	pthread_mutex_t mutex;
+	unordered_map<string, struct greyentry> entries;
+};
+
+static struct greyshard shards[GREYLIST_SHARDS];
+static long grey_delay;		/* seconds a new triplet is deferred */
+static long grey_lifetime;	/* seconds one that got through is kept unused */
+static const char *grey_path;	/* snapshot file, or NULL */
+
+static struct greyshard *shard_for(const string& key)
+{
+	return &shards[hash<string>()(key) % GREYLIST_SHARDS];
+}
+
+/* An address as it is compared: without <>, in lower case */
+static string normalize(const char *addr)
+{
+	string s;
+
+	for (; *addr; addr++)
+		if (*addr != '<' && *addr != '>' && !isspace((unsigned char)*addr))
+			s += tolower((unsigned char)*addr);
+	return s;
+}
+
+/* The network an address greylists as, so that a retry from another
+   host of the same mail farm counts */
+static string network(const char *ip)
+{
+	unsigned char addr[16];
+	char buf[INET6_ADDRSTRLEN];
+
+	if (inet_pton(AF_INET, ip, addr) == 1)
+	{
+		addr[3] = 0;
+		inet_ntop(AF_INET, addr, buf, sizeof(buf));
+		return string(buf) + "/24";
+	}
+	if (inet_pton(AF_INET6, ip, addr) == 1)
+	{
+		memset(addr + 8, 0, 8);
+		inet_ntop(AF_INET6, addr, buf, sizeof(buf));
+		return string(buf) + "/64";
+	}
+	return ip;
+}
+
+static bool expired(const struct greyentry& e, time_t now)
+{
+	if (e.passed)
+		return now - e.last > grey_lifetime;
+	return now - e.first > GREYLIST_WINDOW;
+}
+
+/* Read the triplets saved by an earlier run, if there are any */
+static int load(char *errbuf, size_t errlen)
+{
+	FILE *f;
+	char buf[4096];
+	time_t now = time(NULL);
+
+	f = fopen(grey_path, "r");
+	if (!f)
+	{
+		if (errno == ENOENT)
+			return 0;
+		snprintf(errbuf, errlen, "Could not read %s: %s", grey_path, strerror(errno));
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), f))
+	{
+		struct greyentry e;
+		long first, passed, last;
+		char *key = strchr(buf, '\t');
+
+		/* long lines and damage are not worth stopping for */
+		if (!key || sscanf(buf, "%ld %ld %ld", &first, &passed, &last) != 3 ||
+		    buf[strlen(buf) - 1] != '\n')
+			continue;
+		buf[strlen(buf) - 1] = '\0';
+		e.first = first;
+		e.passed = passed;
+		e.last = last;
+		if (!expired(e, now))
+			shard_for(key + 1)->entries[key + 1] = e;
+	}
+	fclose(f);
+	return 0;
+}
+
+/* Set the greylist up, with the triplets in path if it is given and
+   exists */
+int greylist_init(long delay, long lifetime, const char *path, char *errbuf, size_t errlen)
+{
+	int i;
+
+	for (i = 0; i < GREYLIST_SHARDS; i++)
+		if (pthread_mutex_init(&shards[i].mutex, NULL))
+		{
+			snprintf(errbuf, errlen, "Could not set up the greylist: %s", strerror(errno));
+			return -1;
+		}
+	grey_delay = delay;
+	grey_lifetime = lifetime;
+	grey_path = path;
+	return path ? load(errbuf, errlen) : 0;
+}
+
+/* s is full: drop an eighth of the triplets that have not got through,
+   the oldest first.  Returns false if there were none to drop. */
+static bool make_room(struct greyshard *s)
+{
+	unordered_map<string, struct greyentry>::iterator it;
+	vector<time_t> firsts;
+	vector<time_t>::size_type n, i, tie;
+	time_t cutoff;
+
+	for (it = s->entries.begin(); it != s->entries.end(); ++it)
+		if (!it->second.passed)
+			firsts.push_back(it->second.first);
+	if (firsts.empty())
+		return false;
+	n = firsts.size() / 8 + 1;
+	nth_element(firsts.begin(), firsts.begin() + n - 1, firsts.end());
+	cutoff = firsts[n - 1];
+	/* of those first seen in the same second as the cutoff, only as
+	   many go as make up the eighth */
+	for (i = 0, tie = n; i < n; i++)
+		if (firsts[i] < cutoff)
+			tie--;
+	for (it = s->entries.begin(); it != s->entries.end(); )
+	{
+		if (!it->second.passed && (it->second.first < cutoff ||
+		    (it->second.first == cutoff && tie && tie--)))
+			it = s->entries.erase(it);
+		else
+			++it;
+	}
+	return true;
+}
+
+/* May mail from ip, sender to rcpt go through now?  If not, *wait says
+   how many seconds until it may. */
+bool greylist_check(const char *ip, const char *sender, const char *rcpt, long *wait)
+{
+	string key = network(ip) + "\t" + normalize(sender) + "\t" + normalize(rcpt);
+	struct greyshard *s = shard_for(key);
+	unordered_map<string, struct greyentry>::iterator it;
+	time_t now = time(NULL);
+	bool pass = false;
+
+	pthread_mutex_lock(&s->mutex);
+	it = s->entries.find(key);
+	if (it == s->entries.end() && s->entries.size() >= GREYLIST_MAXENTRIES &&
+	    !make_room(s))
+	{
+		pthread_mutex_unlock(&s->mutex);
+		return true;
+	}
+	if (it == s->entries.end() || expired(it->second, now))
+	{
+		struct greyentry& e = s->entries[key];
+
+		e.first = now;
+		e.passed = 0;
+		e.last = now;
+		*wait = grey_delay;
+	} else
+	{
+		struct greyentry& e = it->second;
+
+		e.last = now;
+		if (e.passed || now - e.first >= grey_delay)
+		{
+			if (!e.passed)
+				e.passed = now;
+			pass = true;
+		} else
+			*wait = grey_delay - (now - e.first);
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return pass;
+}
+
+/* Forget triplets that never retried in time, and those that got through
+   but haven't been seen for the lifetime */
+void greylist_expire()
+{
+	unordered_map<string, struct greyentry>::iterator it;
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < GREYLIST_SHARDS; i++)
+	{
+		pthread_mutex_lock(&shards[i].mutex);
+		for (it = shards[i].entries.begin(); it != shards[i].entries.end(); )
+		{
+			if (expired(it->second, now))
+				it = shards[i].entries.erase(it);
+			else
+				++it;
+		}
+		pthread_mutex_unlock(&shards[i].mutex);
+	}
+}
+
+/* Write the triplets to the file, replacing it whole so that a crash
+   never leaves half of one */
+int greylist_save(char *errbuf, size_t errlen)
+{
+	unordered_map<string, struct greyentry>::iterator it;
+	string tmppath, data;
+	char buf[64];
+	FILE *f;
+	int i;
+
+	if (!grey_path)
+		return 0;
+	for (i = 0; i < GREYLIST_SHARDS; i++)
+	{
+		pthread_mutex_lock(&shards[i].mutex);
+		for (it = shards[i].entries.begin(); it != shards[i].entries.end(); ++it)
+		{
+			snprintf(buf, sizeof(buf), "%ld %ld %ld\t", (long)it->second.first,
+				(long)it->second.passed, (long)it->second.last);
+			data += buf + it->first + "\n";
+		}
+		pthread_mutex_unlock(&shards[i].mutex);
+	}
+
+	tmppath = string(grey_path) + ".tmp";
+	f = fopen(tmppath.c_str(), "w");
+	if (!f)
+	{
+		snprintf(errbuf, errlen, "Could not create %s: %s", tmppath.c_str(), strerror(errno));
+		return -1;
+	}
+	fwrite(data.data(), 1, data.size(), f);
+	/* on disk before the rename, or a crash could leave an empty file
+	   in place of the old one */
+	if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+	{
+		snprintf(errbuf, errlen, "Could not write %s: %s", tmppath.c_str(), strerror(errno));
+		fclose(f);
+		unlink(tmppath.c_str());
+		return -1;
+	}
+	if (ferror(f) | fclose(f) || rename(tmppath.c_str(), grey_path) < 0)
+	{
+		snprintf(errbuf, errlen, "Could not write %s: %s", grey_path, strerror(errno));
+		unlink(tmppath.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+// vim6:ai:noexpandtab
@@ -0,0 +1,66 @@
+//-*-c++-*-
+//
+//  $Id$
+//
+//  Greylisting for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _GREYLIST_H
+#define _GREYLIST_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <string>
+
+using namespace std;
+
+//
+// The -w greylist: the first time a triplet of sending network (/24 or
+// /64), envelope sender and recipient is seen, the recipient is deferred;
+// a retry after the delay, and everything after that, gets through.
+// Most spamware never retries.  The triplets are kept in a hash table
+// split into shards, each with its own lock, and can be written to a
+// file every GREYLIST_SAVE seconds so that a restart doesn't greylist
+// every correspondent again.
+//
+// The file is text, a triplet per line: when it was first seen, when it
+// got through (0 if it hasn't), when it was last seen, and the network,
+// sender and recipient, all separated by tabs.
+//
+// A shard holds at most GREYLIST_MAXENTRIES triplets.  A flood of new
+// ones makes room by dropping the oldest that have not got through, an
+// eighth of them at a time; if every triplet in the shard has got
+// through, new ones are let through rather than deferred for good.
+//
+
+struct greyentry
+{
+	time_t first;
+	time_t passed;
+	time_t last;
+};
+
+#define GREYLIST_SHARDS 16
+#define GREYLIST_MAXENTRIES 65536	/* triplets per shard */
+#define GREYLIST_WINDOW (2 * 24 * 3600)	/* a deferred triplet must retry within this */
+#define GREYLIST_SAVE 300		/* seconds between snapshots */
+
+int greylist_init(long delay, long lifetime, const char *path, char *errbuf, size_t errlen);
+bool greylist_check(const char *ip, const char *sender, const char *rcpt, long *wait);
+void greylist_expire();
+int greylist_save(char *errbuf, size_t errlen);
+
+#endif
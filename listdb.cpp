@@ -0,0 +1,676 @@
+//
+//  $Id$
+//
+//  Compiled list files for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if !HAVE_DECL_STRSEP
+extern "C" char *strsep(char **stringp, const char *delim);
+#endif
+
+#include "listdb.h"
+
+// {{{ Parsing helpers shared with the milter
+
+/* Reduce an address to the form stored in a list: no angle brackets, no
+   trailing dot, all lower case. */
+string normalize_address(const char *addr)
+{
+	string norm(addr);
+	string::size_type i;
+
+	if (norm.size() && norm[0] == '<')
+		norm.erase(0, 1);
+	if (norm.size() && norm[norm.size() - 1] == '>')
+		norm.erase(norm.size() - 1);
+	if (norm.size() && norm[norm.size() - 1] == '.')
+		norm.erase(norm.size() - 1);
+	for (i = 0; i < norm.size(); i++)
+		norm[i] = tolower(norm[i]);
+	return norm;
+}
+
+/* 64-bit FNV-1a */
+uint64_t listdb_hash(const char *key, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (len--)
+	{
+		hash ^= (uint8_t)*key++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Zero the host part of a bits-long prefix */
+static void netmask_key(uint8_t *key, int len, int bits)
+{
+	int i;
+
+	for (i = 0; i < len; i++, bits -= 8)
+	{
+		if (bits <= 0)
+			key[i] = 0;
+		else if (bits < 8)
+			key[i] &= ~((1 << (8 - bits)) - 1);
+	}
+}
+
+/*
+   Parse one network list element: an address, address/bits or (IPv4
+   only) address/netmask, optionally preceded by ! to make it an
+   exclusion.  token is modified.  Returns 0, or -1 with a message in
+   errbuf.
+*/
+int parse_netentry(char *token, struct netentry *net, char *errbuf, size_t errlen)
+{
+	char *tnet, *tmask;
+
+	net->action = NET_MATCH;
+	if (*token == '!')
+	{
+		net->action = NET_EXCLUDE;
+		token++;
+	}
+
+	tnet = strsep(&token, "/");
+	tmask = token;
+	memset(net->key, 0, sizeof(net->key));
+
+	if (inet_pton(AF_INET, tnet, net->key))
+	{
+		net->af = AF_INET;
+		if (tmask)
+		{
+			if (strchr(tmask, '.') == NULL)
+			{
+				/* CIDR */
+				unsigned int ubits;
+				if (sscanf(tmask, "%u", &ubits) != 1 || ubits > 32)
+				{
+					snprintf(errbuf, errlen, "%s: bad CIDR value", tmask);
+					return -1;
+				}
+				net->bits = ubits;
+			} else
+			{
+				struct in_addr mask;
+				uint32_t m;
+
+				if (!inet_pton(AF_INET, tmask, &mask))
+				{
+					snprintf(errbuf, errlen, "Could not parse \"%s\" as a netmask", tmask);
+					return -1;
+				}
+				/* the lookup structures need a contiguous mask */
+				m = ntohl(mask.s_addr);
+				for (net->bits = 0; net->bits < 32 && (m & 0x80000000); net->bits++)
+					m <<= 1;
+				if (m)
+				{
+					snprintf(errbuf, errlen, "Netmask \"%s\" is not contiguous", tmask);
+					return -1;
+				}
+			}
+		} else
+			net->bits = 32;
+		netmask_key(net->key, 4, net->bits);
+	} else if (inet_pton(AF_INET6, tnet, net->key))
+	{
+		net->af = AF_INET6;
+		if (tmask)
+		{
+			if (sscanf(tmask, "%d", &net->bits) != 1 || net->bits < 0 || net->bits > 128)
+			{
+				snprintf(errbuf, errlen, "%s: bad CIDR value", tmask);
+				return -1;
+			}
+		} else
+			net->bits = 128;
+		netmask_key(net->key, 16, net->bits);
+	} else
+	{
+		snprintf(errbuf, errlen, "Could not parse \"%s\" as a network", tnet);
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse a domain name, as -U lists them, into the form it is stored
+   in: lower case, without a trailing dot.  Returns -1 if token is not
+   one, such as a mistyped IPv4 address. */
+int parse_domain(const char *token, string& domain)
+{
+	string::size_type dot;
+	const char *p;
+
+	domain.clear();
+	for (p = token; *p; p++)
+	{
+		if (!isalnum((unsigned char)*p) && *p != '.' && *p != '-' && *p != '_')
+			return -1;
+		domain += tolower((unsigned char)*p);
+	}
+	if (domain.size() && domain[domain.size() - 1] == '.')
+		domain.erase(domain.size() - 1);
+	dot = domain.rfind('.');
+	if (dot == string::npos || dot == 0 ||
+	    domain.find_first_not_of("0123456789", dot + 1) == string::npos)
+		return -1;
+	return 0;
+}
+
+/* Parse a SHA-256 digest written as 64 hex digits into its bytes.
+   Returns -1 if token is anything else. */
+int parse_digest(const char *token, string& digest)
+{
+	int i;
+
+	if (strlen(token) != LISTDB_DIGESTLEN * 2)
+		return -1;
+	digest.resize(LISTDB_DIGESTLEN);
+	for (i = 0; i < LISTDB_DIGESTLEN * 2; i++)
+	{
+		int c = tolower((unsigned char)token[i]);
+		int v;
+
+		if (c >= '0' && c <= '9')
+			v = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v = c - 'a' + 10;
+		else
+			return -1;
+		if (i & 1)
+			digest[i / 2] = (char)((digest[i / 2] & 0xf0) | v);
+		else
+			digest[i / 2] = (char)(v << 4);
+	}
+	return 0;
+}
+
+// }}}
+
+// {{{ Reading
+
+/* Is path a compiled list (as opposed to a text one)? */
+int listdb_probe(const char *path)
+{
+	char magic[sizeof(((struct listdb_header *)0)->magic)];
+	int fd, ok;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ok = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+		memcmp(magic, LISTDB_MAGIC, sizeof(LISTDB_MAGIC)) == 0;
+	close(fd);
+	return ok;
+}
+
+/* Does a section of count records of size bytes lie within the file? */
+static bool section_ok(const struct listdb_section *sect, size_t size, size_t filesize)
+{
+	if (sect->offset > filesize)
+		return false;
+	if (sect->count > (filesize - sect->offset) / size)
+		return false;
+	return true;
+}
+
+/* Map a compiled list.  Returns NULL with a message in errbuf if it
+   can't be read or isn't one we understand. */
+struct listdb *listdb_open(const char *path, char *errbuf, size_t errlen)
+{
+	struct listdb *db;
+	struct stat st;
+	const struct listdb_header *h;
+	size_t hsize;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		snprintf(errbuf, errlen, "Could not open %s: %s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	/* a version 1 header stops short of the digests */
+	if ((size_t)st.st_size < offsetof(struct listdb_header, digests))
+	{
+		snprintf(errbuf, errlen, "%s is too short to be a compiled list", path);
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		snprintf(errbuf, errlen, "Could not map %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	h = (const struct listdb_header *)base;
+	hsize = h->version == 1 ? offsetof(struct listdb_header, digests) : sizeof(*h);
+	if (memcmp(h->magic, LISTDB_MAGIC, sizeof(LISTDB_MAGIC)) != 0 ||
+	    (h->version != 1 && h->version != LISTDB_VERSION))
+		snprintf(errbuf, errlen, "%s is not a version %d compiled list", path, LISTDB_VERSION);
+	else if (h->byteorder != LISTDB_BYTEORDER)
+		snprintf(errbuf, errlen, "%s was compiled on a machine with a different byte order", path);
+	else if (!section_ok(&h->net4, sizeof(struct listdb_range), st.st_size) ||
+	         !section_ok(&h->net6, sizeof(struct listdb_range), st.st_size) ||
+	         !section_ok(&h->slots, sizeof(struct listdb_slot), st.st_size) ||
+	         !section_ok(&h->strings, 1, st.st_size) ||
+	         (size_t)st.st_size < hsize ||
+	         (h->version > 1 && !section_ok(&h->digests, LISTDB_DIGESTLEN, st.st_size)) ||
+	         (h->slots.count & (h->slots.count - 1)) != 0 ||
+	         (h->strings.count && ((const char *)base)[h->strings.offset + h->strings.count - 1]))
+		snprintf(errbuf, errlen, "%s is damaged", path);
+	else
+	{
+		db = new listdb;
+		db->base = base;
+		db->size = st.st_size;
+		db->header = h;
+		db->net4 = (const struct listdb_range *)((const char *)base + h->net4.offset);
+		db->net6 = (const struct listdb_range *)((const char *)base + h->net6.offset);
+		db->slots = (const struct listdb_slot *)((const char *)base + h->slots.offset);
+		db->strings = (const char *)base + h->strings.offset;
+		db->digests = NULL;
+		db->ndigests = 0;
+		if (h->version > 1)
+		{
+			db->digests = (const uint8_t *)base + h->digests.offset;
+			db->ndigests = h->digests.count;
+		}
+		return db;
+	}
+	munmap(base, st.st_size);
+	return NULL;
+}
+
+void listdb_close(struct listdb *db)
+{
+	if (!db)
+		return;
+	munmap(db->base, db->size);
+	delete db;
+}
+
+/* Find the range covering addr.  Returns its action (NET_NONE if none
+   does) and sets *bits to the length of the prefix that decided it. */
+int listdb_lookup_net(const struct listdb *db, int af, const uint8_t *addr, int *bits)
+{
+	const struct listdb_range *table;
+	uint64_t lo, hi;
+	size_t len;
+
+	if (af == AF_INET)
+	{
+		table = db->net4;
+		hi = db->header->net4.count;
+		len = 4;
+	} else
+	{
+		table = db->net6;
+		hi = db->header->net6.count;
+		len = 16;
+	}
+
+	/* find the last range starting at or before addr */
+	lo = 0;
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (memcmp(table[mid].start, addr, len) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || memcmp(addr, table[lo - 1].end, len) > 0)
+		return NET_NONE;
+	*bits = table[lo - 1].bits;
+	return table[lo - 1].action;
+}
+
+/* Is key (already normalized) in the string table? */
+bool listdb_lookup_key(const struct listdb *db, const string& key)
+{
+	uint64_t mask = db->header->slots.count - 1;
+	uint64_t hash, i;
+	uint64_t probes;
+
+	if (db->header->slots.count == 0)
+		return false;
+	hash = listdb_hash(key.data(), key.size());
+	for (i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++)
+	{
+		const struct listdb_slot *slot = &db->slots[i];
+
+		if (slot->string == 0)
+			return false;
+		if (slot->hash == (uint32_t)hash && slot->string <= db->header->strings.count &&
+		    strcmp(db->strings + slot->string - 1, key.c_str()) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Is addr (normalized) listed, either itself, as @domain, or under a
+   @*.domain wildcard? */
+bool listdb_lookup_address(const struct listdb *db, const string& addr)
+{
+	string::size_type at, dot;
+
+	if (listdb_lookup_key(db, addr))
+		return true;
+	at = addr.rfind('@');
+	if (at == string::npos)
+		return false;
+	if (at > 0 && listdb_lookup_key(db, addr.substr(at)))
+		return true;
+	for (dot = addr.find('.', at); dot != string::npos; dot = addr.find('.', dot + 1))
+	{
+		if (listdb_lookup_key(db, "@*" + addr.substr(dot)))
+			return true;
+	}
+	return false;
+}
+
+/* Is host, or a domain above it, listed as a -U domain? */
+bool listdb_lookup_domain(const struct listdb *db, const string& host)
+{
+	string::size_type start = 0;
+
+	for (;;)
+	{
+		if (listdb_lookup_key(db, "@" + host.substr(start)))
+			return true;
+		start = host.find('.', start);
+		if (start == string::npos)
+			return false;
+		start++;
+	}
+}
+
+/* Is digest (LISTDB_DIGESTLEN bytes) in the digest table? */
+bool listdb_lookup_digest(const struct listdb *db, const uint8_t *digest)
+{
+	uint64_t lo = 0, hi = db->ndigests;
+
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(db->digests + mid * LISTDB_DIGESTLEN, digest, LISTDB_DIGESTLEN);
+
+		if (cmp == 0)
+			return true;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+// }}}
+
+// {{{ Writing
+
+/* big-endian arithmetic on len-byte keys; return true on wraparound */
+static bool key_inc(uint8_t *key, size_t len)
+{
+	while (len--)
+		if (++key[len] != 0)
+			return false;
+	return true;
+}
+
+static bool key_dec(uint8_t *key, size_t len)
+{
+	while (len--)
+		if (key[len]-- != 0)
+			return false;
+	return true;
+}
+
+static bool netentry_order(const struct netentry& a, const struct netentry& b)
+{
+	int c = memcmp(a.key, b.key, sizeof(a.key));
+	if (c)
+		return c < 0;
+	return a.bits < b.bits;
+}
+
+/* Append start..end to the table, joining it to the previous range if
+   they touch and agree */
+static void emit_range(vector<struct listdb_range>& table, const uint8_t *start,
+	const uint8_t *end, const struct netentry& net, size_t len)
+{
+	struct listdb_range r;
+
+	memset(&r, 0, sizeof(r));
+	memcpy(r.start, start, len);
+	memcpy(r.end, end, len);
+	r.action = net.action;
+	r.bits = net.bits;
+
+	if (table.size())
+	{
+		struct listdb_range& last = table.back();
+		uint8_t next[16];
+
+		memcpy(next, last.end, sizeof(next));
+		if (last.action == r.action && last.bits == r.bits &&
+		    !key_inc(next, len) && memcmp(next, r.start, len) == 0)
+		{
+			memcpy(last.end, r.end, len);
+			return;
+		}
+	}
+	table.push_back(r);
+}
+
+/*
+   Flatten one family's prefixes into disjoint ranges, each taking the
+   action of the longest prefix covering it.  Prefixes either nest or
+   don't overlap at all, so a sweep in address order with a stack of the
+   prefixes we are inside is enough.
+*/
+static void flatten(vector<struct netentry> nets, size_t len, vector<struct listdb_range>& table)
+{
+	struct open_prefix
+	{
+		struct netentry net;
+		uint8_t end[16];
+	};
+	vector<struct open_prefix> stack;
+	uint8_t pos[16];
+	bool done = false;	// pos has run off the end of the address space
+	vector<struct netentry>::size_type i, n;
+
+	stable_sort(nets.begin(), nets.end(), netentry_order);
+
+	/* a repeated prefix keeps the action of its last appearance */
+	for (i = 0, n = 0; i < nets.size(); i++)
+	{
+		if (n && !netentry_order(nets[n - 1], nets[i]))
+			nets[n - 1] = nets[i];
+		else
+			nets[n++] = nets[i];
+	}
+	nets.resize(n);
+
+	memset(pos, 0, sizeof(pos));
+	for (i = 0; i <= nets.size(); i++)
+	{
+		/* close the prefixes that end before this one starts */
+		while (stack.size() &&
+		       (i == nets.size() || memcmp(stack.back().end, nets[i].key, len) < 0))
+		{
+			if (!done && memcmp(pos, stack.back().end, len) <= 0)
+				emit_range(table, pos, stack.back().end, stack.back().net, len);
+			memcpy(pos, stack.back().end, len);
+			done = key_inc(pos, len);
+			stack.pop_back();
+		}
+		if (i == nets.size())
+			break;
+
+		/* the enclosing prefix covers the gap up to this one */
+		if (stack.size() && !done && memcmp(pos, nets[i].key, len) < 0)
+		{
+			uint8_t before[16];
+			memcpy(before, nets[i].key, len);
+			key_dec(before, len);
+			emit_range(table, pos, before, stack.back().net, len);
+		}
+
+		struct open_prefix p;
+		p.net = nets[i];
+		memcpy(p.end, nets[i].key, len);
+		for (int bit = nets[i].bits; bit < (int)len * 8; bit++)
+			p.end[bit >> 3] |= 0x80 >> (bit & 7);
+		stack.push_back(p);
+		memcpy(pos, nets[i].key, len);
+		done = false;
+	}
+}
+
+/* Write a compiled list to path, atomically replacing any old one so
+   that processes still mapping it are not disturbed.  Returns 0, or -1
+   with a message in errbuf. */
+int listdb_write(const char *path, const vector<struct netentry>& nets,
+	const vector<string>& keys, const vector<string>& digests,
+	char *errbuf, size_t errlen)
+{
+	vector<struct netentry> nets4, nets6;
+	vector<struct listdb_range> table4, table6;
+	vector<struct listdb_slot> slots;
+	vector<string> sorted(digests);
+	string strings;
+	struct listdb_header h;
+	vector<string>::size_type k;
+	uint64_t nslots, mask;
+	string tmppath;
+	FILE *f;
+
+	for (vector<struct netentry>::size_type i = 0; i < nets.size(); i++)
+		(nets[i].af == AF_INET ? nets4 : nets6).push_back(nets[i]);
+	flatten(nets4, 4, table4);
+	flatten(nets6, 16, table6);
+
+	/* keep the table at most half full */
+	for (nslots = keys.size() ? 2 : 0; nslots && nslots < keys.size() * 2; nslots <<= 1)
+		;
+	mask = nslots - 1;
+	slots.resize(nslots);
+	for (k = 0; k < keys.size(); k++)
+	{
+		uint64_t hash = listdb_hash(keys[k].data(), keys[k].size());
+		uint64_t i;
+		bool dup = false;
+
+		for (i = hash & mask; slots[i].string; i = (i + 1) & mask)
+		{
+			if (slots[i].hash == (uint32_t)hash &&
+			    strings.compare(slots[i].string - 1, keys[k].size() + 1,
+			                    keys[k].c_str(), keys[k].size() + 1) == 0)
+			{
+				dup = true;
+				break;
+			}
+		}
+		if (dup)
+			continue;
+		if (strings.size() + keys[k].size() + 1 >= 0xffffffffUL)
+		{
+			snprintf(errbuf, errlen, "Too many addresses for one list");
+			return -1;
+		}
+		slots[i].hash = (uint32_t)hash;
+		slots[i].string = strings.size() + 1;
+		strings.append(keys[k].c_str(), keys[k].size() + 1);
+	}
+
+	sort(sorted.begin(), sorted.end());
+	sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, LISTDB_MAGIC, sizeof(LISTDB_MAGIC));
+	h.version = LISTDB_VERSION;
+	h.byteorder = LISTDB_BYTEORDER;
+	h.net4.offset = sizeof(h);
+	h.net4.count = table4.size();
+	h.net6.offset = h.net4.offset + table4.size() * sizeof(struct listdb_range);
+	h.net6.count = table6.size();
+	h.slots.offset = h.net6.offset + table6.size() * sizeof(struct listdb_range);
+	h.slots.count = slots.size();
+	h.strings.offset = h.slots.offset + slots.size() * sizeof(struct listdb_slot);
+	h.strings.count = strings.size();
+	h.digests.offset = h.strings.offset + strings.size();
+	h.digests.count = sorted.size();
+
+	tmppath = string(path) + ".tmp";
+	f = fopen(tmppath.c_str(), "w");
+	if (!f)
+	{
+		snprintf(errbuf, errlen, "Could not create %s: %s", tmppath.c_str(), strerror(errno));
+		return -1;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	if (table4.size())
+		fwrite(&table4[0], sizeof(struct listdb_range), table4.size(), f);
+	if (table6.size())
+		fwrite(&table6[0], sizeof(struct listdb_range), table6.size(), f);
+	if (slots.size())
+		fwrite(&slots[0], sizeof(struct listdb_slot), slots.size(), f);
+	fwrite(strings.data(), 1, strings.size(), f);
+	for (k = 0; k < sorted.size(); k++)
+		fwrite(sorted[k].data(), 1, LISTDB_DIGESTLEN, f);
+	if (ferror(f) | fclose(f) || rename(tmppath.c_str(), path) < 0)
+	{
+		snprintf(errbuf, errlen, "Could not write %s: %s", path, strerror(errno));
+		unlink(tmppath.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+// }}}
+// vim6:ai:noexpandtab
@@ -0,0 +1,135 @@
+//-*-c++-*-
+//
+//  $Id$
+//
+//  Compiled list files for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _LISTDB_H
+#define _LISTDB_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//
+// A compiled list is a single file that spamass-makelist writes and the
+// milter maps read-only, so loading it costs the same whatever its size
+// and every process on the host shares the pages.  It holds
+//
+//  - for each address family, the networks flattened into a sorted table
+//    of disjoint ranges, each remembering the prefix that decided it, and
+//  - the addresses and domains in an open-addressing hash table of
+//    offsets into a pool of NUL-terminated strings (-U domains are kept
+//    as @domain), and
+//  - SHA-256 digests of known spam content (-K), sorted.
+//
+// Version 1 files have no digest section; they are still read.
+// Offsets are from the start of the file; integers are in the byte order
+// of the machine that wrote the file.
+//
+
+#define LISTDB_MAGIC "SAMLIST"
+#define LISTDB_VERSION 2
+#define LISTDB_DIGESTLEN 32
+#define LISTDB_BYTEORDER 0x01020304
+
+/* what a prefix in a network list means for addresses under it */
+enum netaction
+{
+	NET_NONE,	// glue node, no entry of its own
+	NET_MATCH,	// address is in the list
+	NET_EXCLUDE	// address is carved out of a wider entry
+};
+
+/* one network entry, as parsed from a list */
+struct netentry
+{
+	int af;			// AF_INET or AF_INET6
+	uint8_t key[16];	// network in network byte order, host bits zeroed
+	int bits;		// prefix length
+	int action;		// NET_MATCH or NET_EXCLUDE
+};
+
+struct listdb_section
+{
+	uint64_t offset;
+	uint64_t count;		// records (tables) or bytes (string pool)
+};
+
+struct listdb_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	struct listdb_section net4;	// struct listdb_range, sorted by start
+	struct listdb_section net6;	// struct listdb_range, sorted by start
+	struct listdb_section slots;	// struct listdb_slot, a power of two
+	struct listdb_section strings;	// NUL-terminated keys
+	struct listdb_section digests;	// LISTDB_DIGESTLEN bytes each, sorted
+};
+
+/* addresses from start to end (inclusive, network byte order; IPv4 uses
+   the first four bytes) were decided by a bits-long prefix */
+struct listdb_range
+{
+	uint8_t start[16];
+	uint8_t end[16];
+	uint32_t action;
+	uint32_t bits;
+};
+
+struct listdb_slot
+{
+	uint32_t hash;		// low bits of the key's hash
+	uint32_t string;	// offset into the string pool plus one, 0 if empty
+};
+
+/* an open, mapped list file */
+struct listdb
+{
+	void *base;
+	size_t size;
+	const struct listdb_header *header;
+	const struct listdb_range *net4, *net6;
+	const struct listdb_slot *slots;
+	const char *strings;
+	const uint8_t *digests;
+	uint64_t ndigests;
+};
+
+int listdb_probe(const char *path);
+struct listdb *listdb_open(const char *path, char *errbuf, size_t errlen);
+void listdb_close(struct listdb *db);
+int listdb_lookup_net(const struct listdb *db, int af, const uint8_t *addr, int *bits);
+bool listdb_lookup_key(const struct listdb *db, const string& key);
+bool listdb_lookup_address(const struct listdb *db, const string& addr);
+bool listdb_lookup_domain(const struct listdb *db, const string& host);
+bool listdb_lookup_digest(const struct listdb *db, const uint8_t *digest);
+int listdb_write(const char *path, const vector<struct netentry>& nets,
+	const vector<string>& keys, const vector<string>& digests,
+	char *errbuf, size_t errlen);
+
+int parse_netentry(char *token, struct netentry *net, char *errbuf, size_t errlen);
+int parse_digest(const char *token, string& digest);
+int parse_domain(const char *token, string& domain);
+string normalize_address(const char *addr);
+uint64_t listdb_hash(const char *key, size_t len);
+
+#endif
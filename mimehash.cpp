@@ -0,0 +1,448 @@
+//
+//  $Id$
+//
+//  Streaming MIME part digests for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mimehash.h"
+
+static const char *whitespace = " \t\r\n";
+
+static string trim(const string& s)
+{
+	string::size_type start = s.find_first_not_of(whitespace);
+	string::size_type end = s.find_last_not_of(whitespace);
+
+	if (start == string::npos)
+		return "";
+	return s.substr(start, end - start + 1);
+}
+
+static string lowercase(string s)
+{
+	string::size_type i;
+
+	for (i = 0; i < s.size(); i++)
+		s[i] = tolower(s[i]);
+	return s;
+}
+
+/* Forget the header of the last part; a part without a Content-Type:
+   is text/plain */
+static void reset_header(struct mimehash *mh)
+{
+	mh->field.clear();
+	mh->type = "text/plain";
+	mh->boundary.clear();
+	mh->encoding = MIME_IDENTITY;
+}
+
+/* Note what a header field says about the part: its type, the boundary
+   of a multipart, and the transfer encoding */
+static void parse_field(struct mimehash *mh, const string& name, const string& value)
+{
+	if (strcasecmp(trim(name).c_str(), "Content-Type") == 0)
+	{
+		string lower = lowercase(value);
+		string::size_type idx = 0;
+
+		mh->type = trim(lower.substr(0, lower.find(';')));
+		mh->boundary.clear();
+		while ((idx = lower.find("boundary=", idx)) != string::npos)
+		{
+			string::size_type start = idx + 9, end;
+
+			/* not the tail of some other parameter */
+			if (idx > 0 && lower[idx - 1] != ';' && !isspace((unsigned char)lower[idx - 1]))
+			{
+				idx = start;
+				continue;
+			}
+			if (start < value.size() && value[start] == '"')
+				end = value.find('"', ++start);
+			else
+				end = value.find_first_of("; \t\r\n", start);
+			/* the boundary itself is case sensitive */
+			mh->boundary = value.substr(start, end == string::npos ? string::npos : end - start);
+			break;
+		}
+	} else if (strcasecmp(trim(name).c_str(), "Content-Transfer-Encoding") == 0)
+	{
+		string encoding = lowercase(trim(value));
+
+		if (encoding == "base64")
+			mh->encoding = MIME_BASE64;
+		else if (encoding == "quoted-printable")
+			mh->encoding = MIME_QP;
+		else
+			mh->encoding = MIME_IDENTITY;
+	}
+}
+
+/* An unfolded header field of a part is complete */
+static void end_field(struct mimehash *mh)
+{
+	string::size_type colon = mh->field.find(':');
+
+	if (colon != string::npos)
+		parse_field(mh, mh->field.substr(0, colon), mh->field.substr(colon + 1));
+	mh->field.clear();
+}
+
+/* The header of a part has ended: go into a multipart, into the header
+   of an attached message, or start digesting the content */
+static void begin_part(struct mimehash *mh)
+{
+	if (mh->type.compare(0, 10, "multipart/") == 0 && mh->boundary.size() &&
+	    mh->boundaries.size() < MIME_MAXDEPTH)
+	{
+		mh->boundaries.push_back(mh->boundary);
+		mh->state = MIME_SKIP;
+	} else if (mh->type == "message/rfc822" && mh->encoding == MIME_IDENTITY)
+	{
+		reset_header(mh);
+		mh->state = MIME_HEADER;
+	} else
+	{
+		sha256_init(&mh->part);
+		mh->partlen = 0;
+		mh->textpart = mh->type.compare(0, 5, "text/") == 0;
+		mh->crlf = false;
+		mh->bits = 0;
+		mh->nbits = 0;
+		mh->state = MIME_CONTENT;
+	}
+}
+
+/* A leaf part has ended.  Empty ones are left out, as everybody's list
+   of bad hashes seems to have the digest of nothing on it. */
+static void end_part(struct mimehash *mh)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+
+	if (mh->state != MIME_CONTENT)
+		return;
+	if (mh->text && mh->textpart)
+		mh->text(mh->textarg, NULL, 0);
+	if (mh->digest && mh->partlen && mh->digests.size() <= MIME_MAXPARTS)
+	{
+		string digest;
+
+		sha256_final(&mh->part, md);
+		digest.assign((char *)md, sizeof(md));
+		/* a message can have any number of parts, but only so many
+		   digests are kept: the one that matters must not be lost */
+		if (mh->digests.size() < MIME_MAXPARTS ||
+		    (mh->wanted && mh->wanted(mh->wantedarg, digest)))
+			mh->digests.push_back(digest);
+	}
+	mh->state = MIME_SKIP;
+}
+
+static int base64_value(int c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+static int hex_value(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* Decode a line, or a piece of one if it is too long, of a leaf part's
+   content into the part's digest.  A line break in the content is only
+   added once more content follows it, so that the one before the next
+   boundary, which belongs to the boundary, is left out. */
+static void content(struct mimehash *mh, const char *p, size_t n, bool eol)
+{
+	unsigned char out[MIME_MAXLINE + 2];
+	size_t i, len = 0;
+	bool soft = false;
+	int v;
+
+	if (!mh->digest && !(mh->text && mh->textpart))
+		return;
+
+	switch (mh->encoding)
+	{
+		case MIME_BASE64:
+			for (i = 0; i < n; i++)
+			{
+				if ((v = base64_value((unsigned char)p[i])) < 0)
+					continue;
+				mh->bits = (mh->bits << 6) | v;
+				mh->nbits += 6;
+				if (mh->nbits >= 8)
+				{
+					mh->nbits -= 8;
+					out[len++] = (mh->bits >> mh->nbits) & 0xff;
+					mh->bits &= (1UL << mh->nbits) - 1;
+				}
+			}
+			break;
+		case MIME_QP:
+			if (eol)
+			{
+				while (n && (p[n - 1] == ' ' || p[n - 1] == '\t'))
+					n--;
+				if (n && p[n - 1] == '=')
+				{
+					soft = true;
+					n--;
+				}
+			}
+			if (mh->crlf)
+			{
+				out[len++] = '\r';
+				out[len++] = '\n';
+			}
+			for (i = 0; i < n; i++)
+			{
+				if (p[i] == '=' && i + 2 < n &&
+				    hex_value((unsigned char)p[i + 1]) >= 0 &&
+				    hex_value((unsigned char)p[i + 2]) >= 0)
+				{
+					out[len++] = hex_value((unsigned char)p[i + 1]) << 4 |
+						hex_value((unsigned char)p[i + 2]);
+					i += 2;
+				} else
+					out[len++] = p[i];
+			}
+			mh->crlf = eol && !soft;
+			break;
+		default:
+			if (mh->crlf)
+			{
+				out[len++] = '\r';
+				out[len++] = '\n';
+			}
+			memcpy(out + len, p, n);
+			len += n;
+			mh->crlf = eol;
+			break;
+	}
+	if (mh->digest)
+		sha256_update(&mh->part, out, len);
+	mh->partlen += len;
+	if (mh->text && mh->textpart && len)
+		mh->text(mh->textarg, (const char *)out, len);
+}
+
+/* Is line a delimiter for boundary b, and if so the closing one? */
+static bool is_boundary(const string& line, const string& b, bool *close)
+{
+	string::size_type end;
+
+	if (line.size() < b.size() + 2 || line.compare(2, b.size(), b) != 0)
+		return false;
+	end = b.size() + 2;
+	*close = line.compare(end, 2, "--") == 0;
+	if (*close)
+		end += 2;
+	return line.find_first_not_of(" \t", end) == string::npos;
+}
+
+/* Act on mh->line, a whole line if eol is set (its CR taken off) or the
+   next piece of one that is too long */
+static void handle_line(struct mimehash *mh, bool eol)
+{
+	string& line = mh->line;
+	bool whole = !mh->midline;
+	bool close;
+	int i;
+
+	mh->midline = !eol;
+	mh->binary = false;
+
+	/* a boundary line ends the part and everything nested in it */
+	if (whole && eol && line.compare(0, 2, "--") == 0)
+	{
+		for (i = mh->boundaries.size() - 1; i >= 0; i--)
+		{
+			if (!is_boundary(line, mh->boundaries[i], &close))
+				continue;
+			end_part(mh);
+			mh->boundaries.resize(i + 1);
+			if (close)
+			{
+				mh->boundaries.pop_back();
+				mh->state = MIME_SKIP;
+			} else
+			{
+				reset_header(mh);
+				mh->state = MIME_HEADER;
+			}
+			line.clear();
+			return;
+		}
+	}
+
+	switch (mh->state)
+	{
+		case MIME_HEADER:
+			if (whole && eol && line.empty())
+			{
+				end_field(mh);
+				begin_part(mh);
+			} else if (!whole || line[0] == ' ' || line[0] == '\t')
+			{
+				if (mh->field.size() < 4 * MIME_MAXLINE)
+					mh->field += line;
+			} else
+			{
+				end_field(mh);
+				mh->field = line;
+			}
+			break;
+		case MIME_CONTENT:
+			mh->binary = !mh->textpart;
+			content(mh, line.data(), line.size(), eol);
+			break;
+		default:
+			break;
+	}
+	line.clear();
+}
+
+/* Hand back the line just handled as it was sent */
+static void pass_line(struct mimehash *mh)
+{
+	if (mh->pass)
+		mh->pass(mh->passarg, mh->raw.data(), mh->raw.size(), mh->binary);
+	mh->raw.clear();
+}
+
+void mimehash_init(struct mimehash *mh)
+{
+	mh->state = MIME_SKIP;
+	mh->started = false;
+	mh->line.clear();
+	mh->midline = false;
+	mh->raw.clear();
+	mh->binary = false;
+	mh->boundaries.clear();
+	reset_header(mh);
+	sha256_init(&mh->body);
+	mh->bodylen = 0;
+	mh->partlen = 0;
+	mh->crlf = false;
+	mh->bits = 0;
+	mh->nbits = 0;
+	mh->digests.clear();
+	mh->textpart = false;
+	mh->digest = true;
+	mh->text = NULL;
+	mh->textarg = NULL;
+	mh->pass = NULL;
+	mh->wanted = NULL;
+	mh->wantedarg = NULL;
+	mh->passarg = NULL;
+}
+
+/* A field of the message header, for the type and encoding of the body */
+void mimehash_header(struct mimehash *mh, const char *name, const char *value)
+{
+	parse_field(mh, name, value);
+}
+
+void mimehash_update(struct mimehash *mh, const void *data, size_t len)
+{
+	const char *p = (const char *)data, *end = p + len;
+
+	if (mh->digest)
+		sha256_update(&mh->body, data, len);
+	mh->bodylen += len;
+	if (!mh->started)
+	{
+		mh->started = true;
+		begin_part(mh);
+	}
+
+	while (p < end)
+	{
+		size_t room = MIME_MAXLINE - mh->line.size();
+		size_t n = (size_t)(end - p) < room ? end - p : room;
+		const char *nl = (const char *)memchr(p, '\n', n);
+
+		if (nl)
+		{
+			mh->line.append(p, nl - p);
+			if (mh->pass)
+				mh->raw.append(p, nl + 1 - p);
+			if (mh->line.size() && mh->line[mh->line.size() - 1] == '\r')
+				mh->line.erase(mh->line.size() - 1);
+			handle_line(mh, true);
+			pass_line(mh);
+			p = nl + 1;
+		} else
+		{
+			mh->line.append(p, n);
+			if (mh->pass)
+				mh->raw.append(p, n);
+			p += n;
+			if (mh->line.size() == MIME_MAXLINE)
+			{
+				handle_line(mh, false);
+				pass_line(mh);
+			}
+		}
+	}
+}
+
+/* The body has all arrived: return the digests of its leaf parts, then
+   of the whole body */
+void mimehash_final(struct mimehash *mh, vector<string>& digests)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+
+	if (mh->line.size())
+	{
+		handle_line(mh, true);
+		pass_line(mh);
+	}
+	end_part(mh);
+	digests = mh->digests;
+	if (mh->digest && mh->bodylen)
+	{
+		sha256_final(&mh->body, md);
+		digests.push_back(string((char *)md, sizeof(md)));
+	}
+}
+
+// vim6:ai:noexpandtab
@@ -0,0 +1,107 @@
+//-*-c++-*-
+//
+//  $Id$
+//
+//  Streaming MIME part digests for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _MIMEHASH_H
+#define _MIMEHASH_H
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#include "sha256.h"
+
+using namespace std;
+
+//
+// Takes a message body apart into its MIME parts as it arrives, a chunk
+// at a time, and makes a SHA-256 digest of the whole body as sent and of
+// the content of every leaf part once its transfer encoding (base64 or
+// quoted-printable) is undone, which is what a feed of known malware
+// attachment hashes lists.  The decoded content of text parts can also
+// be handed to a function as it comes, for the -U URI scanner, and the
+// body as sent can be handed back a line at a time, marked where it is
+// the content of a part that is not text, for -s to leave out.  Only a
+// line at a time is ever held; lines longer than MIME_MAXLINE are taken
+// in pieces.
+//
+
+#define MIME_MAXLINE 1000	/* a boundary line is never this long */
+#define MIME_MAXDEPTH 16	/* nested multiparts followed */
+#define MIME_MAXPARTS 100	/* leaf part digests kept */
+
+enum mimestate
+{
+	MIME_HEADER,	// reading a part's header
+	MIME_CONTENT,	// reading a leaf part's content
+	MIME_SKIP	// preamble or epilogue of a multipart
+};
+
+enum mimeencoding
+{
+	MIME_IDENTITY,	// 7bit, 8bit, binary
+	MIME_BASE64,
+	MIME_QP
+};
+
+struct mimehash
+{
+	int state;		// enum mimestate
+	bool started;		// has the top level part begun?
+	string line;		// a line not yet ended
+	bool midline;		// line continues one taken in pieces
+	string raw;		// the same, as sent
+	bool binary;		// line is content of a part that is not text
+
+	vector<string> boundaries;	// enclosing multiparts, innermost last
+	string field;		// the header field being unfolded
+	string type;		// Content-Type: of the part, lower case
+	string boundary;	// its boundary parameter
+	int encoding;		// enum mimeencoding
+	bool textpart;		// the leaf part being read is text/*
+
+	struct sha256_ctx body;	// the body as sent
+	size_t bodylen;
+	struct sha256_ctx part;	// the leaf part being read, decoded
+	size_t partlen;
+	bool crlf;		// a line break is due before more content
+	unsigned long bits;	// base64 bits not yet a whole byte
+	int nbits;
+
+	vector<string> digests;	// finished parts
+
+	bool digest;		// make digests; set by mimehash_init()
+	/* gets the decoded content of text parts, and NULL at the end of each */
+	void (*text)(void *arg, const char *data, size_t len);
+	void *textarg;
+	/* gets the body as sent, a line at a time */
+	void (*pass)(void *arg, const char *data, size_t len, bool binary);
+	void *passarg;
+	/* once MIME_MAXPARTS digests are kept, gets every later one; the
+	   first it returns true for is kept as well */
+	bool (*wanted)(void *arg, const string& digest);
+	void *wantedarg;
+};
+
+void mimehash_init(struct mimehash *mh);
+void mimehash_header(struct mimehash *mh, const char *name, const char *value);
+void mimehash_update(struct mimehash *mh, const void *data, size_t len);
+void mimehash_final(struct mimehash *mh, vector<string>& digests);
+
+#endif
@@ -0,0 +1,168 @@
+//
+//  $Id$
+//
+//  Sending host reputation for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "reputation.h"
+
+struct repshard
+{
+	pthread_mutex_t mutex;
+	list<struct repentry> lru;	/* most recent first */
+	unordered_map<string, list<struct repentry>::iterator> index;
+};
+
+static struct repshard shards[REPUTATION_SHARDS];
+static double min_volume;	/* messages before a source can be judged */
+static double max_ratio;	/* share of them that may be spam */
+static long half_life;
+
+static struct repshard *shard_for(const string& key)
+{
+	return &shards[hash<string>()(key) % REPUTATION_SHARDS];
+}
+
+int reputation_init(double volume, double ratio, long halflife)
+{
+	int i;
+
+	for (i = 0; i < REPUTATION_SHARDS; i++)
+		if (pthread_mutex_init(&shards[i].mutex, NULL))
+			return -1;
+	min_volume = volume;
+	max_ratio = ratio;
+	half_life = halflife;
+	return 0;
+}
+
+/* The keys an address counts under: itself, and its /24 or /64.  Returns
+   how many there are, none if ip isn't an address. */
+static int source_keys(const char *ip, string keys[2])
+{
+	unsigned char addr[16];
+
+	if (inet_pton(AF_INET, ip, addr) == 1)
+	{
+		keys[0] = "a" + string((char *)addr, 4);
+		keys[1] = "n" + string((char *)addr, 3);
+	} else if (inet_pton(AF_INET6, ip, addr) == 1)
+	{
+		keys[0] = "a" + string((char *)addr, 16);
+		keys[1] = "n" + string((char *)addr, 8);
+	} else
+		return 0;
+	return 2;
+}
+
+/* Bring the counts of e forward to now */
+static void age(struct repentry *e, time_t now)
+{
+	double f;
+
+	if (now <= e->updated)
+		return;
+	f = pow(0.5, (double)(now - e->updated) / half_life);
+	e->spam *= f;
+	e->ham *= f;
+	e->updated = now;
+}
+
+/* Has the address, or its network, sent enough mail lately, and enough
+   of it spam, to be turned away?  If so, *spam and *total say how much. */
+bool reputation_bad(const char *ip, double *spam, double *total)
+{
+	unordered_map<string, list<struct repentry>::iterator>::iterator it;
+	string keys[2];
+	time_t now = time(NULL);
+	bool bad = false;
+	int i, n;
+
+	n = source_keys(ip, keys);
+	for (i = 0; i < n && !bad; i++)
+	{
+		struct repshard *s = shard_for(keys[i]);
+
+		pthread_mutex_lock(&s->mutex);
+		it = s->index.find(keys[i]);
+		if (it != s->index.end())
+		{
+			struct repentry *e = &*it->second;
+
+			age(e, now);
+			*spam = e->spam;
+			*total = e->spam + e->ham;
+			bad = *total >= min_volume && *spam >= max_ratio * *total;
+		}
+		pthread_mutex_unlock(&s->mutex);
+	}
+	return bad;
+}
+
+/* Count a verdict on a message from ip */
+void reputation_update(const char *ip, bool spam)
+{
+	unordered_map<string, list<struct repentry>::iterator>::iterator it;
+	string keys[2];
+	time_t now = time(NULL);
+	int i, n;
+
+	n = source_keys(ip, keys);
+	for (i = 0; i < n; i++)
+	{
+		struct repshard *s = shard_for(keys[i]);
+
+		pthread_mutex_lock(&s->mutex);
+		it = s->index.find(keys[i]);
+		if (it != s->index.end())
+			s->lru.splice(s->lru.begin(), s->lru, it->second);
+		else
+		{
+			struct repentry entry;
+
+			entry.key = keys[i];
+			entry.spam = 0;
+			entry.ham = 0;
+			entry.updated = now;
+			s->lru.push_front(entry);
+			s->index[keys[i]] = s->lru.begin();
+			if (s->lru.size() > REPUTATION_ENTRIES / REPUTATION_SHARDS)
+			{
+				s->index.erase(s->lru.back().key);
+				s->lru.pop_back();
+			}
+		}
+		age(&s->lru.front(), now);
+		if (spam)
+			s->lru.front().spam++;
+		else
+			s->lru.front().ham++;
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+// vim6:ai:noexpandtab
@@ -0,0 +1,55 @@
+//-*-c++-*-
+//
+//  $Id$
+//
+//  Sending host reputation for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _REPUTATION_H
+#define _REPUTATION_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+//
+// How much spam and ham each sending address, and each /24 (IPv4) or
+// /64 (IPv6) network, has sent lately, for -G.  Every scanned message
+// counts for its address and network; the counts decay exponentially,
+// halving every halflife seconds, so a source that stops sending spam
+// is soon forgiven.  The table is split into shards, each an LRU list
+// with its own lock, like the verdict cache.
+//
+
+struct repentry
+{
+	string key;		// 'a' and the address, or 'n' and the network
+	double spam, ham;	// as of updated
+	time_t updated;
+};
+
+#define REPUTATION_SHARDS 16
+#define REPUTATION_ENTRIES 65536	/* addresses and networks remembered */
+
+int reputation_init(double volume, double ratio, long halflife);
+bool reputation_bad(const char *ip, double *spam, double *total);
+void reputation_update(const char *ip, bool spam);
+
+#endif
@@ -0,0 +1,423 @@
+//
+//  $Id$
+//
+//  Local pattern rules for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <map>
+
+#include "ruleset.h"
+
+static const char *whitespace = " \t\r\n";
+
+static string trim(const string& s)
+{
+	string::size_type start = s.find_first_not_of(whitespace);
+	string::size_type end = s.find_last_not_of(whitespace);
+
+	if (start == string::npos)
+		return "";
+	return s.substr(start, end - start + 1);
+}
+
+static string lowercase(string s)
+{
+	string::size_type i;
+
+	for (i = 0; i < s.size(); i++)
+		s[i] = tolower(s[i]);
+	return s;
+}
+
+/* The trie as it is built, before it is packed into an acmachine */
+struct acbuild
+{
+	vector<map<uint8_t, uint32_t> > children;
+	vector<vector<uint32_t> > outputs;
+};
+
+static void add_pattern(struct acmachine *m, struct acbuild *b, const string& piece,
+	uint32_t rule, uint32_t idx)
+{
+	struct acpattern p;
+	uint32_t node = 0;
+	string::size_type i;
+
+	for (i = 0; i < piece.size(); i++)
+	{
+		uint8_t c = piece[i];
+		map<uint8_t, uint32_t>::iterator it = b->children[node].find(c);
+
+		if (it != b->children[node].end())
+		{
+			node = it->second;
+			continue;
+		}
+		b->children[node][c] = b->children.size();
+		node = b->children.size();
+		b->children.push_back(map<uint8_t, uint32_t>());
+		b->outputs.push_back(vector<uint32_t>());
+	}
+	p.rule = rule;
+	p.piece = idx;
+	p.len = piece.size();
+	b->outputs[node].push_back(m->patterns.size());
+	m->patterns.push_back(p);
+}
+
+/* Work out the failure and dictionary links breadth first, so that every
+   node's are known before its children's, and pack the trie */
+static void compile(struct acmachine *m, struct acbuild *b)
+{
+	vector<uint32_t> queue;
+	map<uint8_t, uint32_t>::const_iterator it;
+	size_t head, n = b->children.size();
+	uint32_t u, v, f;
+	int c;
+
+	m->nodes.assign(n, acnode());
+	for (c = 0; c < 256; c++)
+		m->root[c] = 0;
+	for (it = b->children[0].begin(); it != b->children[0].end(); ++it)
+	{
+		m->root[it->first] = it->second;
+		queue.push_back(it->second);
+	}
+
+	for (head = 0; head < queue.size(); head++)
+	{
+		u = queue[head];
+		for (it = b->children[u].begin(); it != b->children[u].end(); ++it)
+		{
+			v = it->second;
+			f = m->nodes[u].fail;
+			while (f && !b->children[f].count(it->first))
+				f = m->nodes[f].fail;
+			f = f ? b->children[f][it->first] : m->root[it->first];
+			m->nodes[v].fail = f;
+			m->nodes[v].dict = b->outputs[f].size() ? f : m->nodes[f].dict;
+			queue.push_back(v);
+		}
+	}
+
+	for (u = 0; u < n; u++)
+	{
+		struct acnode& node = m->nodes[u];
+
+		node.edges = m->edges.size();
+		node.nedges = b->children[u].size();
+		for (it = b->children[u].begin(); it != b->children[u].end(); ++it)
+		{
+			struct acedge e;
+
+			e.c = it->first;
+			e.next = it->second;
+			m->edges.push_back(e);
+		}
+		node.outputs = m->outputs.size();
+		node.noutputs = b->outputs[u].size();
+		m->outputs.insert(m->outputs.end(), b->outputs[u].begin(), b->outputs[u].end());
+	}
+}
+
+static inline uint32_t step(const struct acmachine *m, uint32_t s, uint8_t c)
+{
+	while (s)
+	{
+		const struct acnode& node = m->nodes[s];
+		const struct acedge *e = &m->edges[node.edges];
+		uint32_t lo = 0, hi = node.nedges;
+
+		while (lo < hi)
+		{
+			uint32_t mid = (lo + hi) / 2;
+
+			if (e[mid].c == c)
+				return e[mid].next;
+			if (e[mid].c < c)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		s = node.fail;
+	}
+	return m->root[c];
+}
+
+/* Split a pattern into its literal pieces at each unescaped * */
+static void split_pattern(const string& pattern, vector<string>& pieces)
+{
+	string piece;
+	string::size_type i;
+
+	for (i = 0; i < pattern.size(); i++)
+	{
+		if (pattern[i] == '\\' && i + 1 < pattern.size())
+			piece += tolower(pattern[++i]);
+		else if (pattern[i] == '*')
+		{
+			if (piece.size())
+				pieces.push_back(piece);
+			piece.clear();
+		} else
+			piece += tolower(pattern[i]);
+	}
+	if (piece.size())
+		pieces.push_back(piece);
+}
+
+static int parse_rule(struct ruleset *rs, struct acbuild *hb, struct acbuild *bb,
+	const string& line, const string& name, char *errbuf, size_t errlen)
+{
+	struct rule r;
+	string::size_type end1, start2, end2;
+	string where, action;
+	vector<string> pieces;
+	vector<string>::size_type i;
+	char *end;
+
+	end1 = line.find_first_of(whitespace);
+	start2 = line.find_first_not_of(whitespace, end1);
+	end2 = line.find_first_of(whitespace, start2);
+	if (end2 == string::npos)
+	{
+		snprintf(errbuf, errlen, "%s: expected \"where action pattern\"", name.c_str());
+		return -1;
+	}
+	where = lowercase(line.substr(0, end1));
+	action = lowercase(line.substr(start2, end2 - start2));
+
+	r.name = name;
+	r.body = where == "body";
+	if (!r.body && where != "header")
+	{
+		if (where.size() < 2 || where[where.size() - 1] != ':')
+		{
+			snprintf(errbuf, errlen, "%s: unknown place \"%s\"", name.c_str(), where.c_str());
+			return -1;
+		}
+		r.field = where.substr(0, where.size() - 1);
+	}
+
+	r.score = 0;
+	if (action == "skip")
+		r.action = RULE_SKIP;
+	else if (action == "reject")
+		r.action = RULE_REJECT;
+	else
+	{
+		r.action = RULE_NONE;
+		r.score = strtod(action.c_str(), &end);
+		if (*end)
+		{
+			snprintf(errbuf, errlen, "%s: unknown action \"%s\"", name.c_str(), action.c_str());
+			return -1;
+		}
+	}
+
+	split_pattern(trim(line.substr(end2)), pieces);
+	if (pieces.empty())
+	{
+		snprintf(errbuf, errlen, "%s: empty pattern", name.c_str());
+		return -1;
+	}
+	r.pieces = pieces.size();
+	for (i = 0; i < pieces.size(); i++)
+	{
+		if (r.body)
+			add_pattern(&rs->body, bb, pieces[i], rs->rules.size(), i);
+		else
+			add_pattern(&rs->header, hb, pieces[i], rs->rules.size(), i);
+	}
+	rs->rules.push_back(r);
+	return 0;
+}
+
+/* Read and compile the rules in path; NULL, with a message in errbuf, if
+   it can't be read or a rule can't be understood */
+struct ruleset *ruleset_load(const char *path, double threshold, char *errbuf, size_t errlen)
+{
+	struct ruleset *rs = new ruleset;
+	struct acbuild hb, bb;
+	const char *base = strrchr(path, '/');
+	char buf[4096], num[16];
+	string line;
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+	{
+		snprintf(errbuf, errlen, "Could not read %s: %s", path, strerror(errno));
+		delete rs;
+		return NULL;
+	}
+	base = base ? base + 1 : path;
+	rs->threshold = threshold;
+	hb.children.resize(1);
+	hb.outputs.resize(1);
+	bb.children.resize(1);
+	bb.outputs.resize(1);
+
+	while (fgets(buf, sizeof(buf), f))
+	{
+		line = buf;
+		/* a line longer than buf arrives in pieces */
+		while (line.size() && line[line.size() - 1] != '\n' && fgets(buf, sizeof(buf), f))
+			line += buf;
+		lineno++;
+		line = trim(line);
+		if (line.empty() || line[0] == '#')
+			continue;
+		snprintf(num, sizeof(num), ":%d", lineno);
+		if (parse_rule(rs, &hb, &bb, line, base + string(num), errbuf, errlen) < 0)
+		{
+			fclose(f);
+			delete rs;
+			return NULL;
+		}
+	}
+	fclose(f);
+
+	compile(&rs->header, &hb);
+	compile(&rs->body, &bb);
+	return rs;
+}
+
+void ruleset_free(struct ruleset *rs)
+{
+	delete rs;
+}
+
+void rulestate_init(const struct ruleset *rs, struct rulestate *st)
+{
+	st->state = 0;
+	st->pos = 0;
+	st->progress.assign(rs->rules.size(), 0);
+	st->lastend.assign(rs->rules.size(), 0);
+	st->fired.assign(rs->rules.size(), false);
+	st->touched.clear();
+	st->score = 0;
+	st->verdict = RULE_NONE;
+	st->matched.clear();
+}
+
+static void fire(const struct ruleset *rs, struct rulestate *st, uint32_t i)
+{
+	const struct rule& r = rs->rules[i];
+
+	st->fired[i] = true;
+	if (st->verdict != RULE_NONE)
+		return;
+	if (r.action != RULE_NONE)
+		st->verdict = r.action;
+	else
+	{
+		st->score += r.score;
+		if (st->score >= rs->threshold)
+			st->verdict = RULE_REJECT;
+	}
+	if (st->verdict != RULE_NONE)
+		st->matched = r.name;
+}
+
+/* A piece of a pattern ends at end: if it is the one its rule is waiting
+   for and does not overlap the one before, the rule moves on */
+static void found(const struct ruleset *rs, struct rulestate *st, const struct acpattern& p,
+	uint64_t end, bool header)
+{
+	if (st->fired[p.rule] || st->progress[p.rule] != p.piece)
+		return;
+	if (p.piece && end - p.len < st->lastend[p.rule])
+		return;
+	if (header && p.piece == 0)
+		st->touched.push_back(p.rule);
+	st->lastend[p.rule] = end;
+	if (++st->progress[p.rule] == rs->rules[p.rule].pieces)
+		fire(rs, st, p.rule);
+}
+
+/* Run the text through m from state s, reporting the patterns found */
+static uint32_t run(const struct ruleset *rs, struct rulestate *st, const struct acmachine *m,
+	uint32_t s, const char *data, size_t len, uint64_t *pos, const char *field)
+{
+	size_t i;
+
+	for (i = 0; i < len && st->verdict == RULE_NONE; i++)
+	{
+		uint32_t t;
+
+		s = step(m, s, tolower((unsigned char)data[i]));
+		++*pos;
+		for (t = m->nodes[s].noutputs ? s : m->nodes[s].dict; t; t = m->nodes[t].dict)
+		{
+			const struct acnode& node = m->nodes[t];
+			uint32_t j;
+
+			for (j = 0; j < node.noutputs; j++)
+			{
+				const struct acpattern& p = m->patterns[m->outputs[node.outputs + j]];
+				const string& want = rs->rules[p.rule].field;
+
+				if (field && want.size() && strcasecmp(want.c_str(), field) != 0)
+					continue;
+				found(rs, st, p, *pos, field != NULL);
+			}
+		}
+	}
+	return s;
+}
+
+/* A header field: its rules must match within it */
+int ruleset_header(const struct ruleset *rs, struct rulestate *st, const char *name, const char *value)
+{
+	uint64_t pos = 0;
+	vector<uint32_t>::size_type i;
+
+	if (st->verdict == RULE_NONE)
+		run(rs, st, &rs->header, 0, value, strlen(value), &pos, name);
+	for (i = 0; i < st->touched.size(); i++)
+		st->progress[st->touched[i]] = 0;
+	st->touched.clear();
+	return st->verdict;
+}
+
+/* The next piece of the body */
+int ruleset_body(const struct ruleset *rs, struct rulestate *st, const char *data, size_t len)
+{
+	if (st->verdict == RULE_NONE)
+		st->state = run(rs, st, &rs->body, st->state, data, len, &st->pos, NULL);
+	return st->verdict;
+}
+
+/* What comes next does not follow on from what came before, as at the
+   end of a MIME part: no piece of a pattern may match across it */
+void ruleset_body_break(const struct ruleset *rs, struct rulestate *st)
+{
+	st->state = 0;
+}
+
+// vim6:ai:noexpandtab
@@ -0,0 +1,127 @@
+//-*-c++-*-
+//
+//  $Id$
+//
+//  Local pattern rules for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _RULESET_H
+#define _RULESET_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//
+// A rules file (-E) holds one rule per line:
+//
+//	where action pattern
+//
+// where is "header" (any header field), a field name with a colon, as
+// "subject:", or "body"; action is a score to add, "skip" or "reject";
+// and pattern, the rest of the line, is matched without regard to case.
+// A * in it stands for any run of characters (\* and \\ for themselves),
+// within one header field or anywhere later in the body.
+//
+// The literal pieces of all patterns are compiled into one Aho-Corasick
+// automaton for headers and one for the body, so the cost of matching
+// depends on the length of the text and not on the number of rules.
+// The body automaton keeps its state between chunks, so a pattern split
+// over two of them is still found.
+//
+
+enum ruleaction
+{
+	RULE_NONE,	// no verdict (yet)
+	RULE_SKIP,	// accept the message without scanning it
+	RULE_REJECT	// reject it without scanning it
+};
+
+struct rule
+{
+	string name;		// file:line, for the log
+	string field;		// header field name, lower case; empty for any
+	bool body;
+	int action;		// enum ruleaction, RULE_NONE to add score
+	double score;
+	unsigned int pieces;	// literal pieces of the pattern
+};
+
+/* one literal piece of a rule's pattern */
+struct acpattern
+{
+	uint32_t rule;
+	uint32_t piece;		// its place in the pattern
+	uint32_t len;
+};
+
+struct acedge
+{
+	uint8_t c;
+	uint32_t next;
+};
+
+struct acnode
+{
+	uint32_t edges;		// first in the edge table, sorted by c
+	uint32_t nedges;
+	uint32_t fail;		// longest proper suffix that is a node
+	uint32_t outputs;	// first in the output table
+	uint32_t noutputs;	// patterns ending here
+	uint32_t dict;		// nearest node down the fail chain with outputs, 0 if none
+};
+
+struct acmachine
+{
+	vector<struct acnode> nodes;	// node 0 is the root
+	vector<struct acedge> edges;
+	vector<uint32_t> outputs;	// into patterns
+	vector<struct acpattern> patterns;
+	uint32_t root[256];		// the root's transitions, complete
+};
+
+struct ruleset
+{
+	vector<struct rule> rules;
+	struct acmachine header, body;
+	double threshold;	// score that rejects a message
+};
+
+/* where one message has got to */
+struct rulestate
+{
+	uint32_t state;			// in the body automaton
+	uint64_t pos;			// body characters seen
+	vector<uint32_t> progress;	// pattern pieces found, by rule
+	vector<uint64_t> lastend;	// where the last one ended
+	vector<bool> fired;
+	vector<uint32_t> touched;	// rules progressing in this header field
+	double score;
+	int verdict;			// enum ruleaction
+	string matched;			// the rule that decided it
+};
+
+struct ruleset *ruleset_load(const char *path, double threshold, char *errbuf, size_t errlen);
+void ruleset_free(struct ruleset *rs);
+void rulestate_init(const struct ruleset *rs, struct rulestate *st);
+int ruleset_header(const struct ruleset *rs, struct rulestate *st, const char *name, const char *value);
+int ruleset_body(const struct ruleset *rs, struct rulestate *st, const char *data, size_t len);
+void ruleset_body_break(const struct ruleset *rs, struct rulestate *st);
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * SHA-256 as specified in FIPS 180-4.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+/* $Id$ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x)		(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x)		(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x)		(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define s1(x)		(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static void
+sha256_block(struct sha256_ctx *ctx, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++, p += 4)
+		w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		    (uint32_t)p[2] << 8 | p[3];
+	for (; i < 64; i++)
+		w[i] = s1(w[i - 2]) + w[i - 7] + s0(w[i - 15]) + w[i - 16];
+
+	a = ctx->state[0]; b = ctx->state[1];
+	c = ctx->state[2]; d = ctx->state[3];
+	e = ctx->state[4]; f = ctx->state[5];
+	g = ctx->state[6]; h = ctx->state[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + S1(e) + CH(e, f, g) + K[i] + w[i];
+		t2 = S0(a) + MAJ(a, b, c);
+		h = g; g = f; f = e;
+		e = d + t1;
+		d = c; c = b; b = a;
+		a = t1 + t2;
+	}
+	ctx->state[0] += a; ctx->state[1] += b;
+	ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f;
+	ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void
+sha256_init(struct sha256_ctx *ctx)
+{
+	ctx->state[0] = 0x6a09e667; ctx->state[1] = 0xbb67ae85;
+	ctx->state[2] = 0x3c6ef372; ctx->state[3] = 0xa54ff53a;
+	ctx->state[4] = 0x510e527f; ctx->state[5] = 0x9b05688c;
+	ctx->state[6] = 0x1f83d9ab; ctx->state[7] = 0x5be0cd19;
+	ctx->count = 0;
+}
+
+void
+sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	size_t have = ctx->count % 64;
+
+	ctx->count += len;
+	if (have) {
+		size_t need = 64 - have;
+
+		if (len < need) {
+			memcpy(ctx->buf + have, p, len);
+			return;
+		}
+		memcpy(ctx->buf + have, p, need);
+		sha256_block(ctx, ctx->buf);
+		p += need;
+		len -= need;
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block(ctx, p);
+	memcpy(ctx->buf, p, len);
+}
+
+void
+sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+	uint64_t bits = ctx->count * 8;
+	unsigned char pad[72];
+	size_t padlen = 64 - (ctx->count % 64);
+	int i;
+
+	/* 0x80, zeros, then the length in bits, ending on a block boundary */
+	if (padlen < 9)
+		padlen += 64;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++)
+		pad[padlen - 1 - i] = (unsigned char)(bits >> (8 * i));
+	sha256_update(ctx, pad, padlen);
+
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+		digest[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+		digest[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+		digest[4 * i + 3] = (unsigned char)ctx->state[i];
+	}
+}
+
+void
+sha256_hex(const unsigned char digest[SHA256_DIGEST_LENGTH], char hex[2 * SHA256_DIGEST_LENGTH + 1])
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		hex[2 * i] = digits[digest[i] >> 4];
+		hex[2 * i + 1] = digits[digest[i] & 15];
+	}
+	hex[2 * SHA256_DIGEST_LENGTH] = '\0';
+}
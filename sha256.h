@@ -0,0 +1,31 @@
+#ifndef _SHA256_H
+#define _SHA256_H
+
+/* $Id$ */
+
+/* SHA-256 (FIPS 180-4), for naming quarantined messages and for the
+   verdict caches */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+
+struct sha256_ctx {
+  uint32_t state[8];
+  uint64_t count;		/* bytes hashed so far */
+  unsigned char buf[64];
+};
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LENGTH]);
+void sha256_hex(const unsigned char digest[SHA256_DIGEST_LENGTH], char hex[2 * SHA256_DIGEST_LENGTH + 1]);
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Simhash (Charikar) fingerprints over word shingles.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+/* $Id$ */
+
+#include <string.h>
+
+#include "simhash.h"
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+/* splitmix64's finalizer, to spread a combination of word hashes over
+   all 64 bits */
+static uint64_t mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+void simhash_init(struct simhash *sh)
+{
+	memset(sh, 0, sizeof(*sh));
+}
+
+/* A word has ended: add the shingle it completes */
+static void end_word(struct simhash *sh)
+{
+	uint64_t h = sh->word;
+	int i;
+
+	sh->words++;
+	if (sh->words >= SIMHASH_SHINGLE)
+	{
+		for (i = 0; i < SIMHASH_SHINGLE - 1; i++)
+			h = mix(h ^ (sh->prev[i] + (uint64_t)(i + 1)));
+		for (i = 0; i < 64; i++)
+			sh->weights[i] += (h >> i) & 1 ? 1 : -1;
+	}
+	for (i = SIMHASH_SHINGLE - 2; i > 0; i--)
+		sh->prev[i] = sh->prev[i - 1];
+	sh->prev[0] = sh->word;
+	sh->inword = 0;
+}
+
+/* Feed more of the body.  Words are runs of letters and digits (and any
+   non-ASCII bytes), compared without regard to case, so a word split
+   between two calls is still one word. */
+void simhash_update(struct simhash *sh, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = p[i];
+
+		if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80)
+			;
+		else if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		else
+		{
+			if (sh->inword)
+				end_word(sh);
+			continue;
+		}
+		if (!sh->inword)
+		{
+			sh->word = FNV_OFFSET;
+			sh->inword = 1;
+		}
+		sh->word = (sh->word ^ c) * FNV_PRIME;
+	}
+}
+
+/* The fingerprint of what has been fed so far, and how many shingles it
+   was made from (a word still being read counts as ended) */
+uint64_t simhash_value(const struct simhash *sh, unsigned long *shingles)
+{
+	struct simhash s = *sh;
+	uint64_t v = 0;
+	int i;
+
+	if (s.inword)
+		end_word(&s);
+	for (i = 0; i < 64; i++)
+		if (s.weights[i] > 0)
+			v |= (uint64_t)1 << i;
+	if (shingles)
+		*shingles = s.words >= SIMHASH_SHINGLE ? s.words - SIMHASH_SHINGLE + 1 : 0;
+	return v;
+}
+
+/* Number of bits in which two fingerprints differ */
+int simhash_distance(uint64_t a, uint64_t b)
+{
+	uint64_t x = a ^ b;
+	int n = 0;
+
+	while (x)
+	{
+		x &= x - 1;
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,34 @@
+#ifndef _SIMHASH_H
+#define _SIMHASH_H
+
+/* $Id$ */
+
+/* Similarity fingerprints of message bodies for the -N near-duplicate
+   cache: bodies that differ in a few words get fingerprints that differ
+   in a few bits. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIMHASH_SHINGLE 3	/* words per shingle */
+
+struct simhash {
+  int32_t weights[64];		/* per bit: shingles with it set minus clear */
+  uint64_t word;		/* hash of the word being read */
+  uint64_t prev[SIMHASH_SHINGLE - 1];	/* hashes of the words before it */
+  int inword;
+  unsigned long words;		/* words seen so far */
+};
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+void simhash_init(struct simhash *sh);
+void simhash_update(struct simhash *sh, const void *data, size_t len);
+uint64_t simhash_value(const struct simhash *sh, unsigned long *shingles);
+int simhash_distance(uint64_t a, uint64_t b);
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,185 @@
+//
+//  $Id$
+//
+//  spamass-makelist - compile network and address lists for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+// Reads list files in the format -i, -T, -F, -K and -U accept (entries
+// separated by commas or white space, # comments) and writes a single
+// compiled list that the milter maps instead of parsing.  The output is
+// replaced atomically, so it is safe to recompile while the milter is
+// running and then send it SIGUSR1.
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#if !HAVE_DECL_STRSEP
+extern "C" char *strsep(char **stringp, const char *delim);
+#endif
+
+#include "listdb.h"
+
+static vector<struct netentry> nets;
+static vector<string> keys;
+static vector<string> digests;
+static int verbose;
+
+/* Add every entry in a text list file to nets or keys */
+static int read_list(const char *path)
+{
+	FILE *f;
+	char line[1024];
+	int lineno = 0;
+
+	if (strcmp(path, "-") == 0)
+		f = stdin;
+	else if (!(f = fopen(path, "r")))
+	{
+		fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f))
+	{
+		char *rest = line, *token, *hash;
+
+		lineno++;
+		if ((hash = strchr(line, '#')))
+			*hash = '\0';
+
+		while ((token = strsep(&rest, ", \t\r\n")))
+		{
+			string digest, domain;
+
+			if (*token == '\0')
+				continue;
+
+			/* nested list files, as the milter allows */
+			if (*token == '/')
+			{
+				if (read_list(token) < 0)
+					goto fail;
+				continue;
+			}
+
+			if (parse_digest(token, digest) == 0)
+				digests.push_back(digest);
+			else if (parse_domain(token, domain) == 0)
+				keys.push_back("@" + domain);
+			else if (strchr(token, '@'))
+			{
+				string addr = normalize_address(token);
+				string::size_type at = addr.find('@');
+
+				if (addr.find('.', at) == string::npos)
+				{
+					fprintf(stderr, "%s:%d: Could not parse \"%s\" as an email address\n",
+					        path, lineno, token);
+					goto fail;
+				}
+				keys.push_back(addr);
+			} else
+			{
+				struct netentry net;
+				char errbuf[1024];
+
+				if (parse_netentry(token, &net, errbuf, sizeof(errbuf)) < 0)
+				{
+					fprintf(stderr, "%s:%d: %s\n", path, lineno, errbuf);
+					goto fail;
+				}
+				nets.push_back(net);
+			}
+		}
+	}
+	if (ferror(f))
+	{
+		fprintf(stderr, "Error reading %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	if (f != stdin)
+		fclose(f);
+	return 0;
+
+fail:
+	if (f != stdin)
+		fclose(f);
+	return -1;
+}
+
+static void usage()
+{
+	cout << "Usage: spamass-makelist [-v] -o output listfile ..." << endl;
+	cout << "   -o output: compiled list to write (replaced atomically)" << endl;
+	cout << "   -v: report how many entries were compiled" << endl;
+	cout << "   listfile: text list of networks, addresses, domains and SHA-256\n"
+	        "          digests, - for stdin" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	char errbuf[1024];
+	int c, i;
+
+	while ((c = getopt(argc, argv, "o:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'o':
+				output = optarg;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				usage();
+				exit(EX_USAGE);
+		}
+	}
+	if (!output || optind == argc)
+	{
+		usage();
+		exit(EX_USAGE);
+	}
+
+	for (i = optind; i < argc; i++)
+		if (read_list(argv[i]) < 0)
+			exit(EX_DATAERR);
+
+	if (listdb_write(output, nets, keys, digests, errbuf, sizeof(errbuf)) < 0)
+	{
+		fprintf(stderr, "%s\n", errbuf);
+		exit(EX_CANTCREAT);
+	}
+	if (verbose)
+		printf("%s: %lu networks, %lu addresses, %lu digests\n", output,
+		       (unsigned long)nets.size(), (unsigned long)keys.size(),
+		       (unsigned long)digests.size());
+	return 0;
+}
+
+// vim6:ai:noexpandtab
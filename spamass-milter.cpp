@@ -89,6 +89,9 @@
 #endif
 #include <errno.h>
 #include <netdb.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <grp.h>
 #include <time.h>
 
@@ -98,6 +101,7 @@
 #include <csignal>
 #include <string>
 #include <iostream>
+#include <algorithm>
 
 #ifdef  __cplusplus
 extern "C" {
@@ -118,6 +122,12 @@ int daemon(int nochdir, int noclose);
 }
 #endif
 
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#define QUARANTINE_GZIP
+#endif
+
+#include "sha256.h"
 #include "spamass-milter.h"
 
 #ifdef WITH_DMALLOC
@@ -149,6 +159,11 @@ struct smfiDesc smfilter =
     mlfi_eom, // end of message callback
     mlfi_abort, // message aborted callback
     mlfi_close, // connection cleanup callback
+#ifdef HAVE_MILTER_SKIP
+    NULL, // unknown SMTP command callback
+    NULL, // DATA command callback
+    mlfi_negotiate, // option negotiation callback
+#endif
   };
 
 const char *const debugstrings[] = {
@@ -158,10 +173,6 @@ const char *const debugstrings[] = {
 };
 
 int flag_debug = (1<<D_ALWAYS);
-bool flag_reject = false;
-bool flag_random_defer = false;
-int reject_score = -1;
-int random_defer_score = -1;
 bool dontmodifyspam = false;    // Don't modify/add body or spam results headers
 bool dontmodify = false;        // Don't add SA headers, ever.
 bool flag_sniffuser = false;
@@ -169,23 +180,72 @@ char *defaultuser;				/* Username to send to spamc if there are multiple recipie
 char *defaultdomain;			/* Domain to append if incoming address has none */
 char *path_to_sendmail = (char *) SENDMAIL;
 char *spamdhost;
-char *rejecttext = NULL;				/* If we reject a mail, then use this text */
-char *rejectcode = NULL;				/* If we reject a mail, then use code */
-char *reject_reply_code = NULL;				/* If we reject a mail, then use smtp code */
-char *defercode = NULL;				/* If we reject a mail, then use code */
-char *defer_reply_code = NULL;				/* If we reject a mail, then use smtp code */
-struct networklist ignorenets;
-struct addresslist ignoreaddrs;
-int spamc_argc;
-char **spamc_argv;
 bool flag_bucket = false;
 bool flag_bucket_only = false;
 char *spambucket;
 bool flag_full_email = false;		/* pass full email address to spamc */
 bool flag_expand = false;	/* alias/virtusertable expansion */
+unsigned long expandcache_max = 0;	/* -X: cached expansions, 0 = no cache */
+long expandcache_ttl = 300;		/* seconds to keep an expansion */
+long expandcache_negttl = 60;		/* ... or a recipient with none */
+static list<struct expandentry> expandcache_lru;	/* most recent first */
+static unordered_map<string, list<struct expandentry>::iterator> expandcache_index;
+pthread_mutex_t expandcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long verdictcache_max = 0;	/* -H: cached verdicts, 0 = no cache */
+long verdictcache_ttl = 300;		/* seconds to keep a verdict */
+char *verdictcache_path;		/* -W: shared verdict cache file */
+unsigned long verdictcache_size;
+char *verdictcache_server;		/* -J: memcached shared by the fleet */
+bool flag_headerkey = false;		/* -k: look verdicts up at end of header */
+unsigned long fuzzycache_max = 0;	/* -N: near-duplicate verdicts, 0 = none */
+long fuzzycache_ttl = 300;
+long fuzzycache_distance = 6;		/* fingerprint bits that may differ */
+double bayes_confidence = 0;		/* -y: ham probability that skips spamd, 0 = off */
+unsigned long bayes_sample = 10;	/* ... though one in this many is scanned anyway */
+double reputation_volume = 0;		/* -G: recent messages before a source is judged, 0 = off */
+double reputation_ratio = 0.9;		/* ... the share of them that may be spam */
+long reputation_halflife = 3600;	/* ... and how fast they are forgotten */
+long greylist_delay = 0;		/* -w: seconds a new triplet is deferred, 0 = off */
+long greylist_lifetime = 36 * 24 * 3600;	/* ... and one that got through is kept */
+char *greylist_path;			/* ... and saved in this file */
+unsigned long strip_size = 0;		/* -s: bigger parts that are not text go unscanned, 0 = off */
+char *aliases_path;		/* -Y: expand with these files instead of sendmail */
+char *virtusers_path;
+char *localhosts_path;
+shared_ptr<const aliasmap> active_aliasmap;
+time_t aliasmap_checked;	/* when the -Y files were last looked at */
+pthread_mutex_t aliasmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+char *spool_dir;		/* -Q: queue bucket copies here */
+unsigned long spool_max = 1000;	/* copies that may be waiting */
+char *spool_transport;		/* smtp:host[:port] or lmtp:..., or NULL for sendmail */
+static list<struct spoolentry> spool_queue;	/* waiting for the spool thread */
+unsigned long spool_count;	/* copies queued or being delivered */
+pthread_mutex_t spool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t spool_cond = PTHREAD_COND_INITIALIZER;
+char *quarantine_dir;		/* -q: keep spam here */
+static list<struct quarantine_item *> quarantine_pending;	/* for the next commit */
+pthread_mutex_t quarantine_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t quarantine_cond = PTHREAD_COND_INITIALIZER;	/* work for the committer */
+pthread_cond_t quarantine_done = PTHREAD_COND_INITIALIZER;	/* a commit finished */
 bool warnedmacro = false;	/* have we logged that we couldn't fetch a macro? */
 bool auth = false;		/* don't scan authenticated users */
 bool alwaystag = false;
+unsigned long inflight_limit = 0;	/* max bytes buffered by all messages, 0 = no limit */
+unsigned long inflight_bytes = 0;	/* bytes currently buffered by all messages */
+pthread_mutex_t inflight_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long session_max = 0;		/* -j: spamc sessions at once, 0 = no limit */
+unsigned long session_queue;		/* ... messages that may wait for one */
+bool session_fifo = false;		/* ... in arrival order, not smallest first */
+static unsigned long sessions_active;	/* sessions running */
+static list<struct sessionwait *> session_waiting;	/* at end of message, next first */
+pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t session_cond = PTHREAD_COND_INITIALIZER;
+shared_ptr<const runtime_config> active_config;	/* current runtime settings */
+char *optionsfile = NULL;	/* -O: more runtime settings, re-read on reload */
+int saved_argc;			/* the command line, kept for reloads */
+char **saved_argv;
+
+static const char *optstring = "aAfd:mMp:P:r:l:u:D:i:b:B:e:H:N:xX:Y:S:R:c:C:g:T:L:F:O:Q:q:W:J:kK:U:E:y:G:w:j:s:";
 
 // {{{ main()
 
@@ -193,7 +253,6 @@ int
 main(int argc, char* argv[])
 {
    int c, err = 0;
-   const char *args = "aAfd:mMp:P:r:l:u:D:i:b:B:e:xS:R:c:C:g:T:";
    char *sock = NULL;
    char *group = NULL;
    bool dofork = false;
@@ -207,8 +266,11 @@ main(int argc, char* argv[])
     openlog("spamass-milter", LOG_PID, LOG_MAIL);
 
 
-    /* Process command line options */
-    while ((c = getopt(argc, argv, args)) != -1) {
+    /* Process command line options.  Those that can be changed at
+       runtime are handled by build_config() below. */
+    saved_argc = argc;
+    saved_argv = argv;
+    while ((c = getopt(argc, argv, optstring)) != -1) {
         switch (c) {
             case 'a':
                 auth = true;
@@ -232,10 +294,6 @@ main(int argc, char* argv[])
                 flag_full_email = true;
                 defaultdomain = strdup(optarg);
                 break;
-            case 'i':
-                debug(D_MISC, "Parsing ignore list");
-                parse_networklist(optarg, &ignorenets);
-                break;
             case 'm':
                 dontmodifyspam = true;
                 smfilter.xxfi_flags &= ~SMFIF_CHGBODY;
@@ -251,26 +309,45 @@ main(int argc, char* argv[])
             case 'P':
                 pidfilename = strdup(optarg);
                 break;
-            case 'r':
-                flag_reject = true;
-                reject_score = atoi(optarg);
+            case 'L':
+                inflight_limit = parse_size(optarg);
+                if (inflight_limit == 0)
+                {
+                    fprintf(stderr, "Could not parse \"%s\" as a size\n", optarg);
+                    err = 1;
+                }
+                break;
+            case 'j':
+                {
+                    char *end;
+
+                    session_max = strtoul(optarg, &end, 10);
+                    session_queue = 2 * session_max;
+                    if (*end == ',')
+                        session_queue = strtoul(end + 1, &end, 10);
+                    if (*end == ',' && (strcmp(end + 1, "size") == 0 || strcmp(end + 1, "fifo") == 0))
+                    {
+                        session_fifo = end[1] == 'f';
+                        end += strlen(end);
+                    }
+                    if (*end || session_max == 0)
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as sessions[,queue[,size|fifo]]\n", optarg);
+                        err = 1;
+                    }
+                }
                 break;
-            case 'l':
-                flag_random_defer = true;
-                random_defer_score = atoi(optarg);
+            case 's':
+                strip_size = parse_size(optarg);
+                if (strip_size == 0)
+                {
+                    fprintf(stderr, "Could not parse \"%s\" as a size\n", optarg);
+                    err = 1;
+                }
                 break;
             case 'S':
                 path_to_sendmail = strdup(optarg);
                 break;
-            case 'c':
-                reject_reply_code = strdup (optarg);
-                break;
-            case 'C':
-                rejectcode = strdup (optarg);
-                break;
-            case 'R':
-                rejecttext = strdup (optarg);
-                break;
             case 'u':
                 flag_sniffuser = true;
                 defaultuser = strdup(optarg);
@@ -299,9 +376,151 @@ main(int argc, char* argv[])
             case 'x':
                 flag_expand = true;
                 break;
-            case 'T':
-                debug(D_MISC, "Parsing recipient address ignore list");
-                parse_addresslist(optarg, &ignoreaddrs);
+            case 'X':
+                {
+                    long ttls[2] = { expandcache_ttl, expandcache_negttl };
+
+                    if (parse_cachespec(optarg, &expandcache_max, ttls, 2) < 0)
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as entries[,ttl[,negttl]]\n", optarg);
+                        err = 1;
+                    }
+                    expandcache_ttl = ttls[0];
+                    expandcache_negttl = ttls[1];
+                }
+                break;
+            case 'H':
+                if (parse_cachespec(optarg, &verdictcache_max, &verdictcache_ttl, 1) < 0)
+                {
+                    fprintf(stderr, "Could not parse \"%s\" as entries[,ttl]\n", optarg);
+                    err = 1;
+                }
+                break;
+            case 'N':
+                {
+                    long params[2] = { fuzzycache_ttl, fuzzycache_distance };
+
+                    if (parse_cachespec(optarg, &fuzzycache_max, params, 2) < 0 ||
+                        params[1] > FUZZY_MAXDISTANCE)
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as entries[,ttl[,bits]]\n", optarg);
+                        err = 1;
+                    }
+                    fuzzycache_ttl = params[0];
+                    fuzzycache_distance = params[1];
+                }
+                break;
+            case 'G':
+                {
+                    char *end;
+
+                    reputation_volume = strtod(optarg, &end);
+                    if (*end == ',')
+                        reputation_ratio = strtod(end + 1, &end);
+                    if (*end == ',')
+                        reputation_halflife = strtol(end + 1, &end, 10);
+                    if (*end || reputation_volume <= 0 || reputation_ratio <= 0 ||
+                        reputation_ratio > 1 || reputation_halflife <= 0)
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as volume[,ratio[,halflife]]\n", optarg);
+                        err = 1;
+                    }
+                }
+                break;
+            case 'w':
+                {
+                    char *end;
+
+                    greylist_delay = strtol(optarg, &end, 10);
+                    if (*end == ',')
+                        greylist_lifetime = strtol(end + 1, &end, 10);
+                    if (*end == ',')
+                    {
+                        greylist_path = strdup(end + 1);
+                        end += strlen(end);
+                    }
+                    /* a retry must come within GREYLIST_WINDOW */
+                    if (*end || greylist_delay <= 0 || greylist_delay >= GREYLIST_WINDOW ||
+                        greylist_lifetime <= 0 || (greylist_path && !*greylist_path))
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as delay[,lifetime[,file]]\n", optarg);
+                        err = 1;
+                    }
+                }
+                break;
+            case 'y':
+                {
+                    char *end;
+
+                    bayes_confidence = strtod(optarg, &end);
+                    if (*end == ',')
+                        bayes_sample = strtoul(end + 1, &end, 10);
+                    if (*end || bayes_confidence <= 0.5 || bayes_confidence >= 1 ||
+                        bayes_sample == 0)
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as confidence[,sample]\n", optarg);
+                        err = 1;
+                    }
+                }
+                break;
+            case 'Y':
+                {
+                    char *files = strdup(optarg), *f;
+
+                    flag_expand = true;
+                    if ((f = strsep(&files, ",")) && *f)
+                        aliases_path = f;
+                    if ((f = strsep(&files, ",")) && *f)
+                        virtusers_path = f;
+                    if ((f = strsep(&files, ",")) && *f)
+                        localhosts_path = f;
+                    if (files || !(aliases_path || virtusers_path))
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as aliases[,virtusertable[,local-host-names]]\n", optarg);
+                        err = 1;
+                    }
+                }
+                break;
+            case 'O':
+                optionsfile = strdup(optarg);
+                break;
+            case 'Q':
+                {
+                    char *spec = strdup(optarg), *f;
+
+                    spool_dir = strsep(&spec, ",");
+                    if ((f = strsep(&spec, ",")) && *f)
+                        spool_max = strtoul(f, NULL, 10);
+                    spool_transport = spec;
+                    if (!*spool_dir || spool_max == 0 ||
+                        (spool_transport && strncmp(spool_transport, "smtp:", 5) != 0 &&
+                         strncmp(spool_transport, "lmtp:", 5) != 0))
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as spooldir[,maxqueue[,transport]]\n", optarg);
+                        err = 1;
+                    }
+                }
+                break;
+            case 'q':
+                quarantine_dir = strdup(optarg);
+                break;
+            case 'J':
+                verdictcache_server = strdup(optarg);
+                break;
+            case 'k':
+                flag_headerkey = true;
+                break;
+            case 'W':
+                {
+                    char *spec = strdup(optarg);
+
+                    verdictcache_path = strsep(&spec, ",");
+                    if (!*verdictcache_path || !spec || !(verdictcache_size = parse_size(spec)))
+                    {
+                        fprintf(stderr, "Could not parse \"%s\" as file,size\n", optarg);
+                        err = 1;
+                    }
+                }
                 break;
             case '?':
                 err = 1;
@@ -315,17 +534,101 @@ main(int argc, char* argv[])
       err=1;
    }
 
-   /* remember the remainer of the arguments so we can pass them to spamc */
-   spamc_argc = argc - optind;
-   spamc_argv = argv + optind;
+   if (expandcache_max && !flag_expand)
+   {
+      fprintf(stderr, "-X flag requires -x\n");
+      err=1;
+   }
+
+   if (flag_headerkey && !verdictcache_max && !verdictcache_path && !verdictcache_server)
+   {
+      fprintf(stderr, "-k flag requires -H, -W or -J\n");
+      err=1;
+   }
+
+   if (!err && verdictcache_max && verdictcache_init(verdictcache_max, verdictcache_ttl) < 0)
+   {
+      fprintf(stderr, "Could not set up the verdict cache\n");
+      err=1;
+   }
+
+   if (!err && verdictcache_path)
+   {
+      char errbuf[1024];
+
+      if (verdictcache_attach(verdictcache_path, verdictcache_size, verdictcache_ttl,
+                              errbuf, sizeof(errbuf)) < 0)
+      {
+         fprintf(stderr, "%s\n", errbuf);
+         err=1;
+      }
+   }
+
+   if (!err && verdictcache_server)
+   {
+      char errbuf[1024];
+
+      if (verdictcache_remote(verdictcache_server, verdictcache_ttl, errbuf, sizeof(errbuf)) < 0)
+      {
+         fprintf(stderr, "%s\n", errbuf);
+         err=1;
+      }
+   }
+
+   if (!err && fuzzycache_max)
+      fuzzycache_init(fuzzycache_max, fuzzycache_ttl, fuzzycache_distance);
+
+   if (!err && reputation_volume > 0)
+      reputation_init(reputation_volume, reputation_ratio, reputation_halflife);
+
+   if (!err && greylist_delay > 0)
+   {
+      char errbuf[1024];
+
+      if (greylist_init(greylist_delay, greylist_lifetime, greylist_path, errbuf, sizeof(errbuf)) < 0)
+      {
+         fprintf(stderr, "%s\n", errbuf);
+         err = 1;
+      }
+   }
+
+   /* the lists, reject settings and spamc arguments */
+   if (!err)
+   {
+      struct runtime_config *cfg = build_config();
+      if (cfg)
+         install_config(cfg);
+      else
+         err = 1;
+   }
+
+   if (!err && (aliases_path || virtusers_path) && load_aliasmap() < 0)
+      err = 1;
+
+   if (spool_dir && !flag_bucket)
+   {
+      fprintf(stderr, "-Q flag requires -b or -B\n");
+      err=1;
+   } else if (!err && spool_dir && spool_init() < 0)
+      err = 1;
+
+   if (!err && quarantine_dir && quarantine_init() < 0)
+      err = 1;
 
    if (!sock || err) {
       cout << PACKAGE_NAME << " - Version " << PACKAGE_VERSION << endl;
       cout << "SpamAssassin Sendmail Milter Plugin" << endl;
       cout << "Usage: spamass-milter -p socket [-b|-B bucket] [-d xx[,yy...]] [-D host]" << endl;
       cout << "                      [-e defaultdomain] [-f] [-i networks] [-m] [-M]" << endl;
-      cout << "                      [-P pidfile] [-r nn] [-u defaultuser] [-x] [-a] [-A]" << endl;
-      cout << "                      [-T addresses]" << endl;
+      cout << "                      [-P pidfile] [-r nn] [-u defaultuser] [-x] [-X entries[,ttl[,negttl]]]" << endl;
+      cout << "                      [-Y aliases[,virtusertable[,local-host-names]]] [-a] [-A]" << endl;
+      cout << "                      [-T addresses] [-F addresses] [-L limit] [-O optionsfile]" << endl;
+      cout << "                      [-Q spooldir[,maxqueue[,transport]]] [-q quarantinedir]" << endl;
+      cout << "                      [-H entries[,ttl]] [-N entries[,ttl[,bits]]] [-W file,size]" << endl;
+      cout << "                      [-J host[:port][,timeout]] [-k] [-K hashes] [-U domains]" << endl;
+      cout << "                      [-E rulesfile[,threshold]] [-y confidence[,sample]]" << endl;
+      cout << "                      [-G volume[,ratio[,halflife]]] [-w delay[,lifetime[,file]]] [-s size]" << endl;
+      cout << "                      [-j sessions[,queue[,size|fifo]]]" << endl;
       cout << "                      [-c RejectRepyCode] [-C rejectcode] [-R rejectmsg] [-g group]" << endl;
       cout << "                      [-- spamc args ]" << endl;
       cout << "   -p socket: path to create socket" << endl;
@@ -338,43 +641,83 @@ main(int argc, char* argv[])
       cout << "   -D host: connect to spamd at remote host (deprecated)" << endl;
       cout << "   -e defaultdomain: pass full email address to spamc instead of just\n"
               "          username.  Uses 'defaultdomain' if there was none" << endl;
+      cout << "   -E rulesfile[,threshold]: match the header and body against the rules\n"
+              "          in this file, which skip or reject a message without scanning it,\n"
+              "          or add up to a score that rejects it at threshold (default 5)" << endl;
       cout << "   -f: fork into background" << endl;
       cout << "   -g group: socket group (perms to 660 as well)" << endl;
+      cout << "   -G volume[,ratio[,halflife]]: refuse recipients from addresses, or their\n"
+              "          /24 or /64, that sent at least volume messages lately, ratio\n"
+              "          (default 0.9) of them spam; counts halve every halflife seconds\n"
+              "          (default 3600)" << endl;
+      cout << "   -H entries[,ttl]: remember spamd's verdict on up to this many messages\n"
+              "          for ttl seconds (default 300) and reuse it for identical copies" << endl;
+      cout << "   -J host[:port][,timeout]: share verdicts as -H does with other hosts\n"
+              "          through this memcached, waiting at most timeout ms (default 100)" << endl;
+      cout << "   -k: look verdicts up by Message-ID:, From:, Subject:, recipients and\n"
+              "          sending network at end of header, and skip the body on a hit" << endl;
+      cout << "   -K hashes: reject messages whose body or any MIME part of it has one\n"
+              "          of these SHA-256 digests, without scanning them.\n"
+              "          /path reads digests from a feed or compiled list" << endl;
       cout << "   -i: skip (ignore) checks from these IPs or netblocks" << endl;
-      cout << "          example: -i 192.168.12.5,10.0.0.0/8,172.16.0.0/255.255.0.0" << endl;
+      cout << "          example: -i 192.168.12.5,10.0.0.0/8,!10.9.0.0/16,172.16.0.0/255.255.0.0\n"
+              "          !net excludes a smaller network; /path reads networks from a file" << endl;
       cout << "   -m: don't modify body, Content-type: or Subject:" << endl;
       cout << "   -M: don't modify the message at all" << endl;
+      cout << "   -N entries[,ttl[,bits]]: like -H, but reuse verdicts for messages whose\n"
+              "          body fingerprints differ in no more than bits (default 6) bits" << endl;
+      cout << "   -O optionsfile: read more of the -i, -T, -F, -K, -U, -E, -r, -l, -c,\n"
+              "          -C and -R options and spamc args from this file.  These options are\n"
+              "          re-read from the command line and the file on SIGUSR1." << endl;
       cout << "   -P pidfile: Put processid in pidfile" << endl;
+      cout << "   -Q spooldir[,maxqueue[,transport]]: queue the bucket copies of rejected\n"
+              "          spam in spooldir and deliver them in the background, through\n"
+              "          sendmail or transport (smtp:host[:port] or lmtp:host:port|/socket)" << endl;
+      cout << "   -q quarantinedir: store rejected and spam-flagged messages here" << endl;
       cout << "   -r nn: reject messages with a score >= nn with an SMTP error.\n"
               "          use -1 to reject any messages tagged by SA." << endl;
+      cout << "   -j sessions[,queue[,size|fifo]]: run no more than this many spamc at\n"
+              "          once, from end of message; up to queue (default twice sessions)\n"
+              "          more messages wait, smallest first unless fifo, and any more\n"
+              "          are deferred" << endl;
+      cout << "   -L limit: defer new messages while all messages in progress\n"
+              "          hold more than this many bytes (k, m, g suffixes allowed)" << endl;
       cout << "   -l nn: randomly defer messages with a score >= nn with an non permanent SMTP error.\n"
               "      Please be aware this will increase load." << endl;
       cout << "   -R RejectText: using this Reject Text." << endl;
+      cout << "   -s size: send spamd only a note of the size and type of any part that\n"
+              "          is not text and is bigger than this (k, m, g suffixes allowed)" << endl;
+      cout << "   -U domains: reject messages with a link to a host in one of these\n"
+              "          domains, without scanning them.  /path reads domains from a file" << endl;
       cout << "   -u defaultuser: pass the recipient's username to spamc.\n"
               "          Uses 'defaultuser' if there are multiple recipients." << endl;
+      cout << "   -W file,size: share verdicts as -H does through file, a cache of this\n"
+              "          many bytes (k, m, g suffixes allowed) that every milter process\n"
+              "          uses and restarts keep" << endl;
+      cout << "   -w delay[,lifetime[,file]]: defer mail from a /24 or /64, sender and\n"
+              "          recipient not seen for delay seconds; a retry that got through\n"
+              "          is remembered for lifetime seconds (default 36 days), in file" << endl;
       cout << "   -x: pass email address through alias and virtusertable expansion." << endl;
+      cout << "   -X entries[,ttl[,negttl]]: cache up to this many -x expansions for ttl\n"
+              "          seconds (default 300), or negttl (default 60) if none was deliverable" << endl;
+      cout << "   -y confidence[,sample]: learn from spamd's verdicts, and let through\n"
+              "          unscanned mail that is ham with this probability (as 0.999),\n"
+              "          except one in sample (default 10) of it" << endl;
+      cout << "   -Y aliases[,virtusertable[,local-host-names]]: like -x, but expand\n"
+              "          using these text files instead of running sendmail" << endl;
       cout << "   -a: don't scan messages over an authenticated connection." << endl;
-      cout << "   -A: Scan but only tag messages affected by -a, -T and -i, never reject or defer them." << endl;
+      cout << "   -A: Scan but only tag messages affected by -a, -F, -T and -i, never reject or defer them." << endl;
       cout << "   -T: skip (ignore) checks if any recipient is in this address list" << endl;
-      cout << "          example: -T foo@bar.com,spamlover@yourdomain.com" << endl;
+      cout << "          example: -T foo@bar.com,spamlover@yourdomain.com,@lists.example.com\n"
+              "          @domain matches a whole domain, @*.domain its subdomains;\n"
+              "          /path reads addresses from a file" << endl;
+      cout << "   -F: skip (ignore) checks if the envelope sender is in this address list\n"
+              "          (same format as -T)" << endl;
       cout << "   -- spamc args: pass the remaining flags to spamc." << endl;
 
       exit(EX_USAGE);
    }
 
-    /* Set standard reject text */
-    if (rejecttext == NULL) {
-        rejecttext = strdup ("Blocked by SpamAssassin");
-    }
-    if (rejectcode == NULL) {
-        rejectcode = strdup ("5.7.1");
-    }
-    if (reject_reply_code == NULL) {
-        reject_reply_code = strdup ("550");
-    }
-    defercode=to_nonpermanent(rejectcode);
-    defer_reply_code=to_nonpermanent(reject_reply_code);
-
     if (pidfilename)
     {
         unlink(pidfilename);
@@ -442,9 +785,69 @@ main(int argc, char* argv[])
 		}
 	}
 
+	/* Handle reload requests in a thread of their own; block the signal
+	   here so that libmilter's threads inherit the mask. */
+	{
+		sigset_t set;
+		pthread_t tid;
+
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+		if (pthread_create(&tid, NULL, reload_thread, NULL) != 0)
+		{
+			fprintf(stderr, "Could not start reload thread\n");
+			exit(EX_OSERR);
+		}
+		pthread_detach(tid);
+	}
+
+	if (spool_dir)
+	{
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, spool_thread, NULL) != 0)
+		{
+			fprintf(stderr, "Could not start spool thread\n");
+			exit(EX_OSERR);
+		}
+		pthread_detach(tid);
+	}
+
+	if (quarantine_dir)
+	{
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, quarantine_thread, NULL) != 0)
+		{
+			fprintf(stderr, "Could not start quarantine thread\n");
+			exit(EX_OSERR);
+		}
+		pthread_detach(tid);
+	}
+
+	if (greylist_delay > 0)
+	{
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, greylist_thread, NULL) != 0)
+		{
+			fprintf(stderr, "Could not start greylist thread\n");
+			exit(EX_OSERR);
+		}
+		pthread_detach(tid);
+	}
+
 	debug(D_ALWAYS, "spamass-milter %s starting", PACKAGE_VERSION);
 	err = smfi_main();
 	debug(D_ALWAYS, "spamass-milter %s exiting", PACKAGE_VERSION);
+	if (greylist_delay > 0)
+	{
+		char errbuf[1024];
+
+		if (greylist_save(errbuf, sizeof(errbuf)) < 0)
+			debug(D_ALWAYS, "%s", errbuf);
+	}
 	if (pidfilename)
 		unlink(pidfilename);
 	return err;
@@ -452,6 +855,330 @@ main(int argc, char* argv[])
 
 // }}}
 
+// {{{ Runtime configuration
+
+runtime_config::runtime_config():
+  rules(NULL),
+  flag_reject(false),
+  reject_score(-1),
+  flag_random_defer(false),
+  random_defer_score(-1),
+  rejecttext(NULL),
+  rejectcode(NULL),
+  reject_reply_code(NULL),
+  defercode(NULL),
+  defer_reply_code(NULL)
+{
+}
+
+runtime_config::~runtime_config()
+{
+	if (rules)
+		ruleset_free(rules);
+	free(rejecttext);
+	free(rejectcode);
+	free(reject_reply_code);
+	free(defercode);
+	free(defer_reply_code);
+}
+
+/* Return the settings in force right now.  Callers hold on to the
+   returned pointer for as long as they need a consistent view; a reload
+   never changes a snapshot that is in use. */
+shared_ptr<const runtime_config> current_config()
+{
+	return atomic_load(&active_config);
+}
+
+/* Make cfg the current configuration.  The previous one is freed once
+   the last message using it lets go. */
+void install_config(struct runtime_config *cfg)
+{
+	atomic_store(&active_config, shared_ptr<const runtime_config>(cfg));
+	/* spamc's arguments may be different now */
+	verdictcache_flush();
+}
+
+/* Report a problem with the configuration: on stderr while we are
+   starting up, and in the log for the benefit of reloads. */
+void config_error(const char *fmt, ...)
+{
+	char buf[1024];
+	va_list vl;
+
+	va_start(vl, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, vl);
+	va_end(vl);
+	fprintf(stderr, "%s\n", buf);
+	syslog(LOG_ERR, "%s", buf);
+}
+
+/* Apply one of the options that can be changed at runtime to cfg.
+   Returns 1 if it was one of those, 0 if it isn't, and -1 if its
+   argument is bad. */
+int parse_config_option(int c, char *arg, struct runtime_config *cfg)
+{
+	switch (c)
+	{
+		case 'i':
+			debug(D_MISC, "Parsing ignore list");
+			return parse_networklist(arg, &cfg->ignorenets) < 0 ? -1 : 1;
+		case 'T':
+			debug(D_MISC, "Parsing recipient address ignore list");
+			return parse_addresslist(arg, &cfg->ignoreaddrs) < 0 ? -1 : 1;
+		case 'F':
+			debug(D_MISC, "Parsing sender address allow list");
+			return parse_addresslist(arg, &cfg->allowsenders) < 0 ? -1 : 1;
+		case 'K':
+			debug(D_MISC, "Parsing content hash blocklist");
+			return parse_hashlist(arg, &cfg->blockhashes) < 0 ? -1 : 1;
+		case 'U':
+			debug(D_MISC, "Parsing URI domain blocklist");
+			return parse_domainlist(arg, &cfg->uriblock) < 0 ? -1 : 1;
+		case 'E':
+			debug(D_MISC, "Loading local rules");
+			return parse_rules(arg, cfg) < 0 ? -1 : 1;
+		case 'r':
+			cfg->flag_reject = true;
+			cfg->reject_score = atoi(arg);
+			return 1;
+		case 'l':
+			cfg->flag_random_defer = true;
+			cfg->random_defer_score = atoi(arg);
+			return 1;
+		case 'c':
+			free(cfg->reject_reply_code);
+			cfg->reject_reply_code = strdup(arg);
+			return 1;
+		case 'C':
+			free(cfg->rejectcode);
+			cfg->rejectcode = strdup(arg);
+			return 1;
+		case 'R':
+			free(cfg->rejecttext);
+			cfg->rejecttext = strdup(arg);
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Rewind getopt() so another argument vector can be parsed */
+static void reset_getopt()
+{
+#ifdef __GLIBC__
+	optind = 0;
+#else
+	optind = 1;
+#if HAVE_DECL_OPTRESET
+	optreset = 1;
+#endif
+#endif
+}
+
+/*
+   Read runtime options from the -O file.  It holds options exactly as
+   they would appear on the command line, spread over as many lines as
+   you like, with "double quotes" around arguments containing spaces and
+   # starting a comment line.  Anything after -- replaces the spamc
+   arguments from the command line.
+*/
+int read_optionsfile(const char *path, struct runtime_config *cfg)
+{
+	FILE *f;
+	char line[1024];
+	vector<string> words;
+	vector<char *> wargv;
+	int c, err = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+	{
+		config_error("Could not read options file %s: %s", path, strerror(errno));
+		return -1;
+	}
+	words.push_back(PACKAGE_NAME);
+	while (fgets(line, sizeof(line), f))
+	{
+		char *p = line;
+
+		while (*p)
+		{
+			string word;
+
+			while (isspace(*p))
+				p++;
+			if (*p == '\0' || (*p == '#' && words.size()))
+				break;
+			if (*p == '"')
+			{
+				for (p++; *p && *p != '"'; p++)
+					word += *p;
+				if (*p)
+					p++;
+			} else
+			{
+				for (; *p && !isspace(*p); p++)
+					word += *p;
+			}
+			words.push_back(word);
+		}
+	}
+	fclose(f);
+
+	for (vector<string>::size_type i = 0; i < words.size(); i++)
+		wargv.push_back(const_cast<char *>(words[i].c_str()));
+	wargv.push_back(NULL);
+
+	reset_getopt();
+	while ((c = getopt(wargv.size() - 1, &wargv[0], optstring)) != -1)
+	{
+		switch (parse_config_option(c, optarg, cfg))
+		{
+			case -1:
+				err = 1;
+				break;
+			case 0:
+				if (c != '?')
+					config_error("%s: -%c can only be given on the command line", path, c);
+				err = 1;
+				break;
+		}
+	}
+	if (optind < (int)words.size())
+		cfg->spamc_args.assign(words.begin() + optind, words.end());
+
+	return err ? -1 : 0;
+}
+
+/* Build a new runtime configuration from the saved command line and the
+   -O file.  Returns NULL if any of it is bad. */
+struct runtime_config *build_config()
+{
+	struct runtime_config *cfg = new runtime_config;
+	int c, err = 0;
+
+	reset_getopt();
+	while ((c = getopt(saved_argc, saved_argv, optstring)) != -1)
+	{
+		if (parse_config_option(c, optarg, cfg) < 0)
+			err = 1;
+	}
+
+	/* remember the remainer of the arguments so we can pass them to spamc */
+	cfg->spamc_args.assign(saved_argv + optind, saved_argv + saved_argc);
+
+	if (!err && optionsfile && read_optionsfile(optionsfile, cfg) < 0)
+		err = 1;
+
+	if (err)
+	{
+		delete cfg;
+		return NULL;
+	}
+
+	/* Set standard reject text */
+	if (cfg->rejecttext == NULL)
+		cfg->rejecttext = strdup("Blocked by SpamAssassin");
+	if (cfg->rejectcode == NULL)
+		cfg->rejectcode = strdup("5.7.1");
+	if (cfg->reject_reply_code == NULL)
+		cfg->reject_reply_code = strdup("550");
+	cfg->defercode = to_nonpermanent(cfg->rejectcode);
+	cfg->defer_reply_code = to_nonpermanent(cfg->reject_reply_code);
+
+	return cfg;
+}
+
+/* Reload the runtime configuration every time SIGUSR1 arrives.  SIGHUP
+   is taken by libmilter, which shuts down on it. */
+void *reload_thread(void *)
+{
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	for (;;)
+	{
+		struct runtime_config *cfg;
+
+		if (sigwait(&set, &sig) != 0)
+			continue;
+		debug(D_ALWAYS, "Reloading configuration");
+		cfg = build_config();
+		if (cfg)
+		{
+			install_config(cfg);
+			debug(D_ALWAYS, "Configuration reloaded");
+		} else
+			debug(D_ALWAYS, "Configuration reload failed; keeping the old settings");
+		if ((aliases_path || virtusers_path) && load_aliasmap() < 0)
+			debug(D_ALWAYS, "Alias reload failed; keeping the old aliases");
+	}
+	return NULL;
+}
+
+/* Every GREYLIST_SAVE seconds, forget the -w triplets that have expired
+   and save the rest */
+void *greylist_thread(void *)
+{
+	char errbuf[1024];
+
+	for (;;)
+	{
+		sleep(GREYLIST_SAVE);
+		greylist_expire();
+		if (greylist_save(errbuf, sizeof(errbuf)) < 0)
+			debug(D_ALWAYS, "%s", errbuf);
+	}
+	return NULL;
+}
+
+/* Load the -Y files and make them current.  Returns -1, leaving the old
+   maps in place, if they can't be loaded. */
+int load_aliasmap()
+{
+	char errbuf[1024];
+	struct aliasmap *map;
+
+	map = aliasmap_load(aliases_path, virtusers_path, localhosts_path, errbuf, sizeof(errbuf));
+	if (!map)
+	{
+		config_error("%s", errbuf);
+		return -1;
+	}
+	atomic_store(&active_aliasmap, shared_ptr<const aliasmap>(map));
+	return 0;
+}
+
+/* The current -Y maps, reloaded first if one of their files has
+   changed.  The files are looked at no more than once a second, by
+   whichever thread gets there first; the others carry on with the maps
+   they have. */
+shared_ptr<const aliasmap> current_aliasmap()
+{
+	shared_ptr<const aliasmap> map = atomic_load(&active_aliasmap);
+	time_t now = time(NULL);
+
+	if (pthread_mutex_trylock(&aliasmap_mutex) == 0)
+	{
+		if (now != aliasmap_checked)
+		{
+			aliasmap_checked = now;
+			if (aliasmap_changed(map.get()) && load_aliasmap() == 0)
+			{
+				debug(D_RCPT, "Aliases changed; reloaded");
+				map = atomic_load(&active_aliasmap);
+			}
+		}
+		pthread_mutex_unlock(&aliasmap_mutex);
+	}
+	return map;
+}
+
+// }}}
+
 /* Update a header if SA changes it, or add it if it is new. */
 void update_or_insert(SpamAssassin* assassin, SMFICTX* ctx, string oldstring, t_setter setter, const char *header )
 {
@@ -502,30 +1229,27 @@ int
 assassinate(SMFICTX* ctx, SpamAssassin* assassin)
 {
   struct context *sctx = (struct context*)smfi_getpriv(ctx);
-  // find end of header (eol in last line of header)
-  // and beginning of body
-  string::size_type eoh1 = assassin->d().find("\n\n");
-  string::size_type eoh2 = assassin->d().find("\n\r\n");
-  string::size_type eoh = (eoh1 < eoh2) ? eoh1 : eoh2;
-  string::size_type bob = assassin->d().find_first_not_of("\r\n", eoh);
-
-  if (bob == string::npos)
-  	bob = assassin->d().size();
+  const struct runtime_config *cfg = assassin->config.get();
+  string::size_type bob = body_offset(assassin->d());
 
   update_or_insert(assassin, ctx, assassin->spam_flag(), &SpamAssassin::set_spam_flag, "X-Spam-Flag");
   update_or_insert(assassin, ctx, assassin->spam_status(), &SpamAssassin::set_spam_status, "X-Spam-Status");
   update_or_insert(assassin, ctx, assassin->spam_relay_country(), &SpamAssassin::set_spam_relay_country, "X-Spam-Relay-Country");
   update_or_insert(assassin, ctx, assassin->spam_asn(), &SpamAssassin::set_spam_asn, "X-Spam-ASN");
 
+  /* -G: count the verdict against the address the message came from */
+  if (reputation_volume > 0 && !assassin->spam_status().empty())
+    reputation_update(assassin->connectip().c_str(), !assassin->spam_flag().empty());
+
   /* Summarily reject the message if SA tagged it, or if we have a minimum
      score, reject if it exceeds that score. */
-  if (flag_reject)
+  if (cfg->flag_reject)
   {
 	bool do_reject = false;
         bool do_defer = false;
-	if (reject_score == -1 && !assassin->spam_flag().empty())
+	if (cfg->reject_score == -1 && !assassin->spam_flag().empty())
 		do_reject = true;
-	if (reject_score != -1)
+	if (cfg->reject_score != -1)
 	{
 		int score, rv;
 		const char *spam_status = assassin->spam_status().c_str();
@@ -541,12 +1265,12 @@ assassinate(SMFICTX* ctx, SpamAssassin* assassin)
 		else
 		{
 			debug(D_MISC, "SA score: %d", score);
-			if (score >= reject_score)
+			if (score >= cfg->reject_score)
 				do_reject = true;
-                        if(flag_random_defer && score >= random_defer_score){
+                        if(cfg->flag_random_defer && score >= cfg->random_defer_score){
                                 int random_number, random_mod;
                                 srand ( time(NULL) );
-                                random_mod=score*4-3*random_defer_score-2;
+                                random_mod=score*4-3*cfg->random_defer_score-2;
                                 if(random_mod>2){
                                         random_number = rand() % random_mod;
                                 }else{
@@ -567,16 +1291,24 @@ assassinate(SMFICTX* ctx, SpamAssassin* assassin)
 	
 	if (do_reject || do_defer)
 	{
+		if (quarantine_dir)
+			quarantine_message(assassin, sctx->queueid, bob, do_reject ? "rejected" : "deferred");
+
                 if(do_defer){
-                        debug(D_ALWAYS, "Defering with %s %s: %s",const_cast<char*>(defer_reply_code), defercode, rejecttext);
-                        smfi_setreply(ctx, const_cast<char*>(defer_reply_code), defercode, rejecttext);
+                        debug(D_ALWAYS, "Defering with %s %s: %s",cfg->defer_reply_code, cfg->defercode, cfg->rejecttext);
+                        smfi_setreply(ctx, cfg->defer_reply_code, cfg->defercode, cfg->rejecttext);
                 }else{
-                        debug(D_ALWAYS, "Rejecting with %s %s: %s",const_cast<char*>(reject_reply_code), rejectcode, rejecttext);
-                        smfi_setreply(ctx, const_cast<char*>(reject_reply_code), rejectcode, rejecttext);
+                        debug(D_ALWAYS, "Rejecting with %s %s: %s",cfg->reject_reply_code, cfg->rejectcode, cfg->rejecttext);
+                        smfi_setreply(ctx, cfg->reject_reply_code, cfg->rejectcode, cfg->rejecttext);
                 }
 
 
-		if (flag_bucket)
+		if (flag_bucket && spool_dir)
+		{
+			/* Leave the copy to the spool thread so the client gets
+			   its answer now */
+			spool_message(assassin->d());
+		} else if (flag_bucket)
 		{
 			/* If we also want a copy of the spam, shell out to sendmail and
 			   send another copy.  The milter API will not let you send the
@@ -604,12 +1336,15 @@ assassinate(SMFICTX* ctx, SpamAssassin* assassin)
 			}
 		}
 		
-		if (do_reject && reject_reply_code[0]==52) return SMFIS_TEMPFAIL; // 4xx
+		if (do_reject && cfg->reject_reply_code[0]==52) return SMFIS_TEMPFAIL; // 4xx
 		if (do_reject) return SMFIS_REJECT;
                 if (do_defer) return SMFIS_TEMPFAIL;
 	}
   }
 
+  if (quarantine_dir && !assassin->spam_flag().empty())
+    quarantine_message(assassin, sctx->queueid, bob, "tagged");
+
   /* Drop the message into the spam bucket if it's spam */
   if ( flag_bucket ) {
         if (!assassin->spam_flag().empty()) {
@@ -638,7 +1373,8 @@ assassinate(SMFICTX* ctx, SpamAssassin* assassin)
   }
 
   update_or_insert(assassin, ctx, assassin->spam_report(), &SpamAssassin::set_spam_report, "X-Spam-Report");
-  update_or_insert(assassin, ctx, assassin->spam_prev_content_type(), &SpamAssassin::set_spam_prev_content_type, "X-Spam-Prev-Content-Type");
+  if (!assassin->stripped)
+    update_or_insert(assassin, ctx, assassin->spam_prev_content_type(), &SpamAssassin::set_spam_prev_content_type, "X-Spam-Prev-Content-Type");
   update_or_insert(assassin, ctx, assassin->spam_level(), &SpamAssassin::set_spam_level, "X-Spam-Level");
   update_or_insert(assassin, ctx, assassin->spam_checker_version(), &SpamAssassin::set_spam_checker_version, "X-Spam-Checker-Version");
 
@@ -651,9 +1387,17 @@ assassinate(SMFICTX* ctx, SpamAssassin* assassin)
   //  However, only issue the header replacement calls if the content has
   //  actually changed. If SA didn't change subject or content-type, don't
   //  replace here unnecessarily.
+  //
+  //  spamd never saw what -s took out of the body, so its copy of the body
+  //  must not replace the real one.
   if (!dontmodifyspam && assassin->spam_flag().size()>0)
     {
 	  update_or_insert(assassin, ctx, assassin->subject(), &SpamAssassin::set_subject, "Subject");
+	  if (assassin->stripped)
+	  {
+	    debug(D_MISC, "Attachments were left out, keeping the body");
+	    return SMFIS_CONTINUE;
+	  }
 	  update_or_insert(assassin, ctx, assassin->content_type(), &SpamAssassin::set_content_type, "Content-Type");
 
       // Replace body with the one SpamAssassin provided
@@ -667,6 +1411,58 @@ assassinate(SMFICTX* ctx, SpamAssassin* assassin)
   return SMFIS_CONTINUE;
 }
 
+// Reject a message on what -K, -U or -E found in it, with the reply -c, -C
+// and -R set, without waiting for spamd
+sfsistat
+reject_unscanned(SMFICTX* ctx, SpamAssassin* assassin)
+{
+  const struct runtime_config *cfg = assassin->config.get();
+  sfsistat status = cfg->reject_reply_code[0] == '4' ? SMFIS_TEMPFAIL : SMFIS_REJECT;
+
+  /* -G: spam found without spamd's help is spam all the same */
+  if (reputation_volume > 0)
+    reputation_update(assassin->connectip().c_str(), true);
+
+  debug(D_ALWAYS, "Rejecting with %s %s: %s", cfg->reject_reply_code, cfg->rejectcode, cfg->rejecttext);
+  smfi_setreply(ctx, cfg->reject_reply_code, cfg->rejectcode, cfg->rejecttext);
+  ((struct context *)smfi_getpriv(ctx))->assassin=NULL;
+  delete assassin;
+  return status;
+}
+
+// Act on the -E rule that decided the message: reject it as -K and -U
+// do, or let it through untouched, without waiting for spamd either way
+sfsistat
+rule_verdict(SMFICTX* ctx, SpamAssassin* assassin)
+{
+  const struct rulestate& st = assassin->rulestate;
+
+  if (st.verdict == RULE_SKIP)
+  {
+    debug(D_ALWAYS, "Rule %s matched - accepting without scanning", st.matched.c_str());
+    ((struct context *)smfi_getpriv(ctx))->assassin=NULL;
+    delete assassin;
+    return SMFIS_ACCEPT;
+  }
+  debug(D_ALWAYS, "Rule %s matched, local score %.1f - rejecting", st.matched.c_str(), st.score);
+  return reject_unscanned(ctx, assassin);
+}
+
+// find end of header (eol in last line of header) and return where the
+// body begins
+string::size_type
+body_offset(const string& msg)
+{
+  string::size_type eoh1 = msg.find("\n\n");
+  string::size_type eoh2 = msg.find("\n\r\n");
+  string::size_type eoh = (eoh1 < eoh2) ? eoh1 : eoh2;
+  string::size_type bob = msg.find_first_not_of("\r\n", eoh);
+
+  if (bob == string::npos)
+  	bob = msg.size();
+  return bob;
+}
+
 // retrieve the content of a specific field in the header
 // and return it.
 string
@@ -766,8 +1562,14 @@ mlfi_connect(SMFICTX * ctx, char *hostname, _SOCK_ADDR * hostaddr)
 
 	debug(D_FUNC, "mlfi_connect: enter");
 
-	/* allocate a structure to store the IP address (and SA object) in */
-	sctx = (struct context *)malloc(sizeof(*sctx));
+	/* allocate a structure to store the IP address (and SA object) in,
+	   unless mlfi_negotiate already has */
+	sctx = (struct context *)smfi_getpriv(ctx);
+	if (!sctx)
+	{
+		sctx = (struct context *)malloc(sizeof(*sctx));
+		sctx->mta_skip = false;
+	}
 	if (!hostaddr)
 	{
 		static struct sockaddr_in localhost;
@@ -792,6 +1594,7 @@ mlfi_connect(SMFICTX * ctx, char *hostname, _SOCK_ADDR * hostaddr)
 	sctx->auth_authen = NULL;
 	sctx->auth_ssf = NULL;
         sctx->onlytag=false;
+	sctx->ignored = false;
 
 	/* store our FQDN */
 	macro_j = smfi_getsymval(ctx, const_cast<char *>("j"));
@@ -822,11 +1625,12 @@ mlfi_connect(SMFICTX * ctx, char *hostname, _SOCK_ADDR * hostaddr)
 
 	//debug(D_FUNC, "sctx->connect_ip: `%d'", sctx->connect_ip.sin_family);
 
-	if (ip_in_networklist(hostaddr, &ignorenets))
+	if (ip_in_networklist(hostaddr, &current_config()->ignorenets))
 	{
 		debug(D_NET, "%s is in our ignore list - accepting message",
 		      sctx->connect_ip);
                 sctx->onlytag=true;
+		sctx->ignored = true;
                 if(!alwaystag){
                       debug(D_FUNC, "mlfi_connect: exit ignore");
                       return SMFIS_ACCEPT;
@@ -866,6 +1670,8 @@ mlfi_envfrom(SMFICTX* ctx, char** envfrom)
   SpamAssassin* assassin;
   struct context *sctx = (struct context *)smfi_getpriv(ctx);
   const char *queueid, *macro_auth_ssf, *macro_auth_authen;
+  shared_ptr<const runtime_config> cfg = current_config();
+  unsigned long declared;
 
   if (sctx == NULL)
   {
@@ -874,6 +1680,10 @@ mlfi_envfrom(SMFICTX* ctx, char** envfrom)
   }
   /* debug(D_ALWAYS, "ZZZ got private context %p", sctx); */
 
+  /* an allowed sender or ignored recipient earlier in the connection
+     says nothing about this message */
+  sctx->onlytag = sctx->ignored;
+
   if (auth) {
     const char *auth_type = smfi_getsymval(ctx,
         const_cast<char *>("{auth_type}"));
@@ -889,6 +1699,30 @@ mlfi_envfrom(SMFICTX* ctx, char** envfrom)
   }
 
   debug(D_FUNC, "mlfi_envfrom: enter");
+
+  if (addr_in_addresslist(envfrom[0], &cfg->allowsenders))
+  {
+    debug(D_RCPT, "%s is in our sender allow list - accepting message", envfrom[0]);
+    sctx->onlytag=true;
+    if(!alwaystag){
+      debug(D_FUNC, "mlfi_envfrom: exit allowed sender");
+      return SMFIS_ACCEPT;
+    }
+  }
+
+  // the client's SIZE= says how big the message will be, which is as
+  // good a reason to defer it now as any
+  declared = declared_size(envfrom);
+  if (inflight_over_limit(declared))
+  {
+    debug(D_ALWAYS, "%lu bytes in progress and %lu declared exceed limit of %lu - deferring message",
+          inflight_current(), declared, inflight_limit);
+    smfi_setreply(ctx, const_cast<char*>("452"), const_cast<char*>("4.3.1"),
+                  const_cast<char*>("Insufficient system resources, try again later"));
+    debug(D_FUNC, "mlfi_envfrom: exit over limit");
+    return SMFIS_TEMPFAIL;
+  }
+
   try {
     // launch new SpamAssassin
     assassin=new SpamAssassin;
@@ -900,6 +1734,41 @@ mlfi_envfrom(SMFICTX* ctx, char** envfrom)
 
   assassin->set_connectip(string(sctx->connect_ip));
 
+  // the whole message is handled with the settings in force now
+  assassin->config = cfg;
+  assassin->hashing = !cfg->blockhashes.empty();
+  assassin->scanning = !cfg->uriblock.empty();
+  assassin->ruling = cfg->rules != NULL;
+  assassin->mimehash.digest = assassin->hashing;
+  assassin->mimehash.wanted = part_blocked;
+  assassin->mimehash.wantedarg = assassin;
+  if (assassin->ruling)
+    rulestate_init(cfg->rules, &assassin->rulestate);
+  if (assassin->scanning || assassin->ruling || assassin->classifying)
+  {
+    assassin->mimehash.text = body_text;
+    assassin->mimehash.textarg = assassin;
+  }
+  if (assassin->stripping)
+  {
+    assassin->mimehash.pass = body_pass;
+    assassin->mimehash.passarg = assassin;
+  }
+
+  // A message declared too big to hold back goes straight to spamc, and
+  // so does one picked as a -y sample, which spamd sees anyway.  A client
+  // that declares less than it sends is caught by mlfi_body().
+  assassin->declared = declared;
+  if (declared > VERDICT_MAXSIZE && !assassin->stripping &&
+      (assassin->digesting || assassin->classifying))
+  {
+    debug(D_MISC, "SIZE=%lu too big to hold back", declared);
+    assassin->digesting = false;
+    assassin->classifying = false;
+  }
+  if (assassin->classifying && random() % bayes_sample == 0)
+    assassin->sampled = true;
+
   // Store a pointer to the assassin object in our context struct
   sctx->assassin = assassin;
 
@@ -962,11 +1831,10 @@ mlfi_envrcpt(SMFICTX* ctx, char** envrcpt)
 {
 	struct context *sctx = (struct context*)smfi_getpriv(ctx);
 	SpamAssassin* assassin = sctx->assassin;
-	FILE *p;
 
 	debug(D_FUNC, "mlfi_envrcpt: enter");
 
-   if (addr_in_addresslist(envrcpt[0], &ignoreaddrs))
+   if (addr_in_addresslist(envrcpt[0], &assassin->config->ignoreaddrs))
    {
       debug(D_RCPT, "%s is in our ignore addrlist - accepting message", envrcpt[0]);
       sctx->onlytag=true;
@@ -976,57 +1844,47 @@ mlfi_envrcpt(SMFICTX* ctx, char** envrcpt)
       }
    }
 
-	if (flag_expand)
+	/* -G: a source that has lately sent little but spam is turned away
+	   before it can send another message */
+	if (reputation_volume > 0 && !sctx->onlytag)
 	{
-		/* open a pipe to sendmail so we can do address expansion */
-
-		char buf[1024];
-		char *popen_argv[4];
-		pid_t pid;
+		const struct runtime_config *cfg = assassin->config.get();
+		double spam, total;
 
-		popen_argv[0] = path_to_sendmail;
-		popen_argv[1] = (char *)"-bv";
-		popen_argv[2] = envrcpt[0];
-		popen_argv[3] = NULL;
+		if (reputation_bad(sctx->connect_ip, &spam, &total))
+		{
+			debug(D_ALWAYS, "%s sent %.1f spam in %.1f messages lately - refusing %s",
+			      sctx->connect_ip, spam, total, envrcpt[0]);
+			smfi_setreply(ctx, cfg->reject_reply_code, cfg->rejectcode, cfg->rejecttext);
+			debug(D_FUNC, "mlfi_envrcpt: exit reputation");
+			return cfg->reject_reply_code[0] == '4' ? SMFIS_TEMPFAIL : SMFIS_REJECT;
+		}
+	}
 
-		debug(D_RCPT, "calling %s -bv %s", path_to_sendmail, envrcpt[0]);
+	/* -w: mail from a network, sender and recipient not seen before has
+	   to come back later */
+	if (greylist_delay > 0 && !sctx->onlytag)
+	{
+		const struct runtime_config *cfg = assassin->config.get();
+		long wait;
 
-		p = popenv(popen_argv, "r", &pid);
-		if (!p)
-		{
-			debug(D_RCPT, "popenv failed(%s).  Will not expand aliases", strerror(errno));
-			assassin->expandedrcpt.push_back(envrcpt[0]);
-		} else
+		if (!greylist_check(sctx->connect_ip, assassin->from().c_str(), envrcpt[0], &wait))
 		{
-			while (fgets(buf, sizeof(buf), p) != NULL)
-			{
-				int i = strlen(buf);
-				/* strip trailing EOLs */
-				while (i > 0 && buf[i - 1] <= ' ')
-					i--;
-				buf[i] = '\0';
-				debug(D_RCPT, "sendmail output: %s", buf);
-				/*	From a quick scan of the sendmail source, a valid email
-					address gets printed via either
-					    "deliverable: mailer %s, host %s, user %s"
-					or  "deliverable: mailer %s, user %s"
-				*/
-				if (strstr(buf, "... deliverable: mailer "))
-				{
-					char *p=strstr(buf,", user ");
-					/* anything after ", user " is the email address */
-					debug(D_RCPT, "user: %s", p+7);
-					assassin->expandedrcpt.push_back(p+7);
-				}
-			}
-			fclose(p); p = NULL;
-			waitpid(pid, NULL, 0);
+			debug(D_MISC, "Greylisting %s from %s to %s for %ld more seconds",
+			      sctx->connect_ip, assassin->from().c_str(), envrcpt[0], wait);
+			smfi_setreply(ctx, cfg->defer_reply_code, cfg->defercode,
+			              const_cast<char*>("Greylisted, please try again later"));
+			debug(D_FUNC, "mlfi_envrcpt: exit greylist");
+			return SMFIS_TEMPFAIL;
 		}
-	} else
-	{
-		assassin->expandedrcpt.push_back(envrcpt[0]);
 	}
-	debug(D_RCPT, "Total of %d actual recipients", (int)assassin->expandedrcpt.size());
+
+	/* Expansion waits until mlfi_eoh(), so that all the recipients can
+	   go to one sendmail -bv */
+	if (flag_expand)
+		assassin->unexpandedrcpt.push_back(envrcpt[0]);
+	else
+		assassin->expandedrcpt.push_back(envrcpt[0]);
 
 	if (assassin->numrcpt() == 0)
 	{
@@ -1140,14 +1998,6 @@ mlfi_envrcpt(SMFICTX* ctx, char** envrcpt)
 	/* increment RCPT TO: count */
 	assassin->set_numrcpt();
 
-	/* If we expanded to at least one user and we haven't recorded one yet,
-	   record the first one */
-	if (!assassin->expandedrcpt.empty() && (assassin->rcpt().size() == 0))
-	{
-		debug(D_RCPT, "remembering %s for spamc", assassin->expandedrcpt.front().c_str());
-		assassin->set_rcpt(assassin->expandedrcpt.front());
-	}
-
 	debug(D_RCPT, "remembering recipient %s", envrcpt[0]);
 	assassin->recipients.push_back( envrcpt[0] ); // XXX verify that this worked
 
@@ -1165,8 +2015,8 @@ mlfi_envrcpt(SMFICTX* ctx, char** envrcpt)
 // only exception: SpamAssassin header fields (X-Spam-*) get suppressed
 // but are being stored in the SpamAssassin element.
 //
-// this function also starts the connection with the SPAMC program the
-// first time it is called.
+// the headers are buffered until mlfi_eoh() starts spamc, which is when
+// the recipients have been expanded and spamc's username is known.
 //
 
 sfsistat
@@ -1175,22 +2025,6 @@ mlfi_header(SMFICTX* ctx, char* headerf, char* headerv)
   SpamAssassin* assassin = ((struct context *)smfi_getpriv(ctx))->assassin;
   debug(D_FUNC, "mlfi_header: enter");
 
-  // Check if the SPAMC program has already been run, if not we run it.
-  if ( !(assassin->connected) )
-     {
-       try {
-         assassin->connected = 1; // SPAMC is getting ready to run
-         assassin->Connect();
-       }
-       catch (string& problem) {
-         throw_error(problem);
-         ((struct context *)smfi_getpriv(ctx))->assassin=NULL;
-         delete assassin;
-         debug(D_FUNC, "mlfi_header: exit error connect");
-         return SMFIS_TEMPFAIL;
-       };
-     }
-
   // Is it a "X-Spam-" header field?
   if ( cmp_nocase_partial("X-Spam-", headerf) == 0 )
     {
@@ -1233,6 +2067,52 @@ mlfi_header(SMFICTX* ctx, char* headerf, char* headerv)
   if ( cmp_nocase_partial("Subject", headerf) == 0 )
     assassin->set_subject(headerv);
 
+  // The fields that set copies of one mailing apart, for the -H key
+  if ( assassin->digesting &&
+       ( cmp_nocase_partial("Subject", headerf) == 0 ||
+         cmp_nocase_partial("From", headerf) == 0 ||
+         cmp_nocase_partial("Content-Type", headerf) == 0 ))
+    {
+      string field = normalize_field(headerf, headerv);
+      sha256_update(&assassin->digest, field.data(), field.size());
+    }
+
+  // The type and encoding of the body, for -K, -U, -E and -y
+  if (assassin->hashing || assassin->scanning || assassin->ruling || assassin->classifying ||
+      assassin->stripping)
+    mimehash_header(&assassin->mimehash, headerf, headerv);
+
+  // Subject: and From: hold words for the -y classifier as well as the text
+  if ( assassin->classifying &&
+       ( cmp_nocase_partial("Subject", headerf) == 0 ||
+         cmp_nocase_partial("From", headerf) == 0 ))
+    {
+      bayes_field(&assassin->bayes, headerf);
+      bayes_update(&assassin->bayes, headerv, strlen(headerv));
+    }
+
+  // An -E rule may settle it on the header alone; -A messages are only
+  // ever tagged
+  if (assassin->ruling && !((struct context *)smfi_getpriv(ctx))->onlytag &&
+      ruleset_header(assassin->config->rules, &assassin->rulestate, headerf, headerv) != RULE_NONE)
+    {
+      debug(D_FUNC, "mlfi_header: exit rule");
+      return rule_verdict(ctx, assassin);
+    }
+
+  // ... and those that make up the -k key, which only a Message-ID: makes
+  // specific enough
+  if ( flag_headerkey &&
+       ( cmp_nocase_partial("Message-ID", headerf) == 0 ||
+         cmp_nocase_partial("Subject", headerf) == 0 ||
+         cmp_nocase_partial("From", headerf) == 0 ))
+    {
+      string field = normalize_field(headerf, headerv);
+      sha256_update(&assassin->headerdigest, field.data(), field.size());
+      if ( cmp_nocase_partial("Message-ID", headerf) == 0 )
+        assassin->has_msgid = true;
+    }
+
   // assemble header to be written to SpamAssassin
   string header = headerv;
 
@@ -1273,8 +2153,9 @@ mlfi_header(SMFICTX* ctx, char* headerf, char* headerv)
 //
 // Gets called once when the header is finished.
 //
-// writes empty line to SpamAssassin client to separate
-// headers from body.
+// expands the recipients, starts the SPAMC program (unless -H, -N or -y hold
+// it back until the end of the message) and writes the buffered headers and
+// an empty line to separate them from the body.
 //
 sfsistat
 mlfi_eoh(SMFICTX* ctx)
@@ -1283,8 +2164,83 @@ mlfi_eoh(SMFICTX* ctx)
 
   debug(D_FUNC, "mlfi_eoh: enter");
 
+  // Don't start another spamc if we are already holding too much mail
+  if (inflight_over_limit())
+  {
+    debug(D_ALWAYS, "%lu bytes in progress exceeds limit of %lu - deferring message",
+          inflight_current(), inflight_limit);
+    smfi_setreply(ctx, const_cast<char*>("452"), const_cast<char*>("4.3.1"),
+                  const_cast<char*>("Insufficient system resources, try again later"));
+    ((struct context *)smfi_getpriv(ctx))->assassin=NULL;
+    delete assassin;
+    debug(D_FUNC, "mlfi_eoh: exit over limit");
+    return SMFIS_TEMPFAIL;
+  }
+
+  resolve_recipients(assassin);
+
+  // -A: messages that are only tagged aren't rejected by -K, -U or -E
+  // either
+  if (((struct context *)smfi_getpriv(ctx))->onlytag)
+  {
+    assassin->hashing = false;
+    assassin->scanning = false;
+    assassin->ruling = false;
+  }
+
+  // Hold spamc back until we know whether the -H or -N caches have seen this
+  // message before; the message is buffered meanwhile.  -k applies as well
+  // to a message declared too big for that.
+  if (assassin->digesting || (flag_headerkey && assassin->has_msgid))
+     {
+       // The key also covers who spamc asks for and how, since -W
+       // verdicts outlive a change of arguments
+       string spamc = assassin->spamc_user() + "\n";
+
+       if (spamdhost)
+         spamc += string("-d ") + spamdhost + "\n";
+       for (vector<string>::size_type i = 0; i < assassin->config->spamc_args.size(); i++)
+         spamc += assassin->config->spamc_args[i] + "\n";
+       if (assassin->digesting)
+         sha256_update(&assassin->digest, spamc.data(), spamc.size());
+
+       // With -k a verdict may already be known from the header alone
+       if (flag_headerkey && assassin->has_msgid)
+         {
+           bool onlytag = ((struct context *)smfi_getpriv(ctx))->onlytag;
+
+           sha256_update(&assassin->headerdigest, spamc.data(), spamc.size());
+           assassin->headerkey = header_key(assassin);
+           if (verdictcache_lookup(assassin->headerkey, assassin->headerverdict) &&
+               header_verdict_usable(assassin, assassin->headerverdict, onlytag))
+             {
+               debug(D_MISC, "verdict cache hit on header");
+               assassin->headerhit = true;
+             }
+         }
+     }
+
+  // What follows is the body, as far as the -y classifier is concerned
+  if (assassin->classifying)
+    bayes_field(&assassin->bayes, NULL);
+
+  // With -j the body is held back, since spamc only takes up a session
+  // at end of message; but if that looks hopeless, say so now
+  if (session_max && !assassin->headerhit && session_full())
+  {
+    debug(D_ALWAYS, "All %lu spamc sessions in use and %lu messages waiting - deferring message",
+          session_max, session_queue);
+    smfi_setreply(ctx, const_cast<char*>("452"), const_cast<char*>("4.3.2"),
+                  const_cast<char*>("Too many messages waiting for scanning, try again later"));
+    ((struct context *)smfi_getpriv(ctx))->assassin=NULL;
+    delete assassin;
+    debug(D_FUNC, "mlfi_eoh: exit sessions full");
+    return SMFIS_TEMPFAIL;
+  }
+
   // Check if the SPAMC program has already been run, if not we run it.
-  if ( !(assassin->connected) )
+  if ( !(assassin->connected) && !(assassin->digesting) && !(assassin->headerhit) &&
+       !(assassin->classifying && !assassin->sampled) && session_max == 0 )
      {
        try {
          assassin->connected = 1; // SPAMC is getting ready to run
@@ -1300,6 +2256,19 @@ mlfi_eoh(SMFICTX* ctx)
        };
      }
 
+  // Make room up front for as much as SIZE= says is held back, if -L
+  // allows it; the room counts towards -L from now on
+  if (assassin->declared && !assassin->connected && !assassin->headerhit)
+  {
+    string::size_type room = min(assassin->declared, (unsigned long)SIZE_RESERVE_MAX);
+
+    if (!inflight_over_limit(room))
+    {
+      assassin->outputbuffer.reserve(assassin->outputbuffer.size() + room);
+      assassin->account();
+    }
+  }
+
   try {
     // add blank line between header and body
     assassin->output("\r\n",2);
@@ -1319,6 +2288,67 @@ mlfi_eoh(SMFICTX* ctx)
   return SMFIS_CONTINUE;
 }
 
+//
+// Takes a -j session for the message's spamc at end of message, waiting
+// for one if need be; throws if none can be had
+//
+void
+get_session(SpamAssassin* assassin)
+{
+  if (session_max == 0 || assassin->has_session)
+    return;
+  // what is held back is all spamc will get, so its size is known
+  switch (session_wait(assassin->outputbuffer.size()))
+  {
+    case 0:
+      throw string("timed out waiting for a spamc session");
+    case -1:
+      throw string("too many messages waiting for spamc");
+  }
+  assassin->has_session = true;
+}
+
+//
+// Passes a piece of the body on to spamc, or holds it back while -H, -N
+// or -y might find spamd is not needed
+//
+static void
+send_body(SpamAssassin* assassin, const void* data, size_t len)
+{
+  // Too big to hold back any longer: scan it the usual way
+  if ((assassin->digesting || (assassin->classifying && !assassin->sampled)) &&
+      assassin->outputbuffer.size() + len > VERDICT_MAXSIZE)
+  {
+    debug(D_MISC, "message too big to hold back");
+    assassin->digesting = false;
+    assassin->classifying = false;
+    // with -j it waits for end of message all the same
+    if (session_max == 0)
+    {
+      assassin->connected = 1;
+      assassin->Connect();
+    }
+  }
+  // -j holds the body until end of message, but not past -L: once it
+  // would take the total there, spamc starts now if a session is free,
+  // and otherwise the message is deferred
+  if (session_max && !assassin->connected && !assassin->headerhit &&
+      !assassin->digesting && !(assassin->classifying && !assassin->sampled) &&
+      inflight_over_limit(len))
+  {
+    if (!session_try())
+      throw string("message in progress limit reached with no spamc session free");
+    debug(D_MISC, "message in progress limit reached, starting spamc now");
+    assassin->has_session = true;
+    assassin->connected = 1;
+    assassin->Connect();
+  }
+  // the -k key still applies to a message too big for -H
+  if (assassin->digesting || !assassin->headerkey.empty())
+    sha256_update(&assassin->bodydigest, data, len);
+  assassin->output(data, len);
+}
+
 //
 // Gets called repeatedly to transmit the body
 //
@@ -1331,8 +2361,52 @@ mlfi_body(SMFICTX* ctx, u_char *bodyp, size_t bodylen)
   SpamAssassin* assassin = ((struct context *)smfi_getpriv(ctx))->assassin;
 
 
+  if (assassin->hashing || assassin->scanning || assassin->ruling || assassin->classifying ||
+      assassin->stripping)
+    mimehash_update(&assassin->mimehash, bodyp, bodylen);
+
+  // A link into a -U domain settles it, as does an -E rule
+  if (assassin->scanning && uri_blocked(assassin))
+  {
+    debug(D_FUNC, "mlfi_body: exit blocked URI");
+    return reject_unscanned(ctx, assassin);
+  }
+  if (assassin->ruling && assassin->rulestate.verdict != RULE_NONE)
+  {
+    debug(D_FUNC, "mlfi_body: exit rule");
+    return rule_verdict(ctx, assassin);
+  }
+
+  // The -k verdict is known, so the body is of no interest beyond -K,
+  // -U and -E
+  if (assassin->headerhit)
+  {
+    debug(D_FUNC, "mlfi_body: exit skip");
+    assassin->strippedbody.clear();
+#ifdef HAVE_MILTER_SKIP
+    if (((struct context *)smfi_getpriv(ctx))->mta_skip && !assassin->hashing && !assassin->scanning && !assassin->ruling)
+      return SMFIS_SKIP;
+#endif
+    return SMFIS_CONTINUE;
+  }
+
   try {
-    assassin->output(bodyp, bodylen);
+    // with -s, what mimehash has let through so far
+    if (assassin->stripping)
+    {
+      send_body(assassin, assassin->strippedbody.data(), assassin->strippedbody.size());
+      assassin->strippedbody.clear();
+    } else
+      send_body(assassin, bodyp, bodylen);
+    // the cache key is made from the body as it arrived, before -s
+    // takes anything out of it: the same body is always stripped the
+    // same way, so the key still stands for what spamd was sent
+    if (assassin->digesting)
+    {
+      sha256_update(&assassin->digest, bodyp, bodylen);
+      if (fuzzycache_max)
+        simhash_update(&assassin->fingerprint, bodyp, bodylen);
+    }
   } catch (string& problem)
     {
       throw_error(problem);
@@ -1362,6 +2436,96 @@ mlfi_eom(SMFICTX* ctx)
 
   debug(D_FUNC, "mlfi_eom: enter");
   try {
+    string key;
+    struct verdict v;
+
+    // Content on the -K blocklist, or a link in the last line into a -U
+    // domain, is rejected without asking spamd; the last line may also
+    // decide an -E rule
+    if (assassin->hashing || assassin->scanning || assassin->ruling || assassin->classifying ||
+        assassin->stripping)
+    {
+      vector<string> digests;
+
+      mimehash_final(&assassin->mimehash, digests);
+      if (content_blocked(assassin, digests) || uri_blocked(assassin))
+      {
+        debug(D_FUNC, "mlfi_eom: exit blocked content");
+        return reject_unscanned(ctx, assassin);
+      }
+      if (assassin->ruling && assassin->rulestate.verdict != RULE_NONE)
+      {
+        debug(D_FUNC, "mlfi_eom: exit rule");
+        return rule_verdict(ctx, assassin);
+      }
+      if (assassin->stripping)
+      {
+        end_attachment(assassin);
+        send_body(assassin, assassin->strippedbody.data(), assassin->strippedbody.size());
+        assassin->strippedbody.clear();
+      }
+    }
+
+    if (assassin->headerhit)
+    {
+      bool onlytag = ((struct context *)smfi_getpriv(ctx))->onlytag;
+
+      // header_verdict_usable() made sure the body isn't needed for this
+      if (!replay_verdict(assassin, assassin->headerverdict, onlytag, true))
+        throw string("cached verdict no longer applies");
+      milter_status = assassinate(ctx, assassin);
+      ((struct context *)smfi_getpriv(ctx))->assassin=NULL;
+      delete assassin;
+      debug(D_FUNC, "mlfi_eom: exit cached");
+      return milter_status;
+    }
+
+    if (assassin->digesting)
+    {
+      bool onlytag = ((struct context *)smfi_getpriv(ctx))->onlytag;
+      bool cached = false;
+      uint64_t fp;
+      int distance;
+
+      key = verdict_key(assassin);
+      if (verdictcache_lookup(key, v) && replay_verdict(assassin, v, onlytag, false))
+      {
+        debug(D_MISC, "verdict cache hit");
+        cached = true;
+      } else if (fuzzy_fingerprint(assassin, &fp) &&
+                 fuzzycache_lookup(fp, assassin->spamc_user(), v, &distance) &&
+                 replay_verdict(assassin, v, onlytag, true))
+      {
+        debug(D_MISC, "near-duplicate verdict hit, %d bits apart", distance);
+        cached = true;
+      }
+      if (cached)
+      {
+        milter_status = assassinate(ctx, assassin);
+        ((struct context *)smfi_getpriv(ctx))->assassin=NULL;
+        delete assassin;
+        debug(D_FUNC, "mlfi_eom: exit cached");
+        return milter_status;
+      }
+    }
+
+    // -y: mail the classifier is sure is ham goes through without spamd
+    if (assassin->classifying &&
+        bayes_ham(assassin, ((struct context *)smfi_getpriv(ctx))->onlytag))
+    {
+      milter_status = assassinate(ctx, assassin);
+      ((struct context *)smfi_getpriv(ctx))->assassin=NULL;
+      delete assassin;
+      debug(D_FUNC, "mlfi_eom: exit classified");
+      return milter_status;
+    }
+
+    if (!assassin->connected)
+    {
+      get_session(assassin);
+      assassin->connected = 1;
+      assassin->Connect();
+    }
 
     // close output pipe to signal EOF to SpamAssassin
     assassin->close_output();
@@ -1369,6 +2533,18 @@ mlfi_eom(SMFICTX* ctx)
     // read what the Assassin is telling us
     assassin->input();
 
+    // spamc is done with its -j session
+    if (assassin->has_session)
+    {
+      session_release();
+      assassin->has_session = false;
+    }
+
+    if (assassin->digesting || !assassin->headerkey.empty())
+      save_verdict(assassin, key);
+    if (assassin->classifying)
+      learn_verdict(assassin);
+
     milter_status = assassinate(ctx, assassin);
 
     // now cleanup the element.
@@ -1439,6 +2615,41 @@ mlfi_abort(SMFICTX* ctx)
   return SMFIS_ACCEPT;
 }
 
+#ifdef HAVE_MILTER_SKIP
+//
+// Gets called once a connection with what the MTA can do
+//
+// asks for the actions main() settled on, and for SMFIS_SKIP from
+// mlfi_body() if the MTA offers it
+//
+sfsistat
+mlfi_negotiate(SMFICTX* ctx, unsigned long f0, unsigned long f1,
+               unsigned long f2, unsigned long f3, unsigned long *pf0,
+               unsigned long *pf1, unsigned long *pf2, unsigned long *pf3)
+{
+  struct context *sctx;
+
+  debug(D_FUNC, "mlfi_negotiate");
+  *pf0 = smfilter.xxfi_flags;
+  *pf1 = f1 & SMFIP_SKIP;
+  *pf2 = 0;
+  *pf3 = 0;
+
+  /* what this MTA offers is only known for its own connections, so it
+     goes in the context mlfi_connect() will fill in; without one,
+     mlfi_body() just never skips */
+  sctx = (struct context *)calloc(1, sizeof(*sctx));
+  if (sctx)
+  {
+    sctx->mta_skip = (f1 & SMFIP_SKIP) != 0;
+    if (smfi_setpriv(ctx, sctx) != MI_SUCCESS)
+      free(sctx);
+  }
+
+  return SMFIS_CONTINUE;
+}
+#endif
+
 // }}}
 
 // {{{ SpamAssassin Class
@@ -1452,8 +2663,31 @@ SpamAssassin::SpamAssassin():
   error(false),
   running(false),
   connected(false),
-  _numrcpt(0)
+  digesting(verdictcache_max > 0 || verdictcache_path || verdictcache_server ||
+            fuzzycache_max > 0),
+  classifying(bayes_confidence > 0),
+  stripping(strip_size > 0 && !quarantine_dir && !flag_bucket),
+  stripped(false),
+  sampled(false),
+  removed(0),
+  removedencoding(MIME_IDENTITY),
+  _numrcpt(0),
+  accounted(0),
+  declared(0),
+  has_session(false),
+  hashing(false),
+  scanning(false),
+  ruling(false),
+  has_msgid(false),
+  headerhit(false)
 {
+  sha256_init(&digest);
+  sha256_init(&bodydigest);
+  simhash_init(&fingerprint);
+  bayes_init(&bayes);
+  sha256_init(&headerdigest);
+  mimehash_init(&mimehash);
+  uriscan_init(&uriscan);
 }
 
 
@@ -1482,6 +2716,13 @@ SpamAssassin::~SpamAssassin()
 		}
     }
 
+	// what this message held no longer counts towards -L
+	inflight_adjust(-(long)accounted);
+
+	// give up the -j session
+	if (has_session)
+		session_release();
+
 	// Clean up the recip list. Might be overkill, but it's good housekeeping.
 	while( !recipients.empty())
 	{
@@ -1533,45 +2774,24 @@ void SpamAssassin::Connect()
       // execute spamc
       // absolute path (determined in autoconf)
       // should be a little more secure
-      // XXX arbitrary 100-argument max
+      // room for our own (at most 6) arguments, the user's and the NULL
       int argc = 0;
-      char** argv = (char**) malloc(100*sizeof(char*));
+      char** argv = (char**) malloc((config->spamc_args.size() + 7)*sizeof(char*));
       argv[argc++] = strdup(SPAMC);
       if (flag_sniffuser)
       {
+        // Don't worry about freeing this memory as we're exec()ing
+        // anyhow.
         argv[argc++] = strdup("-u");
-        if ( expandedrcpt.size() != 1 )
-        {
-          // More (or less?) than one recipient, so we pass the default
-          // username to SPAMC.  This way special rules can be defined for
-          // multi recipient messages.
-          debug(D_RCPT, "%d recipients; spamc gets default username %s", (int)expandedrcpt.size(), defaultuser);
-          argv[argc++] = defaultuser;
-        } else
-        {
-          // There is only 1 recipient so we pass the username
-          // (converted to lowercase) to SPAMC.  Don't worry about
-          // freeing this memory as we're exec()ing anyhow.
-          if (flag_full_email)
-            argv[argc] = strlwr(strdup(full_user().c_str()));
-          else
-            argv[argc] = strlwr(strdup(local_user().c_str()));
-
-          debug(D_RCPT, "spamc gets %s", argv[argc]);
-
-          argc++;
-        }
+        argv[argc++] = strdup(spamc_user().c_str());
       }
       if (spamdhost)
       {
         argv[argc++] = strdup("-d");
         argv[argc++] = spamdhost;
       }
-      if (spamc_argc)
-      {
-      	memcpy(argv+argc, spamc_argv, spamc_argc * sizeof(char *));
-      	argc += spamc_argc;
-      }
+      for (vector<string>::size_type i = 0; i < config->spamc_args.size(); i++)
+      	argv[argc++] = const_cast<char *>(config->spamc_args[i].c_str());
       argv[argc++] = 0;
 
       execvp(argv[0] , argv); // does not return!
@@ -1605,7 +2825,8 @@ void SpamAssassin::Connect()
   if (outputbuffer.size())
   {
     output(outputbuffer);
-    outputbuffer="";
+    string().swap(outputbuffer);
+    account();
   }
 }
 
@@ -1629,6 +2850,7 @@ SpamAssassin::output(const void* buffer, long size)
 		(string::size_type, char), so we have to cast the parameters.
 	*/
   	outputbuffer.append((const char *)buffer,(string::size_type)size);
+  	account();
   	debug(D_FUNC, "::output exit1");
   	return;
   }
@@ -1705,6 +2927,9 @@ SpamAssassin::output(const void* buffer, long size)
 	}
   } while ( total < size );
 
+  // read_pipe() may have collected some of spamc's reply meanwhile
+  account();
+
   debug(D_FUNC, "::output exit2");
 }
 
@@ -1876,6 +3101,28 @@ SpamAssassin::full_user()
   return name;
 }
 
+// username for spamc's -u: the default one when there is more (or less?)
+// than one recipient, so that special rules can be defined for multi
+// recipient messages, otherwise the recipient's (converted to lowercase)
+string
+SpamAssassin::spamc_user()
+{
+  string user;
+
+  if (!flag_sniffuser)
+    return "";
+  if ( expandedrcpt.size() != 1 )
+  {
+    debug(D_RCPT, "%d recipients; spamc gets default username %s", (int)expandedrcpt.size(), defaultuser);
+    return defaultuser;
+  }
+  user = flag_full_email ? full_user() : local_user();
+  for (string::size_type i = 0; i < user.size(); i++)
+    user[i] = tolower(user[i]);
+  debug(D_RCPT, "spamc gets %s", user.c_str());
+  return user;
+}
+
 int
 SpamAssassin::numrcpt()
 {
@@ -1906,6 +3153,7 @@ SpamAssassin::set_spam_asn(const string& val)
 {
  string::size_type old = x_spam_asn.size();
  x_spam_asn = val;
+ account();
  return (old);
 }
 
@@ -1914,6 +3162,7 @@ SpamAssassin::set_spam_relay_country(const string& val)
 {
  string::size_type old = x_spam_relay_country.size();
  x_spam_relay_country = val;
+ account();
  return (old);
 }
 
@@ -1922,6 +3171,7 @@ SpamAssassin::set_spam_status(const string& val)
 {
   string::size_type old = x_spam_status.size();
   x_spam_status = val;
+  account();
   return (old);
 }
 
@@ -1930,6 +3180,7 @@ SpamAssassin::set_spam_flag(const string& val)
 {
   string::size_type old = x_spam_flag.size();
   x_spam_flag = val;
+  account();
   return (old);
 }
 
@@ -1938,6 +3189,7 @@ SpamAssassin::set_spam_report(const string& val)
 {
   string::size_type old = x_spam_report.size();
   x_spam_report = val;
+  account();
   return (old);
 }
 
@@ -1946,6 +3198,7 @@ SpamAssassin::set_spam_prev_content_type(const string& val)
 {
   string::size_type old = x_spam_prev_content_type.size();
   x_spam_prev_content_type = val;
+  account();
   return (old);
 }
 
@@ -1954,6 +3207,7 @@ SpamAssassin::set_spam_checker_version(const string& val)
 {
   string::size_type old = x_spam_checker_version.size();
   x_spam_checker_version = val;
+  account();
   return (old);
 }
 
@@ -1962,6 +3216,7 @@ SpamAssassin::set_spam_level(const string& val)
 {
   string::size_type old = x_spam_level.size();
   x_spam_level = val;
+  account();
   return (old);
 }
 
@@ -1970,6 +3225,7 @@ SpamAssassin::set_content_type(const string& val)
 {
   string::size_type old = _content_type.size();
   _content_type = val;
+  account();
   return (old);
 }
 
@@ -1978,6 +3234,7 @@ SpamAssassin::set_subject(const string& val)
 {
   string::size_type old = _subject.size();
   _subject = val;
+  account();
   return (old);
 }
 
@@ -2005,6 +3262,43 @@ SpamAssassin::set_connectip(const string& val)
   return (old);
 }
 
+//
+// Recompute how much message data this object is holding (the pending
+// output with any room reserved for it, spamc's reply and the saved
+// header fields) and fold the difference into the process-wide
+// in-flight total.
+//
+void
+SpamAssassin::account()
+{
+	string::size_type now;
+
+	now = outputbuffer.capacity() + mail.size() +
+		strippedbody.capacity() + attachment.capacity() +
+		x_spam_asn.size() + x_spam_relay_country.size() +
+		x_spam_status.size() + x_spam_flag.size() + x_spam_report.size() +
+		x_spam_prev_content_type.size() + x_spam_checker_version.size() +
+		x_spam_level.size() + _content_type.size() + _subject.size();
+
+	if (now != accounted)
+	{
+		inflight_adjust((long)now - (long)accounted);
+		accounted = now;
+	}
+}
+
+//
+// Take reply as spamc's output without running it, letting go of the
+// message held back for it
+//
+void
+SpamAssassin::replay(const string& reply)
+{
+	mail = reply;
+	string().swap(outputbuffer);
+	account();
+}
+
 //
 // Read available output from SpamAssassin client
 //
@@ -2059,6 +3353,7 @@ SpamAssassin::read_pipe()
 	{
 		// append to mail buffer
 		mail.append(iobuff, size);
+		account();
 		debug(D_POLL, "read %ld bytes", size);
 		debug(D_SPAMC, "input  \"%*.*s\"", (int)size, (int)size, iobuff);
 	}
@@ -2081,49 +3376,769 @@ SpamAssassin::empty_and_close_pipe()
 
 // }}}
 
-// {{{ Some small subroutines without much relation to functionality
+// {{{ Spam bucket spool
 
-// output error message to syslog facility
-void
-throw_error(const string& errmsg)
+/*
+   With -Q, the copy of a rejected message that -b/-B asks for is
+   written to the spool directory and delivered by a thread of its own,
+   instead of making the SMTP client wait for a sendmail to finish.
+   Files are named <time>.<pid>.<n> and written as tmp.<name> first, so
+   that a crash never leaves a partial copy to be delivered; whatever is
+   left in the directory is picked up again at startup.  A copy that
+   still can't be delivered after SPOOL_RETRIES attempts is renamed to
+   <name>.failed and left for the administrator.
+*/
+
+#define SPOOL_BATCH	50	/* copies delivered per connection */
+#define SPOOL_RETRIES	12	/* attempts before giving up */
+#define SPOOL_TIMEOUT	60	/* seconds to wait on the SMTP/LMTP server */
+
+static string spool_path(const string& name)
 {
-  if (errmsg.c_str())
-    syslog(LOG_ERR, "Thrown error: %s", errmsg.c_str());
-  else
-    syslog(LOG_ERR, "Unknown error");
+	return string(spool_dir) + "/" + name;
 }
 
-/* Takes a comma or space-delimited string of debug tokens and sets the
-   appropriate bits in flag_debug.  "all" sets all the bits.
-*/
-void parse_debuglevel(char* string)
+/* Queue whatever an earlier run left in the spool directory.  Returns -1
+   if the directory can't be used. */
+int spool_init()
 {
-	char *token;
+	DIR *dir;
+	struct dirent *de;
+	vector<string> names;
+	vector<string>::size_type i;
 
-	/* make a copy so we don't overwrite argv[] */
-	string = strdup(string);
-
-	/* handle the old numeric values too */
-	switch(atoi(string))
+	if (access(spool_dir, W_OK) < 0 || !(dir = opendir(spool_dir)))
 	{
-		case 3:
-			flag_debug |= (1<<D_UORI) | (1<<D_STR);
-		case 2:
-			flag_debug |= (1<<D_POLL);
-		case 1:
-			flag_debug |= (1<<D_MISC) | (1<<D_FUNC);
-			debug(D_ALWAYS, "Setting debug level to 0x%0x", flag_debug);
-			free(string);
-			return;
-		default:
-			break;
+		fprintf(stderr, "Cannot use spool directory %s: %s\n", spool_dir, strerror(errno));
+		return -1;
 	}
+	while ((de = readdir(dir)))
+	{
+		string name = de->d_name;
 
-	while ((token = strsep(&string, ", ")))
+		if (name[0] == '.' || (name.size() > 7 && name.compare(name.size() - 7, 7, ".failed") == 0))
+			continue;
+		if (name.compare(0, 4, "tmp.") == 0)
+			unlink(spool_path(name).c_str());
+		else
+			names.push_back(name);
+	}
+	closedir(dir);
+
+	sort(names.begin(), names.end());
+	for (i = 0; i < names.size(); i++)
 	{
-		int i;
-		for (i=0; debugstrings[i]; i++)
-		{
+		struct spoolentry e;
+
+		e.name = names[i];
+		e.attempts = 0;
+		e.next_try = 0;
+		spool_queue.push_back(e);
+	}
+	spool_count = names.size();
+	if (names.size())
+		debug(D_COPY, "%d bucket copies left in %s", (int)names.size(), spool_dir);
+	return 0;
+}
+
+/* Write msg to the spool and wake the spool thread.  The copy is
+   dropped, and false returned, if the queue is full or the file can't be
+   written. */
+bool spool_message(const string& msg)
+{
+	static unsigned long seq;
+	struct spoolentry e;
+	char name[64];
+	string tmp;
+	FILE *f;
+	int dirfd;
+	bool full, ok;
+
+	pthread_mutex_lock(&spool_mutex);
+	full = spool_count >= spool_max;
+	if (!full)
+		spool_count++;
+	snprintf(name, sizeof(name), "%ld.%ld.%lu", (long)time(NULL), (long)getpid(), seq++);
+	pthread_mutex_unlock(&spool_mutex);
+	if (full)
+	{
+		debug(D_ALWAYS, "Spool %s is full; not sending a copy to %s", spool_dir, spambucket);
+		return false;
+	}
+
+	e.name = name;
+	e.attempts = 0;
+	e.next_try = 0;
+	tmp = spool_path(string("tmp.") + name);
+	/* the data must be on disk before the name is, or a crash could
+	   leave an empty copy for the spool thread to deliver */
+	f = fopen(tmp.c_str(), "w");
+	ok = f != NULL;
+	if (f)
+	{
+		ok = fwrite(msg.data(), 1, msg.size(), f) == msg.size() &&
+			fflush(f) == 0 && fsync(fileno(f)) == 0;
+		if (fclose(f) != 0)
+			ok = false;
+	}
+	if (!ok || rename(tmp.c_str(), spool_path(e.name).c_str()) < 0)
+	{
+		debug(D_ALWAYS, "Could not spool a copy for %s: %s", spambucket, strerror(errno));
+		unlink(tmp.c_str());
+		pthread_mutex_lock(&spool_mutex);
+		spool_count--;
+		pthread_mutex_unlock(&spool_mutex);
+		return false;
+	}
+	/* ... and so must the name, before the message is let go */
+	dirfd = open(spool_dir, O_RDONLY);
+	if (dirfd < 0 || fsync(dirfd) < 0)
+		debug(D_ALWAYS, "Could not sync %s: %s", spool_dir, strerror(errno));
+	if (dirfd >= 0)
+		close(dirfd);
+	debug(D_COPY, "spooled %s for %s", e.name.c_str(), spambucket);
+
+	pthread_mutex_lock(&spool_mutex);
+	spool_queue.push_back(e);
+	pthread_cond_signal(&spool_cond);
+	pthread_mutex_unlock(&spool_mutex);
+	return true;
+}
+
+/* Hand one spooled copy to sendmail, as the unspooled path does */
+static bool spool_sendmail(const string& path)
+{
+	char *popen_argv[4];
+	char buf[8192];
+	size_t n;
+	FILE *in, *p;
+	pid_t pid;
+	int status;
+
+	in = fopen(path.c_str(), "r");
+	if (!in)
+		return false;
+	popen_argv[0] = path_to_sendmail;
+	popen_argv[1] = (char *)"-oi";
+	popen_argv[2] = spambucket;
+	popen_argv[3] = NULL;
+
+	debug(D_COPY, "calling %s -oi %s", path_to_sendmail, spambucket);
+	p = popenv(popen_argv, "w", &pid);
+	if (!p)
+	{
+		debug(D_COPY, "popenv failed(%s).  Will retry the copy to spambucket", strerror(errno));
+		fclose(in);
+		return false;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		fwrite(buf, 1, n, p);
+	fclose(in);
+	fclose(p); p = NULL;
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Open a connection to an smtp:host[:port], lmtp:host:port or
+   lmtp:/socket transport */
+static int spool_connect(const char *transport)
+{
+	string dest = transport + 5;
+	bool lmtp = strncmp(transport, "lmtp:", 5) == 0;
+	struct timeval tv;
+	int fd = -1;
+
+	if (dest[0] == '/')
+	{
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, dest.c_str(), sizeof(sun.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	} else
+	{
+		struct addrinfo hints, *res, *ai;
+		string::size_type colon = dest.rfind(':');
+		string host = dest, port = lmtp ? "24" : "25";
+
+		if (colon != string::npos)
+		{
+			host = dest.substr(0, colon);
+			port = dest.substr(colon + 1);
+		}
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+			return -1;
+		for (ai = res; ai; ai = ai->ai_next)
+		{
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd < 0)
+				continue;
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+	}
+	if (fd < 0)
+		return -1;
+
+	tv.tv_sec = SPOOL_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+static bool smtp_write(int fd, const string& data)
+{
+	string::size_type done = 0;
+
+	while (done < data.size())
+	{
+		ssize_t n = write(fd, data.data() + done, data.size() - done);
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+/* Read a (possibly multi-line) reply and return its code, or -1 */
+static int smtp_reply(FILE *in)
+{
+	char line[1024];
+
+	do
+	{
+		if (!fgets(line, sizeof(line), in))
+			return -1;
+		debug(D_COPY, "spool: %.*s", (int)strcspn(line, "\r\n"), line);
+	} while (strlen(line) > 3 && line[3] == '-');
+	return atoi(line);
+}
+
+/* Send cmd and check that the reply is in the expected hundred */
+static bool smtp_command(int fd, FILE *in, const string& cmd, int expect)
+{
+	return smtp_write(fd, cmd + "\r\n") && smtp_reply(in) / 100 == expect / 100;
+}
+
+/* The message in path, with CRLF line ends and leading dots doubled */
+static bool smtp_data(const string& path, string& data)
+{
+	FILE *f;
+	char line[8192];
+	bool bol = true;
+
+	f = fopen(path.c_str(), "r");
+	if (!f)
+		return false;
+	while (fgets(line, sizeof(line), f))
+	{
+		size_t len = strlen(line);
+
+		if (bol && line[0] == '.')
+			data += '.';
+		bol = len && line[len - 1] == '\n';
+		if (bol)
+		{
+			len--;
+			if (len && line[len - 1] == '\r')
+				len--;
+		}
+		data.append(line, len);
+		if (bol)
+			data += "\r\n";
+	}
+	fclose(f);
+	if (!bol)
+		data += "\r\n";
+	data += ".\r\n";
+	return true;
+}
+
+/* Deliver a batch of copies over one SMTP or LMTP session, setting
+   ok[i] for each one the server accepted */
+static void spool_smtp(const vector<struct spoolentry>& batch, vector<bool>& ok)
+{
+	bool lmtp = strncmp(spool_transport, "lmtp:", 5) == 0;
+	char hostname[256];
+	string rcpt = spambucket;
+	vector<struct spoolentry>::size_type i;
+	FILE *in;
+	int fd;
+
+	fd = spool_connect(spool_transport);
+	if (fd < 0)
+	{
+		debug(D_COPY, "Could not connect to %s: %s", spool_transport, strerror(errno));
+		return;
+	}
+	in = fdopen(fd, "r");
+	if (!in)
+	{
+		debug(D_COPY, "Could not read from %s: %s", spool_transport, strerror(errno));
+		close(fd);
+		return;
+	}
+	if (gethostname(hostname, sizeof(hostname)) < 0)
+		strcpy(hostname, "localhost");
+	hostname[sizeof(hostname) - 1] = '\0';
+	if (rcpt[0] != '<')
+		rcpt = "<" + rcpt + ">";
+
+	if (smtp_reply(in) / 100 != 2 ||
+	    !smtp_command(fd, in, string(lmtp ? "LHLO " : "EHLO ") + hostname, 250))
+	{
+		debug(D_COPY, "%s did not accept a session", spool_transport);
+		fclose(in);
+		return;
+	}
+	for (i = 0; i < batch.size(); i++)
+	{
+		string data;
+
+		if (!smtp_data(spool_path(batch[i].name), data))
+			continue;
+		if (smtp_command(fd, in, "MAIL FROM:<>", 250) &&
+		    smtp_command(fd, in, "RCPT TO:" + rcpt, 250) &&
+		    smtp_command(fd, in, "DATA", 354) &&
+		    smtp_write(fd, data) && smtp_reply(in) / 100 == 2)
+			ok[i] = true;
+		else if (!smtp_command(fd, in, "RSET", 250))
+			break;	// the session is gone; the rest will be retried
+	}
+	smtp_command(fd, in, "QUIT", 221);
+	fclose(in);
+}
+
+/* Deliver spooled copies as they arrive, retrying failures with an
+   increasing delay */
+void *spool_thread(void *)
+{
+	for (;;)
+	{
+		vector<struct spoolentry> batch;
+		vector<struct spoolentry>::size_type i;
+		list<struct spoolentry>::iterator it;
+
+		/* take up to SPOOL_BATCH copies that are due */
+		pthread_mutex_lock(&spool_mutex);
+		for (;;)
+		{
+			time_t now = time(NULL), wake = 0;
+
+			for (it = spool_queue.begin(); it != spool_queue.end() && batch.size() < SPOOL_BATCH; )
+			{
+				if (it->next_try <= now)
+				{
+					batch.push_back(*it);
+					it = spool_queue.erase(it);
+				} else
+				{
+					if (!wake || it->next_try < wake)
+						wake = it->next_try;
+					++it;
+				}
+			}
+			if (batch.size())
+				break;
+			if (wake)
+			{
+				struct timespec ts;
+
+				ts.tv_sec = wake;
+				ts.tv_nsec = 0;
+				pthread_cond_timedwait(&spool_cond, &spool_mutex, &ts);
+			} else
+				pthread_cond_wait(&spool_cond, &spool_mutex);
+		}
+		pthread_mutex_unlock(&spool_mutex);
+
+		vector<bool> ok(batch.size(), false);
+		if (spool_transport)
+			spool_smtp(batch, ok);
+		else
+			for (i = 0; i < batch.size(); i++)
+				ok[i] = spool_sendmail(spool_path(batch[i].name));
+
+		pthread_mutex_lock(&spool_mutex);
+		for (i = 0; i < batch.size(); i++)
+		{
+			struct spoolentry& e = batch[i];
+
+			if (ok[i])
+			{
+				debug(D_COPY, "delivered %s to %s", e.name.c_str(), spambucket);
+				unlink(spool_path(e.name).c_str());
+				spool_count--;
+			} else if (++e.attempts >= SPOOL_RETRIES)
+			{
+				debug(D_ALWAYS, "Giving up on bucket copy %s after %d attempts", e.name.c_str(), e.attempts);
+				rename(spool_path(e.name).c_str(), spool_path(e.name + ".failed").c_str());
+				spool_count--;
+			} else
+			{
+				/* one minute, doubling to about an hour */
+				e.next_try = time(NULL) + (60 << (e.attempts < 7 ? e.attempts - 1 : 6));
+				spool_queue.push_back(e);
+			}
+		}
+		pthread_mutex_unlock(&spool_mutex);
+	}
+	return NULL;
+}
+
+// }}}
+
+// {{{ Quarantine
+
+/*
+   With -q, spam is kept in a content-addressed store:
+
+     objects/xx/<sha256>[.gz]   the header and body of a message, each
+                                stored once however often it is seen
+     index/<recipient>          one line per message for that recipient:
+                                time, queue ID, sender, header and body
+                                object names and what was done with it
+
+   A campaign sent to thousands of recipients then costs one body object
+   and a line in each index.  Writes are made by a single thread, which
+   takes everything queued since its last pass, writes and fsyncs the
+   objects for the lot, then their index lines; the milter threads wait
+   for the pass that includes their message.  An index line is only
+   written once the objects it names are on disk.
+*/
+
+/* Create the store's directories.  Returns -1 if they can't be used. */
+int quarantine_init()
+{
+	string objects = string(quarantine_dir) + "/objects";
+	string index = string(quarantine_dir) + "/index";
+
+	mkdir(objects.c_str(), 0700);
+	mkdir(index.c_str(), 0700);
+	if (access(objects.c_str(), W_OK) < 0 || access(index.c_str(), W_OK) < 0)
+	{
+		fprintf(stderr, "Cannot use quarantine directory %s: %s\n", quarantine_dir, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef QUARANTINE_GZIP
+/* Compress in to a gzip stream, so objects can be read with zcat */
+static bool gzip_string(const string& in, string& out)
+{
+	z_stream zs;
+	int rv;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+	out.resize(deflateBound(&zs, in.size()) + 32);	// room for the gzip wrapper
+	zs.next_in = (Bytef *)in.data();
+	zs.avail_in = in.size();
+	zs.next_out = (Bytef *)&out[0];
+	zs.avail_out = out.size();
+	rv = deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+	return rv == Z_STREAM_END;
+}
+#endif
+
+/* Fill in the object name for data and, unless the store already has
+   it, what to write.  Returns false if there is nothing to write. */
+static bool quarantine_object(const string& data, string& name, string& contents)
+{
+	struct sha256_ctx ctx;
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	char hex[2 * SHA256_DIGEST_LENGTH + 1];
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data.data(), data.size());
+	sha256_final(&ctx, digest);
+	sha256_hex(digest, hex);
+	name = string(hex, 2) + "/" + hex;
+#ifdef QUARANTINE_GZIP
+	name += ".gz";
+#endif
+
+	if (access((string(quarantine_dir) + "/objects/" + name).c_str(), F_OK) == 0)
+		return false;
+#ifdef QUARANTINE_GZIP
+	if (gzip_string(data, contents))
+		return true;
+	/* keep it, if not compressed */
+	name.erase(name.size() - 3);
+#endif
+	contents = data;
+	return true;
+}
+
+/* A recipient as a file name in index/ */
+static string quarantine_index_name(const string& rcpt)
+{
+	string name = normalize_address(rcpt.c_str());
+	string::size_type i;
+
+	for (i = 0; i < name.size(); i++)
+		if (name[i] == '/' || (unsigned char)name[i] < ' ')
+			name[i] = '_';
+	if (name.empty() || name[0] == '.')
+		name = "_" + name;
+	return name;
+}
+
+/* Store the message spamc returned, header and body split at bob, and
+   wait until it is on disk.  Returns false if it could not be stored. */
+bool quarantine_message(SpamAssassin *assassin, const char *queueid,
+	string::size_type bob, const char *action)
+{
+	struct quarantine_item item;
+	list<string>::iterator it;
+	char line[64];
+
+	/* hash and compress here, so the committer only has to write */
+	item.store[0] = quarantine_object(assassin->d().substr(0, bob), item.objects[0], item.data[0]);
+	item.store[1] = quarantine_object(assassin->d().substr(bob), item.objects[1], item.data[1]);
+
+	snprintf(line, sizeof(line), "%ld\t", (long)time(NULL));
+	item.entry = string(line) + queueid + "\t" + assassin->from() + "\t" +
+		item.objects[0] + "\t" + item.objects[1] + "\t" + action + "\n";
+	for (it = assassin->recipients.begin(); it != assassin->recipients.end(); ++it)
+		item.index.push_back(quarantine_index_name(*it));
+	item.done = item.ok = false;
+
+	pthread_mutex_lock(&quarantine_mutex);
+	quarantine_pending.push_back(&item);
+	pthread_cond_signal(&quarantine_cond);
+	while (!item.done)
+		pthread_cond_wait(&quarantine_done, &quarantine_mutex);
+	pthread_mutex_unlock(&quarantine_mutex);
+
+	if (item.ok)
+		debug(D_COPY, "quarantined %s as %s", queueid, item.objects[1].c_str());
+	else
+		debug(D_ALWAYS, "Could not quarantine %s", queueid);
+	return item.ok;
+}
+
+static bool write_all(int fd, const string& data)
+{
+	string::size_type done = 0;
+
+	while (done < data.size())
+	{
+		ssize_t n = write(fd, data.data() + done, data.size() - done);
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+/* Write what the milter threads queue, one round of fsyncs per batch
+   for the objects and one for the index */
+void *quarantine_thread(void *)
+{
+	string objects = string(quarantine_dir) + "/objects/";
+	string index = string(quarantine_dir) + "/index/";
+
+	for (;;)
+	{
+		list<struct quarantine_item *> batch;
+		list<struct quarantine_item *>::iterator it;
+		unordered_map<string, int> files;	// index file -> fd
+		unordered_map<string, int>::iterator f;
+		unordered_set<string> written;		// objects this batch
+		unordered_set<string> failed;		// ... that did not make it
+		vector<pair<string, string> > renames;
+		vector<int> fds;
+		unordered_set<string> dirs;
+		unordered_set<string>::iterator d;
+		vector<int>::size_type i;
+		bool synced = true;
+
+		pthread_mutex_lock(&quarantine_mutex);
+		while (quarantine_pending.empty())
+			pthread_cond_wait(&quarantine_cond, &quarantine_mutex);
+		batch.swap(quarantine_pending);
+		pthread_mutex_unlock(&quarantine_mutex);
+
+		/* first the objects ... */
+		for (it = batch.begin(); it != batch.end(); ++it)
+		{
+			struct quarantine_item *item = *it;
+
+			item->ok = true;
+			for (i = 0; i < 2; i++)
+			{
+				string path = objects + item->objects[i];
+				string dir = path.substr(0, path.rfind('/'));
+				string tmp = path + ".tmp";
+				int fd;
+
+				if (!item->store[i] || written.count(path) || access(path.c_str(), F_OK) == 0)
+					continue;
+				if (mkdir(dir.c_str(), 0700) == 0)
+					dirs.insert(objects);
+				fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+				if (fd < 0 || !write_all(fd, item->data[i]))
+				{
+					debug(D_ALWAYS, "Could not write %s: %s", tmp.c_str(), strerror(errno));
+					if (fd >= 0)
+						close(fd);
+					unlink(tmp.c_str());
+					item->ok = false;
+					continue;
+				}
+				fds.push_back(fd);
+				renames.push_back(make_pair(tmp, path));
+				written.insert(path);
+				dirs.insert(dir);
+			}
+		}
+		for (i = 0; i < fds.size(); i++)
+		{
+			if (fsync(fds[i]) < 0)
+				failed.insert(renames[i].second);
+			close(fds[i]);
+		}
+		for (i = 0; i < renames.size(); i++)
+		{
+			if (failed.count(renames[i].second) ||
+			    rename(renames[i].first.c_str(), renames[i].second.c_str()) < 0)
+			{
+				debug(D_ALWAYS, "Could not store %s: %s", renames[i].second.c_str(), strerror(errno));
+				unlink(renames[i].first.c_str());
+				failed.insert(renames[i].second);
+			}
+		}
+		for (d = dirs.begin(); d != dirs.end(); ++d)
+		{
+			int fd = open(d->c_str(), O_RDONLY);
+			if (fd < 0 || fsync(fd) < 0)
+				synced = false;
+			if (fd >= 0)
+				close(fd);
+		}
+		dirs.clear();
+
+		/* ... and only once they are safe, the index lines that point
+		   at them */
+		for (it = batch.begin(); it != batch.end(); ++it)
+		{
+			struct quarantine_item *item = *it;
+
+			if (failed.count(objects + item->objects[0]) || failed.count(objects + item->objects[1]))
+				item->ok = false;
+			if (!item->ok || !synced)
+				continue;
+			for (i = 0; i < item->index.size(); i++)
+			{
+				f = files.find(item->index[i]);
+				if (f == files.end())
+				{
+					int fd = open((index + item->index[i]).c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+					if (fd >= 0)
+						dirs.insert(index);
+					f = files.insert(make_pair(item->index[i], fd)).first;
+				}
+				/* one write per line keeps O_APPEND lines whole */
+				if (f->second < 0 || !write_all(f->second, item->entry))
+				{
+					debug(D_ALWAYS, "Could not write %s%s: %s", index.c_str(),
+					      item->index[i].c_str(), strerror(errno));
+					item->ok = false;
+				}
+			}
+		}
+		for (f = files.begin(); f != files.end(); ++f)
+		{
+			if (f->second >= 0)
+			{
+				if (fsync(f->second) < 0)
+					synced = false;
+				close(f->second);
+			}
+		}
+		for (d = dirs.begin(); d != dirs.end(); ++d)
+		{
+			int fd = open(d->c_str(), O_RDONLY);
+			if (fd < 0 || fsync(fd) < 0)
+				synced = false;
+			if (fd >= 0)
+				close(fd);
+		}
+		debug(D_COPY, "quarantine: committed %d messages", (int)batch.size());
+
+		pthread_mutex_lock(&quarantine_mutex);
+		for (it = batch.begin(); it != batch.end(); ++it)
+		{
+			(*it)->ok = (*it)->ok && synced;
+			(*it)->done = true;
+		}
+		pthread_cond_broadcast(&quarantine_done);
+		pthread_mutex_unlock(&quarantine_mutex);
+	}
+	return NULL;
+}
+
+// }}}
+
+// {{{ Some small subroutines without much relation to functionality
+
+// output error message to syslog facility
+void
+throw_error(const string& errmsg)
+{
+  if (errmsg.c_str())
+    syslog(LOG_ERR, "Thrown error: %s", errmsg.c_str());
+  else
+    syslog(LOG_ERR, "Unknown error");
+}
+
+/* Takes a comma or space-delimited string of debug tokens and sets the
+   appropriate bits in flag_debug.  "all" sets all the bits.
+*/
+void parse_debuglevel(char* string)
+{
+	char *token;
+
+	/* make a copy so we don't overwrite argv[] */
+	string = strdup(string);
+
+	/* handle the old numeric values too */
+	switch(atoi(string))
+	{
+		case 3:
+			flag_debug |= (1<<D_UORI) | (1<<D_STR);
+		case 2:
+			flag_debug |= (1<<D_POLL);
+		case 1:
+			flag_debug |= (1<<D_MISC) | (1<<D_FUNC);
+			debug(D_ALWAYS, "Setting debug level to 0x%0x", flag_debug);
+			free(string);
+			return;
+		default:
+			break;
+	}
+
+	while ((token = strsep(&string, ", ")))
+	{
+		int i;
+		for (i=0; debugstrings[i]; i++)
+		{
 			if(strcasecmp(token, "ALL")==0)
 			{
 				flag_debug = (1<<D_MAX)-1;
@@ -2244,175 +4259,437 @@ void closeall(int fd)
 		close(fd++);
 }
 
-void parse_networklist(char *string, struct networklist *list)
+/* Read a list file into a single string, turning comments and line
+   breaks into separators so it can be fed to the -i/-T parsers.  Returns
+   NULL (with errno set) if the file can't be read. */
+char *read_listfile(const char *path)
 {
-	char *token;
+	FILE *f;
+	char line[1024];
+	string list;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	while (fgets(line, sizeof(line), f))
+	{
+		char *hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+		list += line;
+		list += ",";
+	}
+	fclose(f);
+	return strdup(list.c_str());
+}
 
-	/* make a copy so we don't overwrite argv[] */
-	string = strdup(string);
+/* Map a compiled list file (see spamass-makelist) and add it to dbs */
+static int add_listdb(const char *path, vector<struct listdb *>& dbs)
+{
+	char errbuf[1024];
+	struct listdb *db;
 
-	while ((token = strsep(&string, ", ")))
+	db = listdb_open(path, errbuf, sizeof(errbuf));
+	if (!db)
 	{
-		char *tnet = strsep(&token, "/");
-		char *tmask = token;
-		struct in_addr net;
-		struct in6_addr net6;
+		config_error("%s", errbuf);
+		return -1;
+	}
+	debug(D_MISC, "Mapped compiled list %s", path);
+	dbs.push_back(db);
+	return 0;
+}
+
+/* Is bit number 'bit' (counting from the most significant) set in key? */
+static inline int netbit(const uint8_t *key, int bit)
+{
+	return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
 
-		if (list->num_nets % 10 == 0)
-			list->nets = (union net*)realloc(list->nets, sizeof(*list->nets) * (list->num_nets + 10));
+/* Count how many leading bits of a and b agree, looking at no more than
+   'max' bits */
+static int netcommon(const uint8_t *a, const uint8_t *b, int max)
+{
+	int bits = 0;
 
-		if (inet_pton(AF_INET, tnet, &net))
+	while (bits < max)
+	{
+		uint8_t diff = a[bits >> 3] ^ b[bits >> 3];
+		if (diff == 0)
+		{
+			bits += 8;
+			continue;
+		}
+		while (!(diff & 0x80))
 		{
-			struct in_addr mask;
+			diff <<= 1;
+			bits++;
+		}
+		break;
+	}
+	return (bits < max) ? bits : max;
+}
+
+/* Add key/bits to the radix tree rooted at *np.  Re-adding a prefix
+   replaces its action, so the last -i entry for a network wins. */
+static void netnode_insert(struct netnode **np, const uint8_t *key, int bits, int action)
+{
+	struct netnode *n, *leaf;
+
+	while ((n = *np) != NULL)
+	{
+		int common = netcommon(key, n->key, (bits < n->bits) ? bits : n->bits);
 
-			if (tmask)
+		if (common < n->bits)
+		{
+			/* key leaves this node's path; split it here */
+			leaf = (struct netnode *)calloc(1, sizeof(*leaf));
+			memcpy(leaf->key, key, sizeof(leaf->key));
+			if (common == bits)
 			{
-				if (strchr(tmask, '.') == NULL)
-				{
-					/* CIDR */
-					unsigned int bits;
-					int ret;
-					ret = sscanf(tmask, "%u", &bits);
-					if (ret != 1 || bits > 32)
-					{
-						fprintf(stderr,"%s: bad CIDR value", tmask);
-						exit(1);
-					}
-					mask.s_addr = htonl(~((1L << (32 - bits)) - 1) & 0xffffffff);
-				} else if (!inet_pton(AF_INET6, tmask, &mask))
-				{
-					fprintf(stderr, "Could not parse \"%s\" as a netmask\n", tmask);
-					exit(1);
-				}
+				/* the new prefix covers the old node */
+				leaf->bits = bits;
+				leaf->action = action;
+				leaf->child[netbit(n->key, bits)] = n;
+				*np = leaf;
 			} else
-				mask.s_addr = 0xffffffff;
-
 			{
-				char *snet = strdup(inet_ntoa(net));
-				debug(D_MISC, "Adding %s/%s to network list", snet, inet_ntoa(mask));
-				free(snet);
+				/* the two differ at bit 'common'; join them under a
+				   glue node that carries no action of its own */
+				struct netnode *glue = (struct netnode *)calloc(1, sizeof(*glue));
+				memcpy(glue->key, key, sizeof(glue->key));
+				glue->bits = common;
+				glue->action = NET_NONE;
+				leaf->bits = bits;
+				leaf->action = action;
+				glue->child[netbit(n->key, common)] = n;
+				glue->child[netbit(key, common)] = leaf;
+				*np = glue;
 			}
-
-			net.s_addr = net.s_addr & mask.s_addr;
-			list->nets[list->num_nets].net4.af = AF_INET;
-			list->nets[list->num_nets].net4.network = net;
-			list->nets[list->num_nets].net4.netmask = mask;
-			list->num_nets++;
-		} else if (inet_pton(AF_INET6, tnet, &net6))
+			return;
+		}
+		if (n->bits == bits)
 		{
-			int mask;
+			n->action = action;
+			return;
+		}
+		np = &n->child[netbit(key, n->bits)];
+	}
 
-			if (tmask)
-			{
-				if (sscanf(tmask, "%d", &mask) != 1 || mask > 128)
-				{
-					fprintf(stderr,"%s: bad CIDR value", tmask);
-					exit(1);
-				}
-			} else
-				mask = 128;
+	leaf = (struct netnode *)calloc(1, sizeof(*leaf));
+	memcpy(leaf->key, key, sizeof(leaf->key));
+	leaf->bits = bits;
+	leaf->action = action;
+	*np = leaf;
+}
 
-			list->nets[list->num_nets].net6.af = AF_INET6;
-			list->nets[list->num_nets].net6.network = net6;
-			list->nets[list->num_nets].net6.netmask = mask;
-			list->num_nets++;
-		} else
+static void netnode_free(struct netnode *n)
+{
+	if (!n)
+		return;
+	netnode_free(n->child[0]);
+	netnode_free(n->child[1]);
+	free(n);
+}
+
+networklist::~networklist()
+{
+	vector<struct listdb *>::size_type i;
+
+	netnode_free(root4);
+	netnode_free(root6);
+	for (i = 0; i < dbs.size(); i++)
+		listdb_close(dbs[i]);
+}
+
+/* Walk the tree towards key, remembering the action of the longest
+   prefix that covers it and (in *bits) its length */
+static int netnode_lookup(const struct netnode *n, const uint8_t *key, int maxbits, int *bits)
+{
+	int action = NET_NONE;
+
+	while (n)
+	{
+		if (netcommon(key, n->key, n->bits) < n->bits)
+			break;
+		if (n->action != NET_NONE)
 		{
-			fprintf(stderr, "Could not parse \"%s\" as a network\n", tnet);
-			exit(1);
+			action = n->action;
+			*bits = n->bits;
 		}
-
+		if (n->bits >= maxbits)
+			break;
+		n = n->child[netbit(key, n->bits)];
 	}
-	free(string);
+	return action;
 }
 
-int ip_in_networklist(struct sockaddr *addr, struct networklist *list)
+int parse_networklist(char *string, struct networklist *list)
 {
-	int i;
+	char *token, *copy;
+	int rv;
 
-	if (list->num_nets == 0)
-		return 0;
+	/* make a copy so we don't overwrite argv[] */
+	string = copy = strdup(string);
 
-	//debug(D_NET, "Checking %s against:", inet_ntoa(ip));
-	for (i = 0; i < list->num_nets; i++)
+	while ((token = strsep(&string, ", \t\r\n")))
 	{
-		if (list->nets[i].net.af == AF_INET && addr->sa_family == AF_INET)
+		struct netentry net;
+		char errbuf[1024];
+
+		if (*token == '\0')
+			continue;
+
+		/* A path names a file holding more networks, either a text
+		   list or one compiled by spamass-makelist */
+		if (*token == '/')
 		{
-			struct in_addr ip = ((struct sockaddr_in *)addr)->sin_addr;
+			if (listdb_probe(token))
+			{
+				if (add_listdb(token, list->dbs) < 0)
+				{
+					free(copy);
+					return -1;
+				}
+				continue;
+			}
 
-			debug(D_NET, "%s", inet_ntoa(list->nets[i].net4.network));
-			debug(D_NET, "/%s", inet_ntoa(list->nets[i].net4.netmask));
-			if ((ip.s_addr & list->nets[i].net4.netmask.s_addr) == list->nets[i].net4.network.s_addr)
+			char *contents = read_listfile(token);
+			if (!contents)
+			{
+				config_error("Could not read network list %s: %s", token, strerror(errno));
+				free(copy);
+				return -1;
+			}
+			debug(D_MISC, "Reading network list from %s", token);
+			rv = parse_networklist(contents, list);
+			free(contents);
+			if (rv < 0)
 			{
-				debug(D_NET, "Hit!");
-				return 1;
+				free(copy);
+				return -1;
 			}
-		} else if (list->nets[i].net.af == AF_INET6 && addr->sa_family == AF_INET6)
+			continue;
+		}
+
+		if (parse_netentry(token, &net, errbuf, sizeof(errbuf)) < 0)
 		{
-			u_int8_t *ip = ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
-			int mask, j;
+			config_error("%s", errbuf);
+			free(copy);
+			return -1;
+		}
+		/* parse_netentry() cut token at the '/', leaving any '!' */
+		debug(D_MISC, "Adding %s/%d to network list", token, net.bits);
+		netnode_insert(net.af == AF_INET ? &list->root4 : &list->root6,
+		               net.key, net.bits, net.action);
+		list->num_nets++;
+	}
+	free(copy);
+	return 0;
+}
 
-			mask = list->nets[i].net6.netmask;
-			for (j = 0; j < 16 && mask > 0; j++, mask -= 8)
-			{
-				unsigned char bytemask;
+int ip_in_networklist(struct sockaddr *addr, const struct networklist *list)
+{
+	int action = NET_NONE, bits = -1;
+	const uint8_t *key;
+	vector<struct listdb *>::size_type i;
 
-				bytemask = (mask < 8) ? ~((1L << (8 - mask)) - 1) : 0xff;
+	if (list->num_nets == 0 && list->dbs.empty())
+		return 0;
 
-				if ((ip[j] & bytemask) != (list->nets[i].net6.network.s6_addr[j] & bytemask))
-					break;
-			}
+	if (addr->sa_family == AF_INET)
+	{
+		key = (const uint8_t *)&((struct sockaddr_in *)addr)->sin_addr;
+		action = netnode_lookup(list->root4, key, 32, &bits);
+	} else if (addr->sa_family == AF_INET6)
+	{
+		key = ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+		action = netnode_lookup(list->root6, key, 128, &bits);
+	} else
+		return 0;
 
-			if (mask <= 0)
-			{
-				debug(D_NET, "Hit!");
-				return 1;
-			}
+	/* as within one list, the longest prefix decides; on a tie the
+	   file named last wins */
+	for (i = 0; i < list->dbs.size(); i++)
+	{
+		int dbbits;
+		int dbaction = listdb_lookup_net(list->dbs[i], addr->sa_family, key, &dbbits);
+
+		if (dbaction != NET_NONE && dbbits >= bits)
+		{
+			action = dbaction;
+			bits = dbbits;
 		}
 	}
 
+	if (action == NET_MATCH)
+	{
+		debug(D_NET, "Hit!");
+		return 1;
+	}
+	if (action == NET_EXCLUDE)
+		debug(D_NET, "Excluded");
 	return 0;
 }
 
-void parse_addresslist(char *string, struct addresslist *list)
+domainnode::~domainnode()
 {
-   char *token;
+	unordered_map<string, struct domainnode *>::iterator it;
+
+	for (it = labels.begin(); it != labels.end(); ++it)
+		delete it->second;
+}
+
+addresslist::~addresslist()
+{
+	vector<struct listdb *>::size_type i;
+
+	delete domains;
+	for (i = 0; i < dbs.size(); i++)
+		listdb_close(dbs[i]);
+}
+
+/* Add a domain to the label tree, rightmost label first.  If subdomains
+   is set, the entry matches hosts below the domain rather than the
+   domain itself. */
+static void domainnode_insert(struct domainnode **root, const string& domain, bool subdomains)
+{
+	struct domainnode **np = root;
+	string::size_type end = domain.size();
+
+	for (;;)
+	{
+		string::size_type dot = domain.rfind('.', end - 1);
+		string::size_type start = (dot == string::npos) ? 0 : dot + 1;
+
+		if (!*np)
+			*np = new domainnode;
+		np = &(*np)->labels[domain.substr(start, end - start)];
+		if (dot == string::npos || dot == 0)
+			break;
+		end = dot;
+	}
+	if (!*np)
+		*np = new domainnode;
+	if (subdomains)
+		(*np)->subdomains = true;
+	else
+		(*np)->domain = true;
+}
+
+/* Does domain, or a parent covered by a wildcard, appear in the tree? */
+static bool domainnode_lookup(const struct domainnode *n, const string& domain)
+{
+	string::size_type end = domain.size();
+
+	while (n && end > 0)
+	{
+		string::size_type dot = domain.rfind('.', end - 1);
+		string::size_type start = (dot == string::npos) ? 0 : dot + 1;
+		unordered_map<string, struct domainnode *>::const_iterator it;
+
+		it = n->labels.find(domain.substr(start, end - start));
+		if (it == n->labels.end())
+			return false;
+		n = it->second;
+		if (dot == string::npos)
+			return n->domain;
+		/* more labels to the left; any *.domain entry here covers them */
+		if (n->subdomains)
+			return true;
+		end = dot;
+	}
+	return false;
+}
+
+int parse_addresslist(char *string, struct addresslist *list)
+{
+   char *token, *copy;
+   int rv;
 
    /* make a copy so we don't overwrite argv[] */
-   string = strdup(string);
+   string = copy = strdup(string);
 
-   while ((token = strsep(&string, ", ")))
+   while ((token = strsep(&string, ", \t\r\n")))
    {
-      char *addr = (char *)malloc(strlen(token)+3);
-      addr = strcpy(addr,"<");
-      addr = strcat(addr,token);
-      addr = strcat(addr,">");
+      std::string addr;
+      std::string::size_type at;
 
-      if (list->num_addrs % 10 == 0)
-         list->addrs = (char **)realloc(list->addrs, sizeof(*list->addrs) * (list->num_addrs + 10));
+      if (*token == '\0')
+         continue;
 
-      if (strchr(addr, '@') == NULL || strchr(addr, '.') == NULL || strchr(addr, '@') > strrchr(addr, '.'))
+      /* A path names a file holding more addresses, either a text
+         list or one compiled by spamass-makelist */
+      if (*token == '/')
       {
-         fprintf(stderr, "Could not parse \"%s\" as an email address\n", addr);
-         exit(1);
+         if (listdb_probe(token))
+         {
+            if (add_listdb(token, list->dbs) < 0)
+            {
+               free(copy);
+               return -1;
+            }
+            continue;
+         }
+
+         char *contents = read_listfile(token);
+         if (!contents)
+         {
+            config_error("Could not read address list %s: %s", token, strerror(errno));
+            free(copy);
+            return -1;
+         }
+         debug(D_MISC, "Reading address list from %s", token);
+         rv = parse_addresslist(contents, list);
+         free(contents);
+         if (rv < 0)
+         {
+            free(copy);
+            return -1;
+         }
+         continue;
       }
 
+      addr = normalize_address(token);
+      at = addr.find('@');
 
+      if (at == std::string::npos || addr.find('.', at) == std::string::npos)
       {
-         debug(D_MISC, "Adding %s to address list", addr);
+         config_error("Could not parse \"%s\" as an email address", token);
+         free(copy);
+         return -1;
       }
 
-      list->addrs[list->num_addrs] = addr;
+      if (at == 0)
+      {
+         /* @domain, or @*.domain for everything below it */
+         if (addr.compare(1, 2, "*.") == 0)
+         {
+            debug(D_MISC, "Adding subdomains of %s to address list", addr.c_str() + 3);
+            domainnode_insert(&list->domains, addr.substr(3), true);
+         } else
+         {
+            debug(D_MISC, "Adding domain %s to address list", addr.c_str() + 1);
+            domainnode_insert(&list->domains, addr.substr(1), false);
+         }
+      } else
+      {
+         debug(D_MISC, "Adding %s to address list", addr.c_str());
+         list->addrs.insert(addr);
+      }
       list->num_addrs++;
    }
-   free(string);
+   free(copy);
+   return 0;
 }
 
-int addr_in_addresslist(char *addr, struct addresslist *list)
+int addr_in_addresslist(char *addr, const struct addresslist *list)
 {
-   int i;
+   string norm;
+   string::size_type at;
+   vector<struct listdb *>::size_type i;
 
-   if (list->num_addrs == 0)
+   if (list->num_addrs == 0 && list->dbs.empty())
       return 0;
 
    if (addr == NULL)
@@ -2427,13 +4704,27 @@ int addr_in_addresslist(char *addr, struct addresslist *list)
       return 0;
    }
 
-   debug(D_RCPT, "Checking %s against:", addr);
-   for (i = 0; i < list->num_addrs; i++)
+   norm = normalize_address(addr);
+   debug(D_RCPT, "Checking %s against address list", norm.c_str());
+
+   if (list->addrs.count(norm))
+   {
+      debug(D_RCPT, "Hit!");
+      return 1;
+   }
+
+   at = norm.rfind('@');
+   if (at != string::npos && domainnode_lookup(list->domains, norm.substr(at + 1)))
+   {
+      debug(D_RCPT, "Domain hit!");
+      return 1;
+   }
+
+   for (i = 0; i < list->dbs.size(); i++)
    {
-      debug(D_RCPT, "%s", list->addrs[i]);
-      if (strcmp(addr,list->addrs[i]) == 0)
+      if (listdb_lookup_address(list->dbs[i], norm))
       {
-         debug(D_RCPT, "Hit!");
+         debug(D_RCPT, "Compiled list hit!");
          return 1;
       }
    }
@@ -2441,6 +4732,382 @@ int addr_in_addresslist(char *addr, struct addresslist *list)
    return 0;
 }
 
+hashlist::~hashlist()
+{
+	vector<struct listdb *>::size_type i;
+
+	for (i = 0; i < dbs.size(); i++)
+		listdb_close(dbs[i]);
+}
+
+int parse_hashlist(char *string, struct hashlist *list)
+{
+   char *token, *copy;
+   std::string digest;
+   int rv;
+
+   /* make a copy so we don't overwrite argv[] */
+   string = copy = strdup(string);
+
+   while ((token = strsep(&string, ", \t\r\n")))
+   {
+      if (*token == '\0')
+         continue;
+
+      /* A path names a file holding more digests, either a text list
+         (a feed) or one compiled by spamass-makelist */
+      if (*token == '/')
+      {
+         if (listdb_probe(token))
+         {
+            if (add_listdb(token, list->dbs) < 0)
+            {
+               free(copy);
+               return -1;
+            }
+            continue;
+         }
+
+         char *contents = read_listfile(token);
+         if (!contents)
+         {
+            config_error("Could not read hash list %s: %s", token, strerror(errno));
+            free(copy);
+            return -1;
+         }
+         debug(D_MISC, "Reading hash list from %s", token);
+         rv = parse_hashlist(contents, list);
+         free(contents);
+         if (rv < 0)
+         {
+            free(copy);
+            return -1;
+         }
+         continue;
+      }
+
+      if (parse_digest(token, digest) < 0)
+      {
+         config_error("Could not parse \"%s\" as a SHA-256 digest", token);
+         free(copy);
+         return -1;
+      }
+      list->digests.insert(digest);
+   }
+   free(copy);
+   return 0;
+}
+
+bool digest_in_hashlist(const string& digest, const struct hashlist *list)
+{
+   vector<struct listdb *>::size_type i;
+
+   if (list->digests.count(digest))
+      return true;
+   for (i = 0; i < list->dbs.size(); i++)
+   {
+      if (listdb_lookup_digest(list->dbs[i], (const uint8_t *)digest.data()))
+         return true;
+   }
+   return false;
+}
+
+/* Is the body, or any of its MIME parts, on the -K list?  Logs the
+   digest that is. */
+bool content_blocked(SpamAssassin *assassin, const vector<string>& digests)
+{
+   vector<string>::size_type i;
+   int j;
+
+   if (!assassin->hashing)
+      return false;
+   for (i = 0; i < digests.size(); i++)
+   {
+      if (digest_in_hashlist(digests[i], &assassin->config->blockhashes))
+      {
+         char hex[2 * LISTDB_DIGESTLEN + 1];
+
+         for (j = 0; j < LISTDB_DIGESTLEN; j++)
+            sprintf(hex + 2 * j, "%02x", (unsigned char)digests[i][j]);
+         debug(D_ALWAYS, "Content with digest %s is on the hash blocklist", hex);
+         return true;
+      }
+   }
+   return false;
+}
+
+/* mimehash asks about the parts past those whose digests it keeps */
+bool part_blocked(void *arg, const string& digest)
+{
+   SpamAssassin *assassin = (SpamAssassin *)arg;
+
+   return digest_in_hashlist(digest, &assassin->config->blockhashes);
+}
+
+domainlist::~domainlist()
+{
+	vector<struct listdb *>::size_type i;
+
+	delete domains;
+	for (i = 0; i < dbs.size(); i++)
+		listdb_close(dbs[i]);
+}
+
+int parse_domainlist(char *string, struct domainlist *list)
+{
+   char *token, *copy;
+   std::string domain;
+   int rv;
+
+   /* make a copy so we don't overwrite argv[] */
+   string = copy = strdup(string);
+
+   while ((token = strsep(&string, ", \t\r\n")))
+   {
+      if (*token == '\0')
+         continue;
+
+      /* A path names a file holding more domains, either a text list
+         or one compiled by spamass-makelist */
+      if (*token == '/')
+      {
+         if (listdb_probe(token))
+         {
+            if (add_listdb(token, list->dbs) < 0)
+            {
+               free(copy);
+               return -1;
+            }
+            continue;
+         }
+
+         char *contents = read_listfile(token);
+         if (!contents)
+         {
+            config_error("Could not read domain list %s: %s", token, strerror(errno));
+            free(copy);
+            return -1;
+         }
+         debug(D_MISC, "Reading domain list from %s", token);
+         rv = parse_domainlist(contents, list);
+         free(contents);
+         if (rv < 0)
+         {
+            free(copy);
+            return -1;
+         }
+         continue;
+      }
+
+      if (parse_domain(token, domain) < 0)
+      {
+         config_error("Could not parse \"%s\" as a domain", token);
+         free(copy);
+         return -1;
+      }
+      /* the domain and every host below it */
+      domainnode_insert(&list->domains, domain, false);
+      domainnode_insert(&list->domains, domain, true);
+   }
+   free(copy);
+   return 0;
+}
+
+bool host_in_domainlist(const string& host, const struct domainlist *list)
+{
+   vector<struct listdb *>::size_type i;
+
+   if (domainnode_lookup(list->domains, host))
+      return true;
+   for (i = 0; i < list->dbs.size(); i++)
+   {
+      if (listdb_lookup_domain(list->dbs[i], host))
+         return true;
+   }
+   return false;
+}
+
+/* Load the -E rules: "file[,threshold]", the threshold being the score
+   at which the rules' scores reject a message, 5 unless given */
+int parse_rules(char *arg, struct runtime_config *cfg)
+{
+   std::string path = arg;
+   std::string::size_type comma = path.rfind(',');
+   double threshold = 5.0;
+   char errbuf[1024];
+   struct ruleset *rs;
+
+   if (comma != std::string::npos)
+   {
+      char *end;
+
+      threshold = strtod(path.c_str() + comma + 1, &end);
+      if (comma + 1 == path.size() || *end)
+      {
+         config_error("Could not parse \"%s\" as rulesfile[,threshold]", arg);
+         return -1;
+      }
+      path.erase(comma);
+   }
+
+   rs = ruleset_load(path.c_str(), threshold, errbuf, sizeof(errbuf));
+   if (!rs)
+   {
+      config_error("%s", errbuf);
+      return -1;
+   }
+   debug(D_MISC, "Loaded %lu rules from %s", (unsigned long)rs->rules.size(), path.c_str());
+   if (cfg->rules)
+      ruleset_free(cfg->rules);
+   cfg->rules = rs;
+   return 0;
+}
+
+/* mimehash hands the text parts of the body to the -U scanner, the -E
+   rules and the -y classifier here */
+void body_text(void *arg, const char *data, size_t len)
+{
+   SpamAssassin *assassin = (SpamAssassin *)arg;
+
+   if (assassin->scanning)
+   {
+      if (data)
+         uriscan_update(&assassin->uriscan, data, len);
+      else
+         uriscan_end(&assassin->uriscan);
+   }
+   if (assassin->ruling)
+   {
+      if (data)
+         ruleset_body(assassin->config->rules, &assassin->rulestate, data, len);
+      else
+         ruleset_body_break(assassin->config->rules, &assassin->rulestate);
+   }
+   if (assassin->classifying)
+   {
+      if (data)
+         bayes_update(&assassin->bayes, data, len);
+      else
+         bayes_field(&assassin->bayes, NULL);
+   }
+}
+
+/* mimehash hands back the body as sent here.  The content of a part that
+   is not text is held until it turns out to be bigger than -s, and from
+   then on only counted. */
+void body_pass(void *arg, const char *data, size_t len, bool binary)
+{
+   SpamAssassin *assassin = (SpamAssassin *)arg;
+
+   if (!binary)
+   {
+      end_attachment(assassin);
+      assassin->strippedbody.append(data, len);
+   } else if (assassin->removed)
+      assassin->removed += len;
+   else
+   {
+      assassin->attachment.append(data, len);
+      if (assassin->attachment.size() > strip_size)
+      {
+         assassin->removed = assassin->attachment.size();
+         assassin->removedtype = assassin->mimehash.type;
+         assassin->removedencoding = assassin->mimehash.encoding;
+         string().swap(assassin->attachment);
+      }
+   }
+   assassin->account();
+}
+
+/* text as base64, in lines of 76 characters */
+static string base64_lines(const string& text)
+{
+   static const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   string out;
+   string::size_type i;
+
+   for (i = 0; i < text.size(); i += 3)
+   {
+      unsigned long bits = (unsigned char)text[i] << 16;
+
+      if (i + 1 < text.size())
+         bits |= (unsigned char)text[i + 1] << 8;
+      if (i + 2 < text.size())
+         bits |= (unsigned char)text[i + 2];
+      out += digits[(bits >> 18) & 63];
+      out += digits[(bits >> 12) & 63];
+      out += i + 1 < text.size() ? digits[(bits >> 6) & 63] : '=';
+      out += i + 2 < text.size() ? digits[bits & 63] : '=';
+      if (i % 57 == 54)
+         out += "\r\n";
+   }
+   if (text.size() % 57)
+      out += "\r\n";
+   return out;
+}
+
+/* The part body_pass() was holding has ended: let it through if it was
+   small, or else say in its place what was taken out */
+void end_attachment(SpamAssassin *assassin)
+{
+   string note;
+   char size[32];
+
+   if (!assassin->removed)
+   {
+      assassin->strippedbody += assassin->attachment;
+      assassin->attachment.clear();
+      return;
+   }
+   debug(D_MISC, "Leaving out %lu bytes of %s", (unsigned long)assassin->removed,
+      assassin->removedtype.c_str());
+   snprintf(size, sizeof(size), "%lu", (unsigned long)assassin->removed);
+   note = string("[") + size + " bytes of " + assassin->removedtype +
+      " left out by spamass-milter]\r\n";
+   /* the part keeps its header, so the note must read right in its
+      Content-Transfer-Encoding */
+   if (assassin->removedencoding == MIME_BASE64)
+      note = base64_lines(note);
+   else if (assassin->removedencoding == MIME_QP)
+   {
+      string::size_type i;
+
+      for (i = 0; i < note.size(); i++)
+         if (note[i] == '=' || (unsigned char)note[i] >= 0x80)
+         {
+            snprintf(size, sizeof(size), "=%02X", (unsigned char)note[i]);
+            note.replace(i, 1, size);
+            i += 2;
+         }
+   }
+   assassin->strippedbody += note;
+   assassin->stripped = true;
+   assassin->removed = 0;
+}
+
+/* Is a URL in the body seen since the last call into a -U domain?  Logs
+   the host that is. */
+bool uri_blocked(SpamAssassin *assassin)
+{
+   vector<string>& found = assassin->uriscan.found;
+   vector<string>::size_type i;
+
+   if (!assassin->scanning)
+      return false;
+   for (i = 0; i < found.size(); i++)
+   {
+      if (host_in_domainlist(found[i], &assassin->config->uriblock))
+      {
+         debug(D_ALWAYS, "URI host %s is on the domain blocklist", found[i].c_str());
+         found.clear();
+         return true;
+      }
+   }
+   found.clear();
+   return false;
+}
+
 char *strlwr(char *str)
 {
     char *s = str;
@@ -2529,6 +5196,702 @@ FILE *popenv(char *const argv[], const char *type, pid_t *pid)
 	return (iop);
 }
 
+/*
+   Expand rcpts through the aliases and virtusertable with a single
+   sendmail -bv, appending every deliverable address to expanded.
+   Returns 0 if sendmail gave a definite answer, or -1 if it could not
+   be run or failed temporarily.
+
+   sendmail reports each deliverable address as "addr... deliverable",
+   where addr is what it ended up delivering to, so once an alias has
+   been expanded its lines can no longer be told apart from those of the
+   other recipients.  byrcpt gets each recipient's own share of the
+   addresses only when they can: when there was a single recipient, or
+   when no line names an address that wasn't asked about.
+*/
+int expand_recipients(const list<string>& rcpts, list<string>& expanded,
+	unordered_map<string, list<string> >& byrcpt)
+{
+	char buf[1024];
+	char **popen_argv;
+	list<string> found;
+	unordered_map<string, list<string> > lines;
+	list<string>::const_iterator it;
+	bool attributable = true;
+	pid_t pid;
+	int status, argc = 0;
+	FILE *p;
+
+	if (rcpts.empty())
+		return 0;
+
+	popen_argv = (char **)malloc((rcpts.size() + 3) * sizeof(char *));
+	popen_argv[argc++] = path_to_sendmail;
+	popen_argv[argc++] = (char *)"-bv";
+	for (it = rcpts.begin(); it != rcpts.end(); ++it)
+	{
+		popen_argv[argc++] = const_cast<char *>(it->c_str());
+		lines[normalize_address(it->c_str())];
+	}
+	popen_argv[argc] = NULL;
+
+	debug(D_RCPT, "calling %s -bv for %d recipients", path_to_sendmail, (int)rcpts.size());
+
+	p = popenv(popen_argv, "r", &pid);
+	free(popen_argv);
+	if (!p)
+	{
+		debug(D_RCPT, "popenv failed(%s).  Will not expand aliases", strerror(errno));
+		expanded.insert(expanded.end(), rcpts.begin(), rcpts.end());
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), p) != NULL)
+	{
+		int i = strlen(buf);
+		/* strip trailing EOLs */
+		while (i > 0 && buf[i - 1] <= ' ')
+			i--;
+		buf[i] = '\0';
+		debug(D_RCPT, "sendmail output: %s", buf);
+		/*	From a quick scan of the sendmail source, a valid email
+			address gets printed via either
+			    "deliverable: mailer %s, host %s, user %s"
+			or  "deliverable: mailer %s, user %s"
+		*/
+		char *d = strstr(buf, "... deliverable: mailer ");
+		if (d)
+		{
+			char *u=strstr(d,", user ");
+			if (!u)
+				continue;
+			/* anything after ", user " is the email address */
+			debug(D_RCPT, "user: %s", u+7);
+			found.push_back(u+7);
+
+			*d = '\0';
+			unordered_map<string, list<string> >::iterator l = lines.find(normalize_address(buf));
+			if (l != lines.end())
+				l->second.push_back(u+7);
+			else
+				attributable = false;
+		}
+	}
+	fclose(p); p = NULL;
+	expanded.insert(expanded.end(), found.begin(), found.end());
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) == EX_TEMPFAIL || WEXITSTATUS(status) == EX_OSERR)
+		return -1;
+
+	if (rcpts.size() == 1)
+		byrcpt[rcpts.front()] = found;
+	else if (attributable)
+		for (it = rcpts.begin(); it != rcpts.end(); ++it)
+			byrcpt[*it] = lines[normalize_address(it->c_str())];
+	return 0;
+}
+
+/* Fill in assassin's expanded recipients, and the one to give spamc,
+   once all the RCPTs are in.  With -Y they are looked up in the alias
+   maps; otherwise recipients the -X cache knows are taken from it and
+   the rest are expanded together. */
+void resolve_recipients(SpamAssassin *assassin)
+{
+	list<string> misses, expanded;
+	unordered_map<string, list<string> > byrcpt;
+	list<string>::iterator it;
+	shared_ptr<const aliasmap> map;
+
+	if (aliases_path || virtusers_path)
+		map = current_aliasmap();
+
+	for (it = assassin->unexpandedrcpt.begin(); it != assassin->unexpandedrcpt.end(); ++it)
+	{
+		if (map)
+		{
+			aliasmap_expand(map.get(), *it, assassin->expandedrcpt);
+			debug(D_RCPT, "expanded %s from the alias maps", it->c_str());
+		} else if (expandcache_lookup(*it, expanded))
+		{
+			debug(D_RCPT, "using cached expansion of %s", it->c_str());
+			assassin->expandedrcpt.splice(assassin->expandedrcpt.end(), expanded);
+		} else
+			misses.push_back(*it);
+	}
+	if (expand_recipients(misses, expanded, byrcpt) == 0)
+	{
+		unordered_map<string, list<string> >::iterator b;
+		for (b = byrcpt.begin(); b != byrcpt.end(); ++b)
+			expandcache_store(b->first, b->second);
+	}
+	assassin->expandedrcpt.splice(assassin->expandedrcpt.end(), expanded);
+	assassin->unexpandedrcpt.clear();
+	debug(D_RCPT, "Total of %d actual recipients", (int)assassin->expandedrcpt.size());
+
+	/* If we expanded to at least one user, record the first one */
+	if (!assassin->expandedrcpt.empty() && (assassin->rcpt().size() == 0))
+	{
+		debug(D_RCPT, "remembering %s for spamc", assassin->expandedrcpt.front().c_str());
+		assassin->set_rcpt(assassin->expandedrcpt.front());
+	}
+}
+
+/* Fetch rcpt's expansion from the -X cache.  Returns false on a miss. */
+bool expandcache_lookup(const string& rcpt, list<string>& expanded)
+{
+	unordered_map<string, list<struct expandentry>::iterator>::iterator it;
+	bool hit = false;
+
+	if (expandcache_max == 0)
+		return false;
+	pthread_mutex_lock(&expandcache_mutex);
+	it = expandcache_index.find(rcpt);
+	if (it != expandcache_index.end())
+	{
+		if (it->second->expires > time(NULL))
+		{
+			/* move it to the front */
+			expandcache_lru.splice(expandcache_lru.begin(), expandcache_lru, it->second);
+			expanded = it->second->expanded;
+			hit = true;
+		} else
+		{
+			expandcache_lru.erase(it->second);
+			expandcache_index.erase(it);
+		}
+	}
+	pthread_mutex_unlock(&expandcache_mutex);
+	return hit;
+}
+
+/* Remember rcpt's expansion, pushing out the least recently used entry
+   if the cache is full.  An empty expansion is kept for the shorter
+   negative TTL. */
+void expandcache_store(const string& rcpt, const list<string>& expanded)
+{
+	unordered_map<string, list<struct expandentry>::iterator>::iterator it;
+	struct expandentry entry;
+
+	if (expandcache_max == 0)
+		return;
+	entry.rcpt = rcpt;
+	entry.expanded = expanded;
+	entry.expires = time(NULL) + (expanded.empty() ? expandcache_negttl : expandcache_ttl);
+
+	pthread_mutex_lock(&expandcache_mutex);
+	it = expandcache_index.find(rcpt);
+	if (it != expandcache_index.end())
+	{
+		expandcache_lru.erase(it->second);
+		expandcache_index.erase(it);
+	}
+	expandcache_lru.push_front(entry);
+	expandcache_index[rcpt] = expandcache_lru.begin();
+	while (expandcache_lru.size() > expandcache_max)
+	{
+		expandcache_index.erase(expandcache_lru.back().rcpt);
+		expandcache_lru.pop_back();
+	}
+	pthread_mutex_unlock(&expandcache_mutex);
+}
+
+/* The header fields spamd may set that assassinate() acts on */
+static const char *const verdict_fields[] = {
+	"X-Spam-Flag", "X-Spam-Status", "X-Spam-Relay-Country", "X-Spam-ASN",
+	"X-Spam-Report", "X-Spam-Prev-Content-Type", "X-Spam-Level",
+	"X-Spam-Checker-Version", "Subject", "Content-Type", NULL
+};
+
+/* A header field as it goes into the -H key: the name in lowercase and
+   the value unfolded, with runs of white space squeezed to one space */
+string normalize_field(const char *name, const char *value)
+{
+	string field;
+	string::size_type start;
+	bool space = false;
+
+	for (; *name; name++)
+		field += tolower(*name);
+	field += ":";
+	start = field.size();
+	for (; *value; value++)
+	{
+		if (isspace((unsigned char)*value))
+			space = true;
+		else
+		{
+			if (space && field.size() > start)
+				field += ' ';
+			field += *value;
+			space = false;
+		}
+	}
+	return field + "\n";
+}
+
+/* Finish the -H key of a message whose body has all arrived */
+string verdict_key(SpamAssassin *assassin)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+
+	sha256_final(&assassin->digest, md);
+	return string((char *)md, sizeof(md));
+}
+
+/* Finish the -k key of a message at end of header: add the network it
+   came from, a /24 for IPv4 and a /64 for IPv6, and its recipients, in
+   an order that doesn't depend on the RCPT TO: order */
+string header_key(SpamAssassin *assassin)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH], addr[16];
+	vector<string> rcpts;
+	vector<string>::size_type i;
+	list<string>::iterator it;
+	string net;
+
+	if (inet_pton(AF_INET, assassin->connectip().c_str(), addr) == 1)
+		net.assign((char *)addr, 3);
+	else if (inet_pton(AF_INET6, assassin->connectip().c_str(), addr) == 1)
+		net.assign((char *)addr, 8);
+	else
+		net = assassin->connectip();
+	net += "\n";
+	sha256_update(&assassin->headerdigest, net.data(), net.size());
+
+	for (it = assassin->recipients.begin(); it != assassin->recipients.end(); it++)
+		rcpts.push_back(normalize_address(it->c_str()));
+	sort(rcpts.begin(), rcpts.end());
+	for (i = 0; i < rcpts.size(); i++)
+	{
+		string rcpt = rcpts[i] + "\n";
+
+		sha256_update(&assassin->headerdigest, rcpt.data(), rcpt.size());
+	}
+
+	sha256_final(&assassin->headerdigest, md);
+	return string((char *)md, sizeof(md));
+}
+
+/* Take out every occurrence of a header field, continuation lines too */
+static void remove_field(string& header, const string& field)
+{
+	string::size_type idx = 0, end;
+
+	while ((idx = find_nocase(header, field + ":", idx)) != string::npos)
+	{
+		if (idx != 0 && header[idx - 1] != '\n')
+		{
+			idx++;
+			continue;
+		}
+		end = idx;
+		do
+			end = header.find('\n', end) + 1;
+		while (end != 0 && end < header.size() && (header[end] == ' ' || header[end] == '\t'));
+		header.erase(idx, end == 0 ? string::npos : end - idx);
+	}
+}
+
+/* Make spamc's reply to the message we held back from a cached verdict,
+   as if spamd had just answered.  Returns false if the verdict can't be
+   used: spamd replaced the body of the copy it saw with a report that
+   quotes that copy's headers, and this copy would go on with that body.
+   A verdict on a near duplicate (fuzzy) can't be used either if spamd
+   rewrote that copy's Subject: or Content-Type:. */
+bool replay_verdict(SpamAssassin *assassin, const struct verdict& v, bool onlytag, bool fuzzy)
+{
+	const struct runtime_config *cfg = assassin->config.get();
+	const string& held = assassin->outputbuffer;
+	string::size_type eoh = 0;
+	string reply;
+	vector<pair<string, string> >::size_type i;
+	bool rewrites = v.rewrote_body;
+
+	for (i = 0; fuzzy && i < v.fields.size(); i++)
+		if (strcasecmp(v.fields[i].first.c_str(), "Subject") == 0 ||
+		    strcasecmp(v.fields[i].first.c_str(), "Content-Type") == 0)
+			rewrites = true;
+
+	if (rewrites && !dontmodifyspam &&
+	    !(cfg->flag_reject && cfg->reject_score == -1 && !onlytag))
+	{
+		debug(D_MISC, "cached verdict rewrote the message; scanning this copy");
+		return false;
+	}
+
+	/* the held back message is our headers, a blank line and the body */
+	if (held.compare(0, 2, "\r\n") != 0)
+		eoh = held.find("\r\n\r\n") + 2;
+	reply = held.substr(0, eoh);
+
+	for (i = 0; i < v.fields.size(); i++)
+	{
+		string value = v.fields[i].second;
+		string::size_type idx = value.size();
+
+		while ((idx = value.rfind("\n", idx)) != string::npos)
+			value.replace(idx, 1, "\r\n");
+		remove_field(reply, v.fields[i].first);
+		reply += v.fields[i].first + ": " + value + "\r\n";
+	}
+	reply += held.substr(eoh);
+	assassin->replay(reply);
+	return true;
+}
+
+static bool verdict_confident(const string& status);
+
+/* Remember what spamd made of a message in the -H and -N caches.  Nothing is
+   kept unless spamd answered: if it can't be reached, spamc passes the
+   message on as it was. */
+void save_verdict(SpamAssassin *assassin, const string& key)
+{
+	string::size_type eoh1 = assassin->d().find("\n\n");
+	string::size_type eoh2 = assassin->d().find("\n\r\n");
+	string::size_type eoh = ( eoh1 < eoh2 ? eoh1 : eoh2 );
+	string::size_type bob = body_offset(assassin->d());
+	string header = assassin->d().substr(0, eoh);
+	unsigned char sent[SHA256_DIGEST_LENGTH], got[SHA256_DIGEST_LENGTH];
+	struct sha256_ctx ctx;
+	struct verdict v;
+	uint64_t fp;
+	int i;
+
+	if (assassin->error || retrieve_field(header, "X-Spam-Status").empty())
+		return;
+
+	for (i = 0; verdict_fields[i]; i++)
+	{
+		string value = retrieve_field(header, verdict_fields[i]);
+
+		/* Subject: and Content-Type: only if spamd changed them */
+		if (value.empty() ||
+		    (strcasecmp(verdict_fields[i], "Subject") == 0 && value == assassin->subject()) ||
+		    (strcasecmp(verdict_fields[i], "Content-Type") == 0 && value == assassin->content_type()))
+			continue;
+		v.fields.push_back(make_pair(string(verdict_fields[i]), value));
+	}
+
+	/* A body that starts with blank lines looks replaced; that only
+	   costs a rescan of the next copy */
+	sha256_final(&assassin->bodydigest, sent);
+	sha256_init(&ctx);
+	sha256_update(&ctx, assassin->d().data() + bob, assassin->d().size() - bob);
+	sha256_final(&ctx, got);
+	v.rewrote_body = memcmp(sent, got, sizeof(sent)) != 0;
+
+	if (assassin->digesting)
+		verdictcache_store(key, v);
+	if (!verdict_confident(retrieve_field(header, "X-Spam-Status")))
+		return;
+	if (assassin->digesting && fuzzy_fingerprint(assassin, &fp))
+		fuzzycache_store(fp, assassin->spamc_user(), v);
+	if (!assassin->headerkey.empty())
+		verdictcache_store(assassin->headerkey, v);
+}
+
+/* Ask the -y classifier about a message held back for spamc.  If it is
+   sure enough that it is ham, make up spamc's reply with an X-Spam-Status:
+   of our own and return true, unless the message is one of the sample
+   that spamd still sees so that the classifier can be checked and keeps
+   learning. */
+bool bayes_ham(SpamAssassin *assassin, bool onlytag)
+{
+	double p = bayes_classify(&assassin->bayes);
+	struct verdict v;
+	char status[128];
+
+	if (p < 0 || p > 1 - bayes_confidence)
+		return false;
+	if (assassin->sampled)
+	{
+		debug(D_MISC, "classified as ham (spam probability %.3g), scanning as a sample", p);
+		return false;
+	}
+	debug(D_MISC, "classified as ham (spam probability %.3g), not scanning", p);
+	snprintf(status, sizeof(status), "No, score=0.0 tests=MILTER_BAYES_HAM probability=%.3g", p);
+	v.fields.push_back(make_pair(string("X-Spam-Status"), string(status)));
+	v.rewrote_body = false;
+	return replay_verdict(assassin, v, onlytag, false);
+}
+
+/* Teach the -y classifier what spamd made of a message, if it was clear
+   about it */
+void learn_verdict(SpamAssassin *assassin)
+{
+	string::size_type eoh1 = assassin->d().find("\n\n");
+	string::size_type eoh2 = assassin->d().find("\n\r\n");
+	string::size_type eoh = ( eoh1 < eoh2 ? eoh1 : eoh2 );
+	string status;
+
+	if (assassin->error)
+		return;
+	status = retrieve_field(assassin->d().substr(0, eoh), "X-Spam-Status");
+	if (!verdict_confident(status))
+		return;
+	bayes_learn(&assassin->bayes, strncasecmp(status.c_str(), "Yes", 3) == 0);
+}
+
+/* The -N fingerprint of the message body.  Returns false if there is no
+   index or too little text for the fingerprint to mean much. */
+bool fuzzy_fingerprint(SpamAssassin *assassin, uint64_t *fp)
+{
+	unsigned long shingles;
+
+	if (fuzzycache_max == 0)
+		return false;
+	*fp = simhash_value(&assassin->fingerprint, &shingles);
+	return shingles >= FUZZY_MINSHINGLES;
+}
+
+/* Is the score in an X-Spam-Status: field far enough from the threshold
+   that a slightly different message would very likely score the same
+   side of it? */
+static bool verdict_confident(const string& status)
+{
+	double score, required;
+	int rv;
+
+	/* SA 3.0 uses the keyword "score", SA 2.x "hits" */
+	rv = sscanf(status.c_str(), "%*s score=%lf required=%lf", &score, &required);
+	if (rv != 2)
+		rv = sscanf(status.c_str(), "%*s hits=%lf required=%lf", &score, &required);
+	if (rv != 2)
+		return false;
+	return score - required >= FUZZY_MARGIN || required - score >= FUZZY_MARGIN;
+}
+
+/* Can a verdict found under the -k key be acted on with no body at
+   hand?  Only if assassinate() will neither replace the body nor keep a
+   copy of it: spam must be rejected outright or left alone (-m), and
+   nothing that is rejected or flagged may be quarantined or go to the
+   spam bucket.  Like -N, this takes a clear score, since the key says
+   nothing of the body. */
+bool header_verdict_usable(SpamAssassin *assassin, const struct verdict& v, bool onlytag)
+{
+	const struct runtime_config *cfg = assassin->config.get();
+	string status;
+	bool spam = false, rewrites = v.rewrote_body;
+	vector<pair<string, string> >::size_type i;
+
+	for (i = 0; i < v.fields.size(); i++)
+	{
+		const char *name = v.fields[i].first.c_str();
+
+		if (strcasecmp(name, "X-Spam-Status") == 0)
+			status = v.fields[i].second;
+		else if (strcasecmp(name, "X-Spam-Flag") == 0)
+			spam = true;
+		else if (strcasecmp(name, "Subject") == 0 || strcasecmp(name, "Content-Type") == 0)
+			rewrites = true;
+	}
+
+	if (!verdict_confident(status))
+		return false;
+	if ((quarantine_dir || flag_bucket) && (spam || cfg->flag_reject))
+		return false;
+	if (!spam)
+		return !rewrites;
+	return dontmodifyspam || (cfg->flag_reject && cfg->reject_score == -1 && !onlytag);
+}
+
+/* Parse a cache size with up to nttls optional lifetimes in seconds,
+   "entries[,ttl...]".  ttls keeps its defaults for any left out.
+   Returns -1 if the string is malformed. */
+int parse_cachespec(const char *spec, unsigned long *entries, long *ttls, int nttls)
+{
+	char *end;
+	int i;
+
+	errno = 0;
+	*entries = strtoul(spec, &end, 10);
+	if (errno || end == spec || *entries == 0)
+		return -1;
+	for (i = 0; i < nttls && *end == ','; i++)
+	{
+		spec = end + 1;
+		ttls[i] = strtol(spec, &end, 10);
+		if (errno || end == spec || ttls[i] < 0)
+			return -1;
+	}
+	return *end ? -1 : 0;
+}
+
+/* Add delta (which may be negative) to the count of in-flight bytes */
+void inflight_adjust(long delta)
+{
+	if (delta == 0)
+		return;
+	pthread_mutex_lock(&inflight_mutex);
+	inflight_bytes += delta;
+	pthread_mutex_unlock(&inflight_mutex);
+}
+
+/* The count of in-flight bytes, for the log */
+unsigned long inflight_current()
+{
+	unsigned long bytes;
+
+	pthread_mutex_lock(&inflight_mutex);
+	bytes = inflight_bytes;
+	pthread_mutex_unlock(&inflight_mutex);
+	return bytes;
+}
+
+/* Have the messages in progress used up the -L allowance, or would
+   coming more bytes take it past the limit?  A message bigger than the
+   allowance is still let in when nothing else is in progress. */
+bool inflight_over_limit(unsigned long coming)
+{
+	bool over;
+
+	if (inflight_limit == 0)
+		return false;
+	pthread_mutex_lock(&inflight_mutex);
+	over = inflight_bytes >= inflight_limit ||
+		(inflight_bytes > 0 && inflight_bytes + coming > inflight_limit);
+	pthread_mutex_unlock(&inflight_mutex);
+	return over;
+}
+
+/* Are all -j sessions in use and the queue for them full? */
+bool session_full()
+{
+	bool full;
+
+	pthread_mutex_lock(&session_mutex);
+	full = sessions_active >= session_max && session_waiting.size() >= session_queue;
+	pthread_mutex_unlock(&session_mutex);
+	return full;
+}
+
+/* Take a -j session if one is free and no message is waiting for one */
+bool session_try()
+{
+	bool got;
+
+	pthread_mutex_lock(&session_mutex);
+	got = sessions_active < session_max && session_waiting.empty();
+	if (got)
+		sessions_active++;
+	pthread_mutex_unlock(&session_mutex);
+	return got;
+}
+
+/* Take a -j session for a message that has all arrived, waiting up to
+   SESSION_WAIT seconds if none is free.  Returns 1 once it has one, 0
+   if none came in time, or -1 if the queue is full. */
+int session_wait(unsigned long size)
+{
+	struct sessionwait w;
+	list<struct sessionwait *>::iterator it;
+	unsigned long ahead = 0;
+	struct timespec deadline;
+	int rv;
+
+	w.size = size;
+	w.since = time(NULL);
+	w.granted = false;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += SESSION_WAIT;
+
+	pthread_mutex_lock(&session_mutex);
+	if (sessions_active < session_max && session_waiting.empty())
+	{
+		sessions_active++;
+		rv = 1;
+	} else if (session_waiting.size() >= session_queue)
+		rv = -1;
+	else
+	{
+		for (it = session_waiting.begin(); it != session_waiting.end(); it++, ahead++)
+			if (!session_fifo && (*it)->size > size)
+				break;
+		session_waiting.insert(it, &w);
+		debug(D_MISC, "waiting for a spamc session behind %lu messages", ahead);
+		while (!w.granted)
+			if (pthread_cond_timedwait(&session_cond, &session_mutex, &deadline) == ETIMEDOUT)
+				break;
+		if (!w.granted)
+			session_waiting.remove(&w);
+		rv = w.granted;
+	}
+	pthread_mutex_unlock(&session_mutex);
+	return rv;
+}
+
+/* A session has ended: hand it to the next message waiting, if any.
+   That is the smallest, unless some message has waited SESSION_AGE
+   seconds, when it is the one that has waited longest. */
+void session_release()
+{
+	list<struct sessionwait *>::iterator it, next;
+	time_t old = time(NULL) - SESSION_AGE;
+
+	pthread_mutex_lock(&session_mutex);
+	if (session_waiting.empty())
+		sessions_active--;
+	else
+	{
+		next = session_waiting.begin();
+		for (it = session_waiting.begin(); !session_fifo && it != session_waiting.end(); ++it)
+			if ((*it)->since <= old && (*it)->since < (*next)->since)
+				next = it;
+		(*next)->granted = true;
+		session_waiting.erase(next);
+		pthread_cond_broadcast(&session_cond);
+	}
+	pthread_mutex_unlock(&session_mutex);
+}
+
+/* The SIZE= parameter of MAIL FROM:, or 0 if the client gave none */
+unsigned long declared_size(char **envfrom)
+{
+	char *end;
+	unsigned long size;
+	int i;
+
+	for (i = 1; envfrom[i]; i++)
+	{
+		if (strncasecmp(envfrom[i], "SIZE=", 5) != 0 || !isdigit((unsigned char)envfrom[i][5]))
+			continue;
+		size = strtoul(envfrom[i] + 5, &end, 10);
+		if (*end == '\0')
+			return size;
+	}
+	return 0;
+}
+
+/* Parse a byte count with an optional k, m or g suffix.  Returns 0 if
+   the string is not a valid size. */
+unsigned long parse_size(const char *str)
+{
+	char *end;
+	unsigned long size;
+
+	errno = 0;
+	size = strtoul(str, &end, 10);
+	if (errno || end == str)
+		return 0;
+	switch (tolower(*end))
+	{
+		case 'g':
+			size *= 1024;
+			/* FALLTHROUGH */
+		case 'm':
+			size *= 1024;
+			/* FALLTHROUGH */
+		case 'k':
+			size *= 1024;
+			end++;
+			break;
+		default:
+			break;
+	}
+	if (*end)
+		return 0;
+	return size;
+}
+
 // convert status to nonpermant
 //
 // Replace the first char of a string to convert a status to nonpermanent
@@ -36,11 +36,33 @@
 #endif
 
 #include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "aliasmap.h"
+#include "bayes.h"
+#include "greylist.h"
+#include "listdb.h"
+#include "mimehash.h"
+#include "reputation.h"
+#include "ruleset.h"
+#include "uriscan.h"
+#include "sha256.h"
+#include "simhash.h"
+#include "verdictcache.h"
 
 using namespace std;
 
 string retrieve_field(const string&, const string&);
 
+/* libmilter 8.14 and later can be asked to stop sending the body */
+#if SMFI_VERSION > 3 && defined(SMFIP_SKIP)
+#define HAVE_MILTER_SKIP 1
+#endif
+
 sfsistat mlfi_connect(SMFICTX*, char*, _SOCK_ADDR*);
 sfsistat mlfi_helo(SMFICTX*, char*);
 sfsistat mlfi_envrcpt(SMFICTX*, char**);
@@ -52,44 +74,168 @@ sfsistat mlfi_eom(SMFICTX*);
 sfsistat mlfi_close(SMFICTX*);
 sfsistat mlfi_abort(SMFICTX*);
 sfsistat mlfi_abort(SMFICTX*);
+#ifdef HAVE_MILTER_SKIP
+sfsistat mlfi_negotiate(SMFICTX*, unsigned long, unsigned long, unsigned long,
+	unsigned long, unsigned long*, unsigned long*, unsigned long*, unsigned long*);
+#endif
 
 extern struct smfiDesc smfilter;
 
-/* struct describing a single network */
-union net
+/* a node in a path-compressed binary radix (Patricia) tree of prefixes */
+struct netnode
 {
-	struct
-	{
-		uint8_t af;
-	} net;
-	struct
-	{
-		uint8_t af;
-		struct in_addr network;
-		struct in_addr netmask;
-	} net4;
-	struct
-	{
-		uint8_t af;
-		struct in6_addr network;
-		int netmask; /* Just the number of bits for IPv6 */
-	} net6;
+	struct netnode *child[2];
+	uint8_t key[16];	// network in network byte order, host bits zeroed
+	int bits;		// prefix length
+	int action;		// enum netaction
 };
 
-/* an array of networks */
+/* a list of networks, one tree per address family, plus any compiled
+   list files it names */
 struct networklist
 {
-	union net *nets;
+	struct netnode *root4;
+	struct netnode *root6;
 	int num_nets;
+	vector<struct listdb *> dbs;
+
+	networklist() : root4(NULL), root6(NULL), num_nets(0) {}
+	~networklist();
+};
+
+/* a node in a tree of domain names, keyed on labels right to left */
+struct domainnode
+{
+	unordered_map<string, struct domainnode *> labels;
+	bool domain;		// "@domain" entry ends here
+	bool subdomains;	// "@*.domain" entry ends here
+
+	domainnode() : domain(false), subdomains(false) {}
+	~domainnode();
 };
 
-/* an array of addresses */
+/* a set of addresses and domains, plus any compiled list files it
+   names; addresses are normalized with normalize_address() */
 struct addresslist
 {
-        char **addrs;
-        int num_addrs;
+	unordered_set<string> addrs;
+	struct domainnode *domains;
+	int num_addrs;
+	vector<struct listdb *> dbs;
+
+	addresslist() : domains(NULL), num_addrs(0) {}
+	~addresslist();
+};
+
+/* domains whose hosts may not appear in URLs, plus any compiled list
+   files that hold more; each entry covers the hosts below it too */
+struct domainlist
+{
+	struct domainnode *domains;
+	vector<struct listdb *> dbs;
+
+	bool empty() const { return !domains && dbs.empty(); }
+	domainlist() : domains(NULL) {}
+	~domainlist();
+};
+
+/* SHA-256 digests of known spam content, plus any compiled list files
+   that hold more */
+struct hashlist
+{
+	unordered_set<string> digests;	// LISTDB_DIGESTLEN bytes each
+	vector<struct listdb *> dbs;
+
+	bool empty() const { return digests.empty() && dbs.empty(); }
+	~hashlist();
+};
+
+/* Settings that can be changed without a restart.  One is built at
+   startup and again on every SIGUSR1, then swapped in whole; a message
+   keeps using the one that was current when it started. */
+struct runtime_config
+{
+	struct networklist ignorenets;		// -i
+	struct addresslist ignoreaddrs;		// -T
+	struct addresslist allowsenders;	// -F
+	struct hashlist blockhashes;		// -K
+	struct domainlist uriblock;		// -U
+	struct ruleset *rules;			// -E
+	bool flag_reject;
+	int reject_score;
+	bool flag_random_defer;
+	int random_defer_score;
+	char *rejecttext;		// If we reject a mail, then use this text
+	char *rejectcode;		// If we reject a mail, then use code
+	char *reject_reply_code;	// If we reject a mail, then use smtp code
+	char *defercode;		// If we defer a mail, then use code
+	char *defer_reply_code;		// If we defer a mail, then use smtp code
+	vector<string> spamc_args;	// everything after --
+
+	runtime_config();
+	~runtime_config();
+
+private:
+	runtime_config(const runtime_config&);
+	runtime_config& operator=(const runtime_config&);
+};
+
+/* a cached alias/virtusertable expansion of one recipient (-X) */
+struct expandentry
+{
+	string rcpt;
+	list<string> expanded;	// empty if nothing was deliverable
+	time_t expires;
 };
 
+/* a bucket copy waiting in the -Q spool */
+struct spoolentry
+{
+	string name;		// file in the spool directory
+	int attempts;		// failed deliveries so far
+	time_t next_try;
+};
+
+/* a message on its way into the -q quarantine */
+struct quarantine_item
+{
+	string objects[2];	// header and body object names
+	bool store[2];		// not in the store yet ...
+	string data[2];		// ... so write this
+	vector<string> index;	// index files (recipients) to add entry to
+	string entry;		// the index line
+	bool done;		// set by the committer ...
+	bool ok;		// ... with whether it reached the disk
+};
+
+/* messages bigger than this are scanned as they arrive instead of being
+   held back for the -H verdict cache */
+#define VERDICT_MAXSIZE (256*1024)
+
+/* a SIZE= parameter is trusted with no more memory than this up front */
+#define SIZE_RESERVE_MAX (1024*1024)
+
+/* seconds a message may wait for a -j session at end of message, well
+   inside the MTA's usual five minutes */
+#define SESSION_WAIT 120
+
+/* a message that has waited this long for a -j session goes before
+   smaller ones */
+#define SESSION_AGE 30
+
+/* a message waiting for a -j session */
+struct sessionwait
+{
+	unsigned long size;	// bytes spamc will get
+	time_t since;		// when it began to wait
+	bool granted;		// set by session_release()
+};
+
+/* a -N fingerprint needs this many shingles to be worth comparing, and
+   a verdict this many points either side of the threshold to be reused */
+#define FUZZY_MINSHINGLES 20
+#define FUZZY_MARGIN 2.0
+
 // Debug tokens.
 enum debuglevel
 {
@@ -109,6 +255,8 @@ public:
   void output(string);
   void close_output();
   void input();
+  void replay(const string&);
+  void account();
 
   string& d();
   
@@ -127,6 +275,7 @@ public:
   string& connectip();	/* IP of sending machine */
   string  local_user();	/* username part of first expanded recipient */
   string  full_user();	/* full first expanded recipient */
+  string  spamc_user();	/* what spamc gets for -u, or "" */
   int     numrcpt();	/* total RCPT TO: recpients */
   int     set_numrcpt();	/* increment total RCPT count */
   int     set_numrcpt(const int);	/* set total RCPT count to n */
@@ -153,6 +302,11 @@ public:
   bool error;
   bool running;		/* XXX merge running, connected, and pid */
   bool connected;	/* are we connected to spamc? */
+  bool digesting;	/* holding back spamc for a -H or -N cache lookup */
+  bool classifying;	/* holding back spamc for the -y classifier */
+  bool stripping;	/* leaving big attachments out for -s */
+  bool stripped;	/* ... and did */
+  bool sampled;		/* scanned whatever -y makes of it */
 
   // This is where we store the mail after it
   // was piped through SpamAssassin
@@ -161,6 +315,14 @@ public:
   // Data written via output() but before Connect() is stored here
   string outputbuffer;
 
+  // -s: the body as it is to go to spamc, not yet sent; the content of
+  // the part being held in case it is small; and what is known of it
+  // once it is not
+  string strippedbody, attachment;
+  string::size_type removed;
+  string removedtype;
+  int removedencoding;		// enum mimeencoding
+
   // Variables for SpamAssassin influenced fields
   string x_spam_asn, x_spam_relay_country, x_spam_status, x_spam_flag, x_spam_report, x_spam_prev_content_type;
   string x_spam_checker_version, x_spam_level, _content_type, _subject;
@@ -175,12 +337,55 @@ public:
   // The list of recipients for the current message
   list <string> recipients;
 
+  // Recipients waiting for alias/virtusertable expansion at end of header
+  list <string> unexpandedrcpt;
+
   // List of recipients after alias/virtusertable expansion
   list <string> expandedrcpt;
 
   // Process handling variables
   pid_t pid;
   int pipe_io[2][2];
+
+  // Bytes this object has added to the in-flight total
+  string::size_type accounted;
+
+  // The message size given with MAIL FROM:, 0 if none
+  unsigned long declared;
+
+  // Has it a -j session for spamc?
+  bool has_session;
+
+  // -H cache key: spamc user, significant header fields and body; and
+  // the body alone, to tell whether spamd replaced it
+  struct sha256_ctx digest, bodydigest;
+
+  // -N fingerprint of the body
+  struct simhash fingerprint;
+
+  // -y words of the Subject:, From: and text
+  struct bayes_tokens bayes;
+
+  // -K digests of the body and its MIME parts, the hosts -U looks for in
+  // its text parts, and how far the -E rules have got
+  bool hashing;
+  bool scanning;
+  bool ruling;
+  struct mimehash mimehash;
+  struct uriscan uriscan;
+  struct rulestate rulestate;
+
+  // -k cache key: Message-ID:, From:, Subject:, sending network and
+  // recipients; and the verdict found under it, which makes the body
+  // of no interest
+  struct sha256_ctx headerdigest;
+  bool has_msgid;
+  string headerkey;
+  bool headerhit;
+  struct verdict headerverdict;
+
+  // Settings this message is being handled with
+  shared_ptr<const runtime_config> config;
 };
 
 /* Private data structure to carry per-client data between calls */
@@ -194,6 +399,8 @@ struct context
 	char *auth_authen;
 	char *auth_ssf;
         bool onlytag;
+	bool ignored;		// from an address in -i: tag every message only
+	bool mta_skip;		// the MTA takes SMFIS_SKIP from mlfi_body
 	SpamAssassin *assassin; // pointer to the SA object if we're processing a message
 };
 
@@ -202,20 +409,78 @@ typedef string::size_type (SpamAssassin::*t_setter)(const string &val);
 #define callsetter(object, ptrToMember)  ((object).*(ptrToMember))
 
 int assassinate(SMFICTX*, SpamAssassin*);
+sfsistat reject_unscanned(SMFICTX*, SpamAssassin*);
+sfsistat rule_verdict(SMFICTX*, SpamAssassin*);
+void get_session(SpamAssassin*);
+
+shared_ptr<const runtime_config> current_config();
+void install_config(struct runtime_config *cfg);
+void config_error(const char *fmt, ...) __printflike(1, 2);
+int parse_config_option(int c, char *arg, struct runtime_config *cfg);
+int read_optionsfile(const char *path, struct runtime_config *cfg);
+struct runtime_config *build_config();
+void *reload_thread(void *);
+void *greylist_thread(void *);
+int load_aliasmap();
+shared_ptr<const aliasmap> current_aliasmap();
+int spool_init();
+bool spool_message(const string& msg);
+void *spool_thread(void *);
+int quarantine_init();
+bool quarantine_message(SpamAssassin *assassin, const char *queueid,
+	string::size_type bob, const char *action);
+void *quarantine_thread(void *);
 
 void throw_error(const string&);
 void debug(enum debuglevel, const char* fmt, ...) __printflike(2, 3);
 string::size_type find_nocase(const string&, const string&, string::size_type = 0);
 int cmp_nocase_partial(const string&, const string&);
 void closeall(int fd);
-void parse_networklist(char *string, struct networklist *list);
-int ip_in_networklist(struct sockaddr *addr, struct networklist *list);
-void parse_addresslist(char *string, struct addresslist *list);
-int addr_in_addresslist(char *addr, struct addresslist *list);
+char *read_listfile(const char *path);
+int parse_networklist(char *string, struct networklist *list);
+int ip_in_networklist(struct sockaddr *addr, const struct networklist *list);
+int parse_addresslist(char *string, struct addresslist *list);
+int addr_in_addresslist(char *addr, const struct addresslist *list);
+int parse_hashlist(char *string, struct hashlist *list);
+bool digest_in_hashlist(const string& digest, const struct hashlist *list);
+bool content_blocked(SpamAssassin *assassin, const vector<string>& digests);
+bool part_blocked(void *arg, const string& digest);
+int parse_domainlist(char *string, struct domainlist *list);
+bool host_in_domainlist(const string& host, const struct domainlist *list);
+int parse_rules(char *arg, struct runtime_config *cfg);
+void body_text(void *arg, const char *data, size_t len);
+void body_pass(void *arg, const char *data, size_t len, bool binary);
+void end_attachment(SpamAssassin *assassin);
+bool uri_blocked(SpamAssassin *assassin);
 void parse_debuglevel(char* string);
 char *strlwr(char *str);
 void warnmacro(const char *macro, const char *scope);
 FILE *popenv(char *const argv[], const char *type, pid_t *pid);
+int expand_recipients(const list<string>& rcpts, list<string>& expanded,
+	unordered_map<string, list<string> >& byrcpt);
+void resolve_recipients(SpamAssassin *assassin);
+bool expandcache_lookup(const string& rcpt, list<string>& expanded);
+void expandcache_store(const string& rcpt, const list<string>& expanded);
+string::size_type body_offset(const string& msg);
+string normalize_field(const char *name, const char *value);
+string verdict_key(SpamAssassin *assassin);
+string header_key(SpamAssassin *assassin);
+bool header_verdict_usable(SpamAssassin *assassin, const struct verdict& v, bool onlytag);
+bool replay_verdict(SpamAssassin *assassin, const struct verdict& v, bool onlytag, bool fuzzy);
+void save_verdict(SpamAssassin *assassin, const string& key);
+bool bayes_ham(SpamAssassin *assassin, bool onlytag);
+void learn_verdict(SpamAssassin *assassin);
+bool fuzzy_fingerprint(SpamAssassin *assassin, uint64_t *fp);
+int parse_cachespec(const char *spec, unsigned long *entries, long *ttls, int nttls);
 char *to_nonpermanent(char* instring);
+void inflight_adjust(long delta);
+unsigned long inflight_current();
+bool inflight_over_limit(unsigned long coming = 0);
+unsigned long declared_size(char **envfrom);
+bool session_full();
+bool session_try();
+int session_wait(unsigned long size);
+void session_release();
+unsigned long parse_size(const char *str);
 
 #endif
@@ -0,0 +1,137 @@
+//
+//  $Id$
+//
+//  Streaming URI host extraction for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "uriscan.h"
+
+static inline bool hostchar(int c)
+{
+	return isalnum(c) || c == '.' || c == '-' || c == '_';
+}
+
+/* A run of host name characters has ended: report it if it is the host
+   of a URL */
+static void end_host(struct uriscan *us)
+{
+	string& host = us->host;
+	string::size_type dot;
+
+	if (!us->url && host.compare(0, 4, "www.") != 0)
+		return;
+
+	/* "http://example.com." at the end of a sentence */
+	while (host.size() && (host[host.size() - 1] == '.' || host[host.size() - 1] == '-'))
+		host.erase(host.size() - 1);
+	dot = host.rfind('.');
+	if (dot == string::npos || dot == 0 || host.size() > URISCAN_MAXHOST ||
+	    host.find_first_not_of("0123456789", dot + 1) == string::npos)
+		return;
+
+	/* past the limit a host may be reported twice, but never missed */
+	if (us->seen.count(host))
+		return;
+	if (us->seen.size() < URISCAN_MAXHOSTS)
+		us->seen.insert(host);
+	us->found.push_back(host);
+}
+
+/* Does c end the user:password@host:port of a URL? */
+static inline bool authority_end(int c)
+{
+	return c < 0x20 || c == 0x7f || isspace(c) || strchr("/?#\\\"'<>", c) != NULL;
+}
+
+void uriscan_init(struct uriscan *us)
+{
+	us->host.clear();
+	us->url = false;
+	us->hostend = false;
+	memset(us->last, 0, sizeof(us->last));
+	us->seen.clear();
+	us->found.clear();
+}
+
+void uriscan_update(struct uriscan *us, const char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		int c = (unsigned char)data[i];
+
+		if (!us->url && memcmp(us->last, "://", 3) == 0)
+		{
+			us->url = true;
+			us->hostend = false;
+			us->host.clear();
+		}
+
+		if (us->url)
+		{
+			/* whatever came before the last '@' was the user name
+			   and password; the host ends at a ':' for the port,
+			   or anything else that can't be in it */
+			if (authority_end(c))
+			{
+				end_host(us);
+				us->host.clear();
+				us->url = false;
+			} else if (c == '@')
+			{
+				us->host.clear();
+				us->hostend = false;
+			} else if (hostchar(c) && !us->hostend)
+			{
+				if (us->host.size() <= URISCAN_MAXHOST)
+					us->host += tolower(c);
+			} else
+				us->hostend = true;
+		} else if (hostchar(c))
+		{
+			if (us->host.size() <= URISCAN_MAXHOST)
+				us->host += tolower(c);
+		} else if (us->host.size())
+		{
+			end_host(us);
+			us->host.clear();
+		}
+		us->last[0] = us->last[1];
+		us->last[1] = us->last[2];
+		us->last[2] = c;
+	}
+}
+
+/* The text has ended, and the next piece is unrelated */
+void uriscan_end(struct uriscan *us)
+{
+	if (us->host.size())
+		end_host(us);
+	us->host.clear();
+	us->url = false;
+	us->hostend = false;
+	memset(us->last, 0, sizeof(us->last));
+}
+
+// vim6:ai:noexpandtab
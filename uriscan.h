@@ -0,0 +1,57 @@
+//-*-c++-*-
+//
+//  $Id$
+//
+//  Streaming URI host extraction for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _URISCAN_H
+#define _URISCAN_H
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+using namespace std;
+
+//
+// Picks the host names out of the URLs in decoded text, plain or HTML,
+// fed to it in pieces of any size: whatever follows "://", after the
+// last '@' of any user:password@ before it, and anything starting with
+// "www.".  Numeric hosts are left out, since the -U list is of domains.
+// Every host is reported; the first URISCAN_MAXHOSTS of them only once.
+//
+
+#define URISCAN_MAXHOST 253	/* longest DNS name */
+#define URISCAN_MAXHOSTS 100
+
+struct uriscan
+{
+	string host;		// host name characters so far, lower case
+	bool url;		// in what follows a "://"
+	bool hostend;		// past the host, unless an '@' comes
+	char last[3];		// the three characters before this one
+
+	unordered_set<string> seen;	// hosts reported, up to URISCAN_MAXHOSTS
+	vector<string> found;	// new hosts, for the caller to take
+};
+
+void uriscan_init(struct uriscan *us);
+void uriscan_update(struct uriscan *us, const char *data, size_t len);
+void uriscan_end(struct uriscan *us);
+
+#endif
@@ -0,0 +1,933 @@
+//
+//  $Id$
+//
+//  Verdict cache for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simhash.h"
+#include "verdictcache.h"
+
+struct verdictshard
+{
+	pthread_mutex_t mutex;
+	list<struct verdictentry> lru;	/* most recent first */
+	unordered_map<string, list<struct verdictentry>::iterator> index;
+};
+
+static struct verdictshard shards[VERDICT_SHARDS];
+static unsigned long shard_max;		/* entries per shard, 0 = no cache */
+static long verdict_ttl;
+
+static int shared_fd = -1;		/* -W file, or -1 */
+static char *shared_base;
+static size_t shared_size;
+static uint64_t shared_buckets;
+static long shared_ttl;
+static pthread_mutex_t stripe_mutex[VERDICT_STRIPES];
+
+static struct sockaddr_storage remote_addr;	/* -J server, if remote_len */
+static socklen_t remote_len;
+static int remote_timeout;		/* milliseconds */
+static long remote_ttl;
+static time_t remote_down_until;
+static vector<int> remote_idle;		/* connections not in use */
+static pthread_mutex_t remote_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Keys are digests, so any byte of them spreads evenly */
+static struct verdictshard *shard_for(const string& key)
+{
+	return &shards[(unsigned char)key[0] % VERDICT_SHARDS];
+}
+
+/* Size the cache to hold about entries verdicts for ttl seconds each */
+int verdictcache_init(unsigned long entries, long ttl)
+{
+	int i;
+
+	for (i = 0; i < VERDICT_SHARDS; i++)
+		if (pthread_mutex_init(&shards[i].mutex, NULL))
+			return -1;
+	shard_max = (entries + VERDICT_SHARDS - 1) / VERDICT_SHARDS;
+	verdict_ttl = ttl;
+	return 0;
+}
+
+static bool shared_lookup(const string& key, struct verdict& v);
+static void shared_store(const string& key, const struct verdict& v);
+static bool remote_lookup(const string& key, struct verdict& v);
+static void remote_store(const string& key, const struct verdict& v);
+static void verdictcache_store_local(const string& key, const struct verdict& v);
+
+/* Fetch the verdict for key, from this process's cache or else the
+   shared one.  Returns false on a miss. */
+bool verdictcache_lookup(const string& key, struct verdict& v)
+{
+	struct verdictshard *s;
+	unordered_map<string, list<struct verdictentry>::iterator>::iterator it;
+	bool hit = false;
+
+	if (key.empty())
+		return false;
+	if (shard_max == 0)
+	{
+		if (shared_lookup(key, v))
+			return true;
+		if (!remote_lookup(key, v))
+			return false;
+		shared_store(key, v);
+		return true;
+	}
+	s = shard_for(key);
+	pthread_mutex_lock(&s->mutex);
+	it = s->index.find(key);
+	if (it != s->index.end())
+	{
+		if (it->second->expires > time(NULL))
+		{
+			s->lru.splice(s->lru.begin(), s->lru, it->second);
+			v = it->second->v;
+			hit = true;
+		} else
+		{
+			s->lru.erase(it->second);
+			s->index.erase(it);
+		}
+	}
+	pthread_mutex_unlock(&s->mutex);
+	if (!hit && shared_lookup(key, v))
+	{
+		verdictcache_store_local(key, v);
+		hit = true;
+	} else if (!hit && remote_lookup(key, v))
+	{
+		verdictcache_store_local(key, v);
+		shared_store(key, v);
+		hit = true;
+	}
+	return hit;
+}
+
+/* Remember the verdict for key in this process, pushing out the shard's
+   least recently used entry if it is full */
+static void verdictcache_store_local(const string& key, const struct verdict& v)
+{
+	struct verdictshard *s;
+	unordered_map<string, list<struct verdictentry>::iterator>::iterator it;
+	struct verdictentry entry;
+
+	if (shard_max == 0)
+		return;
+	entry.key = key;
+	entry.v = v;
+	entry.expires = time(NULL) + verdict_ttl;
+
+	s = shard_for(key);
+	pthread_mutex_lock(&s->mutex);
+	it = s->index.find(key);
+	if (it != s->index.end())
+	{
+		s->lru.erase(it->second);
+		s->index.erase(it);
+	}
+	s->lru.push_front(entry);
+	s->index[key] = s->lru.begin();
+	while (s->lru.size() > shard_max)
+	{
+		s->index.erase(s->lru.back().key);
+		s->lru.pop_back();
+	}
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/* Remember the verdict for key, here and in the shared caches */
+void verdictcache_store(const string& key, const struct verdict& v)
+{
+	if (key.empty())
+		return;
+	verdictcache_store_local(key, v);
+	shared_store(key, v);
+	remote_store(key, v);
+}
+
+/* The verdict as the text of a message header: whether spamd replaced
+   the body, then the fields it set */
+string verdict_serialize(const struct verdict& v)
+{
+	string data = v.rewrote_body ? "1\n" : "0\n";
+	vector<pair<string, string> >::size_type i;
+
+	for (i = 0; i < v.fields.size(); i++)
+		data += v.fields[i].first + ": " + v.fields[i].second + "\n";
+	return data;
+}
+
+/* Undo verdict_serialize().  Returns false if data is not a verdict. */
+bool verdict_parse(const string& data, struct verdict& v)
+{
+	string::size_type start, end, colon;
+
+	if (data.size() < 2 || (data[0] != '0' && data[0] != '1') || data[1] != '\n')
+		return false;
+	v.rewrote_body = data[0] == '1';
+	v.fields.clear();
+	for (start = 2; start < data.size(); start = end + 1)
+	{
+		/* a line that starts with white space continues the field */
+		end = start;
+		while ((end = data.find('\n', end)) != string::npos &&
+		       end + 1 < data.size() && (data[end + 1] == ' ' || data[end + 1] == '\t'))
+			end++;
+		if (end == string::npos)
+			return false;
+		colon = data.find(": ", start);
+		if (colon == string::npos || colon > end)
+			return false;
+		v.fields.push_back(make_pair(data.substr(start, colon - start),
+		                             data.substr(colon + 2, end - colon - 2)));
+	}
+	return true;
+}
+
+/* Take stripe's lock, shared (for reading) or not */
+static void stripe_lock(int stripe, bool shared)
+{
+	struct flock fl;
+
+	pthread_mutex_lock(&stripe_mutex[stripe]);
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = shared ? F_RDLCK : F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 1 + stripe;
+	fl.l_len = 1;
+	while (fcntl(shared_fd, F_SETLKW, &fl) < 0 && errno == EINTR)
+		;
+}
+
+static void stripe_unlock(int stripe)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 1 + stripe;
+	fl.l_len = 1;
+	fcntl(shared_fd, F_SETLK, &fl);
+	pthread_mutex_unlock(&stripe_mutex[stripe]);
+}
+
+/* The bucket a key lives in */
+static struct verdictslot *shared_bucket(const string& key, int *stripe)
+{
+	uint64_t h;
+	uint64_t b;
+
+	memcpy(&h, key.data(), sizeof(h));
+	b = h % shared_buckets;
+	*stripe = b % VERDICT_STRIPES;
+	/* slot 0 is the file header */
+	return (struct verdictslot *)shared_base + 1 + b * VERDICT_BUCKET;
+}
+
+static bool shared_lookup(const string& key, struct verdict& v)
+{
+	struct verdictslot *slot;
+	string data;
+	int stripe, i;
+
+	if (shared_fd < 0 || key.size() != sizeof(slot->key))
+		return false;
+	slot = shared_bucket(key, &stripe);
+	stripe_lock(stripe, true);
+	for (i = 0; i < VERDICT_BUCKET; i++, slot++)
+	{
+		if (slot->expires > time(NULL) && memcmp(slot->key, key.data(), sizeof(slot->key)) == 0)
+		{
+			if (slot->length <= sizeof(slot->data))
+				data.assign(slot->data, slot->length);
+			break;
+		}
+	}
+	stripe_unlock(stripe);
+	return !data.empty() && verdict_parse(data, v);
+}
+
+static void shared_store(const string& key, const struct verdict& v)
+{
+	struct verdictslot *slot, *victim = NULL;
+	string data;
+	int stripe, i;
+
+	if (shared_fd < 0 || key.size() != sizeof(slot->key))
+		return;
+	data = verdict_serialize(v);
+	if (data.size() > sizeof(slot->data))
+		return;
+	slot = shared_bucket(key, &stripe);
+	stripe_lock(stripe, false);
+	/* the same key, or else the entry that expires first (free slots
+	   expire at 0) */
+	for (i = 0; i < VERDICT_BUCKET; i++, slot++)
+	{
+		if (memcmp(slot->key, key.data(), sizeof(slot->key)) == 0)
+		{
+			victim = slot;
+			break;
+		}
+		if (!victim || slot->expires < victim->expires)
+			victim = slot;
+	}
+	/* the slot is free while it is being written, so that a process
+	   that dies half way through leaves nothing torn behind */
+	victim->expires = 0;
+	__sync_synchronize();
+	memcpy(victim->key, key.data(), sizeof(victim->key));
+	victim->length = data.size();
+	memcpy(victim->data, data.data(), data.size());
+	__sync_synchronize();
+	victim->expires = time(NULL) + shared_ttl;
+	stripe_unlock(stripe);
+}
+
+/* Make a new cache file laid out as want and put it in place of path,
+   which other processes may still have mapped.  Returns its descriptor
+   or -1. */
+static int verdictfile_create(const char *path, const struct verdictfile_header *want)
+{
+	char pid[32];
+	string tmp;
+	int fd;
+
+	snprintf(pid, sizeof(pid), ".%ld", (long)getpid());
+	tmp = string(path) + pid;
+	fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+	/* a sparse file of free slots */
+	if (ftruncate(fd, shared_size) < 0 ||
+	    pwrite(fd, want, sizeof(*want), 0) != sizeof(*want) ||
+	    rename(tmp.c_str(), path) < 0)
+	{
+		close(fd);
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return fd;
+}
+
+/* Map the shared cache in path, making it (or making a new one in its
+   place, if it is not one or a different size) about size bytes big.
+   What it holds is kept for ttl seconds. */
+int verdictcache_attach(const char *path, unsigned long size, long ttl,
+	char *errbuf, size_t errlen)
+{
+	struct verdictfile_header want, h;
+	struct flock fl;
+	struct stat st, pst;
+	uint64_t buckets = size / (VERDICT_SLOTSIZE * VERDICT_BUCKET);
+	int fd, newfd, i;
+
+	if (sizeof(struct verdictslot) != VERDICT_SLOTSIZE || buckets == 0)
+	{
+		snprintf(errbuf, errlen, "A verdict cache needs at least %d bytes",
+		         VERDICT_SLOTSIZE * VERDICT_BUCKET);
+		return -1;
+	}
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, VERDICTFILE_MAGIC, sizeof(VERDICTFILE_MAGIC));
+	want.version = VERDICTFILE_VERSION;
+	want.byteorder = VERDICTFILE_BYTEORDER;
+	want.slots = buckets * VERDICT_BUCKET;
+	want.slotsize = VERDICT_SLOTSIZE;
+	want.bucket = VERDICT_BUCKET;
+	shared_size = (want.slots + 1) * VERDICT_SLOTSIZE;
+
+	for (;;)
+	{
+		fd = open(path, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+		{
+			snprintf(errbuf, errlen, "Could not open %s: %s", path, strerror(errno));
+			return -1;
+		}
+
+		/* byte 0 keeps two processes from setting the file up at once */
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_len = 1;
+		while (fcntl(fd, F_SETLKW, &fl) < 0)
+		{
+			if (errno != EINTR)
+			{
+				snprintf(errbuf, errlen, "Could not lock %s: %s", path, strerror(errno));
+				close(fd);
+				return -1;
+			}
+		}
+		if (fstat(fd, &st) < 0)
+		{
+			snprintf(errbuf, errlen, "Could not stat %s: %s", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		/* somebody else replaced it while we waited: look again */
+		if (stat(path, &pst) < 0 || pst.st_dev != st.st_dev || pst.st_ino != st.st_ino)
+		{
+			close(fd);
+			continue;
+		}
+		break;
+	}
+	if (st.st_size == 0)
+	{
+		/* a new file, which nobody can have mapped yet */
+		if (ftruncate(fd, shared_size) < 0 ||
+		    pwrite(fd, &want, sizeof(want), 0) != sizeof(want))
+		{
+			snprintf(errbuf, errlen, "Could not set up %s: %s", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	} else if ((size_t)st.st_size != shared_size ||
+	           pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(&h, &want, sizeof(h)) != 0)
+	{
+		/* laid out differently, and perhaps still in use that way by
+		   other processes: never change it under them */
+		if ((newfd = verdictfile_create(path, &want)) < 0)
+		{
+			snprintf(errbuf, errlen, "Could not set up %s: %s", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		close(fd);	/* drops the lock */
+		fd = newfd;
+	}
+	fl.l_type = F_UNLCK;
+	fcntl(fd, F_SETLK, &fl);
+
+	shared_base = (char *)mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shared_base == MAP_FAILED)
+	{
+		snprintf(errbuf, errlen, "Could not map %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < VERDICT_STRIPES; i++)
+		pthread_mutex_init(&stripe_mutex[i], NULL);
+	shared_buckets = buckets;
+	shared_ttl = ttl;
+	shared_fd = fd;
+	return 0;
+}
+
+/* Milliseconds on a clock that doesn't jump */
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Wait until fd is ready for events or the deadline passes */
+static bool remote_wait(int fd, short events, long long deadline)
+{
+	struct pollfd pfd;
+	long long left;
+	int rv;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	do
+	{
+		left = deadline - now_ms();
+		if (left <= 0)
+			return false;
+		rv = poll(&pfd, 1, (int)left);
+	} while (rv < 0 && errno == EINTR);
+	return rv > 0 && !(pfd.revents & (POLLERR | POLLNVAL)) && (pfd.revents & (events | POLLHUP));
+}
+
+/* Give up on the server for a while, saying so once */
+static void remote_failed(const char *what)
+{
+	bool first;
+
+	pthread_mutex_lock(&remote_mutex);
+	first = remote_down_until <= time(NULL);
+	remote_down_until = time(NULL) + VERDICT_REMOTE_RETRY;
+	pthread_mutex_unlock(&remote_mutex);
+	if (first)
+		syslog(LOG_WARNING, "verdict cache server %s; not using it for %d seconds",
+		       what, VERDICT_REMOTE_RETRY);
+}
+
+/* An idle connection to the server if idle is set and there is one,
+   saying so in pooled, or else a new one.  Returns -1 if there is no
+   server or it can't be reached in time. */
+static int remote_get(long long deadline, bool idle, bool& pooled)
+{
+	int fd = -1, err;
+	socklen_t len = sizeof(err);
+
+	pooled = false;
+	if (remote_len == 0)
+		return -1;
+	pthread_mutex_lock(&remote_mutex);
+	if (remote_down_until > time(NULL))
+	{
+		pthread_mutex_unlock(&remote_mutex);
+		return -1;
+	}
+	if (idle && !remote_idle.empty())
+	{
+		fd = remote_idle.back();
+		remote_idle.pop_back();
+		pooled = true;
+	}
+	pthread_mutex_unlock(&remote_mutex);
+	if (fd >= 0)
+		return fd;
+
+	/* close-on-exec from the start, or a spamc started by another
+	   thread in between could inherit it */
+#ifdef SOCK_CLOEXEC
+	fd = socket(remote_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+#else
+	fd = socket(remote_addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+#endif
+	if (connect(fd, (struct sockaddr *)&remote_addr, remote_len) < 0 &&
+	    (errno != EINPROGRESS || !remote_wait(fd, POLLOUT, deadline) ||
+	     getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0))
+	{
+		close(fd);
+		remote_failed("unreachable");
+		return -1;
+	}
+	return fd;
+}
+
+/* Hand back a connection that is in a known state */
+static void remote_put(int fd)
+{
+	pthread_mutex_lock(&remote_mutex);
+	if (remote_idle.size() < VERDICT_REMOTE_IDLE)
+	{
+		remote_idle.push_back(fd);
+		fd = -1;
+	}
+	pthread_mutex_unlock(&remote_mutex);
+	if (fd >= 0)
+		close(fd);
+}
+
+static bool remote_write(int fd, const string& data, long long deadline)
+{
+	string::size_type done = 0;
+	ssize_t n;
+
+	while (done < data.size())
+	{
+		n = write(fd, data.data() + done, data.size() - done);
+		if (n > 0)
+			done += n;
+		else if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return false;
+		else if (!remote_wait(fd, POLLOUT, deadline))
+			return false;
+	}
+	return true;
+}
+
+/* Read what the server has sent, waiting for it until the deadline.
+   Returns the number of bytes added to reply, 0 if the server closed the
+   connection, -1 on an error and -2 if it took too long. */
+static ssize_t remote_read(int fd, string& reply, long long deadline)
+{
+	char buf[4096];
+	ssize_t n;
+
+	for (;;)
+	{
+		n = read(fd, buf, sizeof(buf));
+		if (n > 0)
+		{
+			reply.append(buf, n);
+			return n;
+		}
+		if (n == 0)
+			return 0;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return -1;
+		if (!remote_wait(fd, POLLIN, deadline))
+			return -2;
+	}
+}
+
+/* The server's key for a verdict */
+static string remote_key(const string& key)
+{
+	static const char hex[] = "0123456789abcdef";
+	string k = VERDICT_REMOTE_PREFIX;
+	string::size_type i;
+
+	for (i = 0; i < key.size(); i++)
+	{
+		k += hex[(unsigned char)key[i] >> 4];
+		k += hex[key[i] & 15];
+	}
+	return k;
+}
+
+static bool remote_lookup(const string& key, struct verdict& v)
+{
+	long long deadline = now_ms() + remote_timeout;
+	string request = "get " + remote_key(key) + "\r\n", reply;
+	string::size_type eol;
+	unsigned long length = 0;
+	bool idle = true, pooled;
+	ssize_t n;
+	int fd;
+
+again:
+	if ((fd = remote_get(deadline, idle, pooled)) < 0)
+		return false;
+	reply.clear();
+	if (!remote_write(fd, request, deadline))
+		goto stale;
+
+	/* "END" alone is a miss; a hit is "VALUE key flags length",
+	   the data and "END" */
+	for (;;)
+	{
+		eol = reply.find("\r\n");
+		if (eol != string::npos && reply.compare(0, 5, "END\r\n") == 0)
+			break;
+		if (eol != string::npos && reply.compare(0, 6, "VALUE ") == 0)
+		{
+			string header = reply.substr(0, eol);
+
+			length = strtoul(header.c_str() + header.rfind(' ') + 1, NULL, 10);
+			if (reply.size() >= eol + 2 + length + 7)
+			{
+				if (reply.compare(eol + 2 + length, 7, "\r\nEND\r\n") != 0)
+					goto fail;
+				break;
+			}
+		} else if (eol != string::npos)
+			goto fail;	/* an error, or a reply we didn't ask for */
+
+		n = remote_read(fd, reply, deadline);
+		if (n == -2)
+		{
+			/* too slow this time; the reply would confuse the next
+			   user of this connection */
+			close(fd);
+			return false;
+		}
+		if (n <= 0)
+			goto stale;
+	}
+	remote_put(fd);
+	if (reply.compare(0, 6, "VALUE ") != 0)
+		return false;
+	return verdict_parse(reply.substr(eol + 2, length), v);
+
+stale:
+	/* the server drops connections that have been idle too long, and
+	   we only find out on using one: try again, once, on a new one */
+	if (pooled && reply.empty())
+	{
+		close(fd);
+		idle = false;
+		goto again;
+	}
+fail:
+	close(fd);
+	remote_failed("failed");
+	return false;
+}
+
+/* Store a verdict on the server, waiting up to the timeout for its
+   STORED; a connection that gets anything else is not reused */
+static void remote_store(const string& key, const struct verdict& v)
+{
+	long long deadline = now_ms() + remote_timeout;
+	string data = verdict_serialize(v), request, reply;
+	bool idle = true, pooled;
+	char cmd[128];
+	ssize_t n;
+	int fd;
+
+	/* not "noreply": an error the server sent back anyway would be
+	   taken as the reply to whatever next used the connection */
+	snprintf(cmd, sizeof(cmd), " 0 %ld %lu\r\n", remote_ttl, (unsigned long)data.size());
+	request = "set " + remote_key(key) + cmd + data + "\r\n";
+again:
+	if ((fd = remote_get(deadline, idle, pooled)) < 0)
+		return;
+	reply.clear();
+	if (!remote_write(fd, request, deadline))
+		goto stale;
+	while (reply.find("\r\n") == string::npos)
+	{
+		n = remote_read(fd, reply, deadline);
+		if (n == -2)
+		{
+			close(fd);
+			return;
+		}
+		if (n <= 0)
+			goto stale;
+	}
+	/* anything else, such as the verdict being too big, is the server's
+	   business, but the connection may not be in step any more */
+	if (reply == "STORED\r\n")
+		remote_put(fd);
+	else
+		close(fd);
+	return;
+
+stale:
+	if (pooled && reply.empty())
+	{
+		close(fd);
+		idle = false;
+		goto again;
+	}
+	close(fd);
+	remote_failed("failed");
+}
+
+/* Use the server named by spec, "host[:port][,timeout]" with the
+   timeout in milliseconds.  Verdicts stored there expire after ttl
+   seconds. */
+int verdictcache_remote(const char *spec, long ttl, char *errbuf, size_t errlen)
+{
+	string dest = spec, host, port = "11211";
+	string::size_type comma = dest.find(','), colon;
+	struct addrinfo hints, *res;
+	int rv;
+
+	remote_timeout = 100;
+	if (comma != string::npos)
+	{
+		remote_timeout = atoi(dest.c_str() + comma + 1);
+		dest.erase(comma);
+	}
+	/* [v6 address]:port, host:port or just host */
+	if (dest[0] == '[' && (colon = dest.find(']')) != string::npos)
+	{
+		host = dest.substr(1, colon - 1);
+		if (dest.compare(colon + 1, 1, ":") == 0)
+			port = dest.substr(colon + 2);
+	} else if ((colon = dest.rfind(':')) != string::npos && dest.find(':') == colon)
+	{
+		host = dest.substr(0, colon);
+		port = dest.substr(colon + 1);
+	} else
+		host = dest;
+	if (host.empty() || remote_timeout <= 0)
+	{
+		snprintf(errbuf, errlen, "Could not parse \"%s\" as host[:port][,timeout]", spec);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) != 0)
+	{
+		snprintf(errbuf, errlen, "Could not resolve %s: %s", host.c_str(), gai_strerror(rv));
+		return -1;
+	}
+	memcpy(&remote_addr, res->ai_addr, res->ai_addrlen);
+	remote_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	remote_ttl = ttl;
+	return 0;
+}
+
+static list<struct fuzzyentry> fuzzy_lru;	/* most recent first */
+static unordered_multimap<uint64_t, list<struct fuzzyentry>::iterator> fuzzy_bands;
+static pthread_mutex_t fuzzy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long fuzzy_max;		/* 0 = no index */
+static long fuzzy_ttl;
+static int fuzzy_distance;
+
+/* The index key of band i of a fingerprint: the band's bits, tagged
+   with which band they are */
+static uint64_t fuzzy_band(uint64_t fingerprint, int i)
+{
+	int nbands = fuzzy_distance + 1;
+	int lo = i * 64 / nbands, width = (i + 1) * 64 / nbands - lo;
+	uint64_t mask = width == 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+
+	return ((fingerprint >> lo) & mask) | ((uint64_t)i << 58);
+}
+
+static void fuzzy_erase(list<struct fuzzyentry>::iterator e)
+{
+	int i;
+
+	for (i = 0; i <= fuzzy_distance; i++)
+	{
+		pair<unordered_multimap<uint64_t, list<struct fuzzyentry>::iterator>::iterator,
+		     unordered_multimap<uint64_t, list<struct fuzzyentry>::iterator>::iterator> r;
+
+		r = fuzzy_bands.equal_range(fuzzy_band(e->fingerprint, i));
+		for (; r.first != r.second; ++r.first)
+			if (r.first->second == e)
+			{
+				fuzzy_bands.erase(r.first);
+				break;
+			}
+	}
+	fuzzy_lru.erase(e);
+}
+
+/* Keep about entries verdicts for ttl seconds each, matching
+   fingerprints up to distance bits apart */
+int fuzzycache_init(unsigned long entries, long ttl, int distance)
+{
+	if (distance < 0 || distance > FUZZY_MAXDISTANCE)
+		return -1;
+	fuzzy_max = entries;
+	fuzzy_ttl = ttl;
+	fuzzy_distance = distance;
+	return 0;
+}
+
+/* Fetch the verdict on the closest message to fingerprint that was for
+   the same user.  Returns false if there is none close enough. */
+bool fuzzycache_lookup(uint64_t fingerprint, const string& user, struct verdict& v, int *distance)
+{
+	list<struct fuzzyentry>::iterator best = fuzzy_lru.end();
+	int bestdist = fuzzy_distance + 1, i;
+	time_t now = time(NULL);
+
+	if (fuzzy_max == 0)
+		return false;
+	pthread_mutex_lock(&fuzzy_mutex);
+	for (i = 0; i <= fuzzy_distance && bestdist > 0; i++)
+	{
+		pair<unordered_multimap<uint64_t, list<struct fuzzyentry>::iterator>::iterator,
+		     unordered_multimap<uint64_t, list<struct fuzzyentry>::iterator>::iterator> r;
+
+		r = fuzzy_bands.equal_range(fuzzy_band(fingerprint, i));
+		for (; r.first != r.second; ++r.first)
+		{
+			list<struct fuzzyentry>::iterator e = r.first->second;
+			int d = simhash_distance(e->fingerprint, fingerprint);
+
+			if (d < bestdist && e->expires > now && e->user == user)
+			{
+				best = e;
+				bestdist = d;
+			}
+		}
+	}
+	if (best != fuzzy_lru.end())
+	{
+		fuzzy_lru.splice(fuzzy_lru.begin(), fuzzy_lru, best);
+		v = best->v;
+		*distance = bestdist;
+	}
+	pthread_mutex_unlock(&fuzzy_mutex);
+	return bestdist <= fuzzy_distance;
+}
+
+/* Add a verdict to the index, replacing one for the same fingerprint and
+   user and pushing out the least recently used entry if it is full */
+void fuzzycache_store(uint64_t fingerprint, const string& user, const struct verdict& v)
+{
+	struct fuzzyentry entry;
+	pair<unordered_multimap<uint64_t, list<struct fuzzyentry>::iterator>::iterator,
+	     unordered_multimap<uint64_t, list<struct fuzzyentry>::iterator>::iterator> r;
+	int i;
+
+	if (fuzzy_max == 0)
+		return;
+	entry.fingerprint = fingerprint;
+	entry.user = user;
+	entry.v = v;
+	entry.expires = time(NULL) + fuzzy_ttl;
+
+	pthread_mutex_lock(&fuzzy_mutex);
+	r = fuzzy_bands.equal_range(fuzzy_band(fingerprint, 0));
+	for (; r.first != r.second; ++r.first)
+		if (r.first->second->fingerprint == fingerprint && r.first->second->user == user)
+		{
+			fuzzy_erase(r.first->second);
+			break;
+		}
+	fuzzy_lru.push_front(entry);
+	for (i = 0; i <= fuzzy_distance; i++)
+		fuzzy_bands.insert(make_pair(fuzzy_band(fingerprint, i), fuzzy_lru.begin()));
+	while (fuzzy_lru.size() > fuzzy_max)
+		fuzzy_erase(--fuzzy_lru.end());
+	pthread_mutex_unlock(&fuzzy_mutex);
+}
+
+/* Forget every verdict, for when the settings they were made under change */
+void verdictcache_flush()
+{
+	int i;
+
+	if (shard_max)
+	{
+		for (i = 0; i < VERDICT_SHARDS; i++)
+		{
+			pthread_mutex_lock(&shards[i].mutex);
+			shards[i].lru.clear();
+			shards[i].index.clear();
+			pthread_mutex_unlock(&shards[i].mutex);
+		}
+	}
+	pthread_mutex_lock(&fuzzy_mutex);
+	fuzzy_lru.clear();
+	fuzzy_bands.clear();
+	pthread_mutex_unlock(&fuzzy_mutex);
+}
+
+// vim6:ai:noexpandtab
@@ -0,0 +1,143 @@
+//-*-c++-*-
+//
+//  $Id$
+//
+//  Verdict cache for SpamAss-Milter
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; if not, write to the Free Software
+//   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+#ifndef _VERDICTCACHE_H
+#define _VERDICTCACHE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+//
+// What spamd made of a message, kept under a digest of its content so
+// that the next copy of the same message can be handled without asking
+// spamd again.  The cache is split into shards, each an LRU list with
+// its own lock, so that threads finishing different messages seldom
+// wait for each other.
+//
+
+/* the header fields spamd set, as retrieve_field() returns them */
+struct verdict
+{
+	vector<pair<string, string> > fields;
+	bool rewrote_body;	// spamd replaced the body (report_safe)
+};
+
+struct verdictentry
+{
+	string key;
+	struct verdict v;
+	time_t expires;
+};
+
+#define VERDICT_SHARDS 16
+
+//
+// The near-duplicate index finds verdicts on messages whose body
+// fingerprints (see simhash.h) differ in at most a few bits.  Each
+// fingerprint is split into one more band than the bits allowed to
+// differ, so a near duplicate agrees with it entirely on at least one
+// band, and only entries that do are compared.
+//
+
+struct fuzzyentry
+{
+	uint64_t fingerprint;
+	string user;		// spamc -u user the verdict was for
+	struct verdict v;
+	time_t expires;
+};
+
+#define FUZZY_MAXDISTANCE 15
+
+//
+// The shared tier (-W) is a file every milter process on the host maps,
+// so verdicts are shared between them and outlive restarts.  It holds a
+// header and then fixed-size slots, grouped in buckets of
+// VERDICT_BUCKET; a key can only be in the bucket its digest picks, and
+// a full bucket gives up the entry that expires first.  The buckets are
+// guarded by VERDICT_STRIPES locks, each a mutex between the threads of
+// a process and an fcntl() lock on one byte of the file between
+// processes.
+//
+// Integers are in the byte order of the machine that made the file.
+//
+
+#define VERDICTFILE_MAGIC "SAMVRDC"
+#define VERDICTFILE_VERSION 1
+#define VERDICTFILE_BYTEORDER 0x01020304
+#define VERDICT_SLOTSIZE 4096
+#define VERDICT_BUCKET 8
+#define VERDICT_STRIPES 64
+
+struct verdictfile_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t slots;		// a multiple of VERDICT_BUCKET
+	uint32_t slotsize;
+	uint32_t bucket;
+};
+
+/* one cached verdict; the header takes up the first slot of the file */
+struct verdictslot
+{
+	uint8_t key[32];	// SHA-256 of the message
+	int64_t expires;	// 0 if the slot is free
+	uint32_t length;	// of data
+	uint32_t unused;
+	char data[VERDICT_SLOTSIZE - 48];	// verdict_serialize()d
+};
+
+//
+// The remote tier (-J) is a memcached, or anything that speaks its text
+// protocol, shared by a fleet of MX hosts.  Verdicts are stored with a
+// plain "set", not "set ... noreply": the store waits, as a lookup does,
+// for the server's reply or the -J timeout, so that a connection is only
+// kept for reuse once nothing more can arrive on it.  After a failure
+// the server is left alone for VERDICT_REMOTE_RETRY seconds.
+//
+
+#define VERDICT_REMOTE_PREFIX "spamass-milter:"
+#define VERDICT_REMOTE_RETRY 30
+#define VERDICT_REMOTE_IDLE 8	/* idle connections kept open */
+
+int verdictcache_init(unsigned long entries, long ttl);
+int verdictcache_attach(const char *path, unsigned long size, long ttl,
+	char *errbuf, size_t errlen);
+int verdictcache_remote(const char *spec, long ttl, char *errbuf, size_t errlen);
+string verdict_serialize(const struct verdict& v);
+bool verdict_parse(const string& data, struct verdict& v);
+bool verdictcache_lookup(const string& key, struct verdict& v);
+void verdictcache_store(const string& key, const struct verdict& v);
+int fuzzycache_init(unsigned long entries, long ttl, int distance);
+bool fuzzycache_lookup(uint64_t fingerprint, const string& user, struct verdict& v, int *distance);
+void fuzzycache_store(uint64_t fingerprint, const string& user, const struct verdict& v);
+void verdictcache_flush();
+
+#endif